@@ -0,0 +1,269 @@
+/* Power manager host benchmark and replay harness
+
+   Runs powerManager.c natively against a corpus of recorded homeassistant/Power
+   payloads. It benchmarks the cJSON and streaming decoders and the relay
+   decision, then replays the corpus through a controller mode and reports the
+   relay decisions it makes.
+
+   The corpus has one payload per line. A line may start with a timestamp in
+   milliseconds followed by a space, otherwise samples are taken as 1 second
+   apart. Blank lines and lines starting with # are ignored.
+
+   Usage: powerBench [-n iterations] [-m open|pi] [-d] corpus...
+     -n  benchmark passes over the corpus (default 100)
+     -m  controller mode to replay (default open)
+     -d  print every decision of the replay as CSV
+
+   The replay feeds each decision back in as the current relay value. The
+   recorded power values don't react to it, so treat the replay as a
+   comparison between controllers on the same input, not a plant model.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "powerManager.h"
+
+const char* TAG = "powerBench";
+esp_log_level_t hostLogLevel = ESP_LOG_WARN;
+unsigned long hostLogCalls = 0;
+
+#define MAX_SAMPLES 200000
+
+typedef struct {
+    int64_t timeMs;
+    char* payload;
+    int len;
+} sample_T;
+
+static sample_T samples[MAX_SAMPLES];
+static int sampleCount = 0;
+static unsigned long allocations = 0;
+
+// -----------------------------------------------
+// Counting allocator for cJSON
+// -----------------------------------------------
+static void* CountingMalloc(size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+static int64_t NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// -----------------------------------------------
+// Load a corpus file, one payload per line
+// -----------------------------------------------
+static bool LoadCorpus(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { fprintf(stderr, "Can't open %s\n", path); return false; }
+
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) > 0 && sampleCount < MAX_SAMPLES) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) { line[--n] = 0; }
+        char* p = line;
+        while (isspace((unsigned char)*p)) { p++; }
+        if (*p == 0 || *p == '#') { continue; }
+
+        int64_t timeMs = (sampleCount > 0) ? samples[sampleCount - 1].timeMs + 1000 : 0;
+        if (isdigit((unsigned char)*p)) {
+            char* end;
+            timeMs = strtoll(p, &end, 10);
+            p = end;
+            while (isspace((unsigned char)*p)) { p++; }
+        }
+        samples[sampleCount].timeMs = timeMs;
+        samples[sampleCount].payload = strdup(p);
+        samples[sampleCount].len = strlen(p);
+        sampleCount++;
+    }
+    free(line);
+    fclose(f);
+    return true;
+}
+
+// -----------------------------------------------
+// Benchmark one decoder over the corpus
+// -----------------------------------------------
+static void BenchDecoder(const char* name, bool streaming, int iterations)
+{
+    powerManager_T pm;
+    unsigned long failures = 0;
+    PowerManager_Initialise(&pm);
+
+    allocations = 0;
+    hostLogCalls = 0;
+    int64_t start = NowNs();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < sampleCount; i++) {
+            int status = streaming ? PowerManager_DecodeStream(&pm, samples[i].payload, samples[i].len)
+                                   : PowerManager_Decode(&pm, samples[i].payload);
+            if (status != 0) { failures++; }
+        }
+    }
+    double ops = (double)iterations * sampleCount;
+    double ns = (NowNs() - start) / ops;
+    printf("%-24s %10.0f ns/op %8.2f allocs/op %6.2f logs/op %8lu failures\n",
+        name, ns, allocations / ops, hostLogCalls / ops, failures / iterations);
+}
+
+// -----------------------------------------------
+// Check both decoders agree on every sample
+// -----------------------------------------------
+static void CompareDecoders(void)
+{
+    int mismatches = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        powerManager_T a, b;
+        memset(&a, 0, sizeof(a));   // Padding too, for the memcmp
+        memset(&b, 0, sizeof(b));
+        PowerManager_Initialise(&a);
+        PowerManager_Initialise(&b);
+        int sa = PowerManager_Decode(&a, samples[i].payload);
+        int sb = PowerManager_DecodeStream(&b, samples[i].payload, samples[i].len);
+        if (sa != sb || (sa == 0 && memcmp(&a, &b, sizeof(a)) != 0)) {
+            if (mismatches++ < 5) { fprintf(stderr, "Decoders disagree on line %d: %s\n", i + 1, samples[i].payload); }
+        }
+    }
+    printf("%-24s %10d mismatches\n", "decoder agreement", mismatches);
+}
+
+// -----------------------------------------------
+// Benchmark the open loop relay decision
+// -----------------------------------------------
+static void BenchDecision(int iterations)
+{
+    static powerManager_T decoded[MAX_SAMPLES];
+    int count = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        PowerManager_Initialise(&decoded[count]);
+        if (PowerManager_DecodeStream(&decoded[count], samples[i].payload, samples[i].len) == 0) { count++; }
+    }
+    if (count == 0) { return; }
+
+    volatile relayValue_T sink = 0;
+    hostLogCalls = 0;
+    PowerManager_HistoryInitialise();
+    int64_t start = NowNs();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < count; i++) {
+            powerManager_T pm = decoded[i];
+            PowerManager_HistoryAdd(&pm, sink);
+            sink = CalculateRelaySettings(&pm, sink);
+        }
+    }
+    double ops = (double)iterations * count;
+    printf("%-24s %10.0f ns/op %8.2f allocs/op %6.2f logs/op\n", "CalculateRelaySettings", (NowNs() - start) / ops, 0.0, hostLogCalls / ops);
+}
+
+// -----------------------------------------------
+// Replay the corpus through a controller and summarise its decisions
+// -----------------------------------------------
+static void Replay(controllerMode_T mode, bool printDecisions)
+{
+    exportControllerConfig_T cfg = {
+        .kp = 1.0, .ki = 0.1, .deadbandkW = 0.1, .targetGridkW = 0.05, .minDwellMs = 10000, .maxStepsPerUpdate = 3
+    };
+    exportController_T ctl;
+    powerManager_T pm;
+    unsigned long stepTimeMs[RELAY_CHANNELS][RELAY_STEPS] = { { 0 } };
+    int transitions = 0;
+    relayValue_T relay = 0;
+
+    ExportController_Initialise(&ctl, &cfg);
+    PowerManager_Initialise(&pm);
+    PowerManager_HistoryInitialise();
+    if (printDecisions) { printf("timeMs,gridkW,solarkW,housekW,relay\n"); }
+    for (int i = 0; i < sampleCount; i++) {
+        if (PowerManager_DecodeStream(&pm, samples[i].payload, samples[i].len) != 0) { continue; }
+        if (i + 1 < sampleCount) {
+            for (int c = 0; c < RELAY_CHANNELS; c++) { stepTimeMs[c][RELAY_VALUE_CODE(relay, c)] += samples[i + 1].timeMs - samples[i].timeMs; }
+        }
+
+        relayValue_T next;
+        pm.receivedUs = samples[i].timeMs * 1000;
+        PowerManager_HistoryAdd(&pm, relay);
+        if (mode == CONTROLLER_MODE_PI) {
+            next = ExportController_Update(&ctl, &pm, relay, samples[i].timeMs * 1000);
+        } else {
+            powerManager_T copy = pm;
+            next = CalculateRelaySettings(&copy, relay);
+        }
+        if (next != relay) { transitions++; }
+        relay = next;
+        if (printDecisions) { printf("%lld,%.3f,%.3f,%.3f,%0*X\n", (long long)samples[i].timeMs, pm.gridPowerkW, pm.solarPowerkW, pm.housePowerkW, RELAY_CHANNELS, relay); }
+    }
+
+    int64_t spanMs = (sampleCount > 1) ? samples[sampleCount - 1].timeMs - samples[0].timeMs : 0;
+    printf("%-24s %10d transitions over %.1f h (%.1f per hour)\n", (mode == CONTROLLER_MODE_PI) ? "replay pi" : "replay open loop",
+        transitions, spanMs / 3600000.0, (spanMs > 0) ? transitions * 3600000.0 / spanMs : 0.0);
+    for (int c = 0; c < RELAY_CHANNELS; c++) {
+        char label[32] = "time at relay step %";
+        if (RELAY_CHANNELS > 1) { snprintf(label, sizeof(label), "time at relay %d step %%", c); }
+        printf("%-24s", label);
+        for (int r = 0; r < RELAY_STEPS; r++) { printf(" %u:%.0f", r, (spanMs > 0) ? 100.0 * stepTimeMs[c][r] / spanMs : 0.0); }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 100;
+    controllerMode_T mode = CONTROLLER_MODE_OPEN_LOOP;
+    bool printDecisions = false;
+
+    if (!PowerManager_RelayModelInitialise()) { return 1; }
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) { iterations = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) { i++; mode = (strcmp(argv[i], "pi") == 0) ? CONTROLLER_MODE_PI : CONTROLLER_MODE_OPEN_LOOP; }
+        else if (strcmp(argv[i], "-d") == 0) { printDecisions = true; }
+        else { fprintf(stderr, "Usage: %s [-n iterations] [-m open|pi] [-d] corpus...\n", argv[0]); return 1; }
+    }
+    if (i == argc) { fprintf(stderr, "Usage: %s [-n iterations] [-m open|pi] [-d] corpus...\n", argv[0]); return 1; }
+    for (; i < argc; i++) {
+        if (!LoadCorpus(argv[i])) { return 1; }
+    }
+    if (iterations < 1) { iterations = 1; }
+    printf("%d samples, %d iterations\n", sampleCount, iterations);
+
+    cJSON_Hooks hooks = { CountingMalloc, free };
+    cJSON_InitHooks(&hooks);
+    hostLogLevel = ESP_LOG_NONE;
+
+    if (!printDecisions) {
+        BenchDecoder("PowerManager_Decode", false, iterations);
+        BenchDecoder("PowerManager_DecodeStream", true, iterations);
+        CompareDecoders();
+        BenchDecision(iterations);
+    }
+    Replay(mode, printDecisions);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __ESP_LOG_H__
+#define __ESP_LOG_H__
+
+// Host stand-in for ESP-IDF's esp_log.h, so the portable modules build off target.
+// Every log call is counted, whether or not it's printed, so benchmarks can report logging cost.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    ESP_LOG_NONE = 0,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+extern esp_log_level_t hostLogLevel;
+extern unsigned long hostLogCalls;
+
+#define HOST_LOG(level, letter, tag, format, ...) do { \
+        hostLogCalls++; \
+        if ((level) <= hostLogLevel) { fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); } \
+    } while (0)
+
+#define ESP_LOG_LEVEL(level, tag, format, ...) do { \
+        hostLogCalls++; \
+        if ((level) <= hostLogLevel) { fprintf(stderr, "%c (%s) " format "\n", "NEWIDV"[level], tag, ##__VA_ARGS__); } \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif // __ESP_LOG_H__
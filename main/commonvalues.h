@@ -1,6 +1,37 @@
 #ifndef __COMMONVALUES_H__
 #define __COMMONVALUES_H__
 
+#include <stdint.h>
+
 extern const char* TAG;
 
+// Relay channels, one DRM relay group each, usually one per Envoy. Each channel has its own
+// pins (relayOutput.h), relay power table (powerManager.c) and Home Assistant number entity.
+#define RELAY_CHANNELS 1
+#define RELAY_CODE_BITS 4               // DRM relay codes are 0 to 15
+
+// A relay value packs one relay code per channel, channel 0 in the low bits. With a single
+// channel it's just the relay code.
+typedef uint16_t relayValue_T;
+_Static_assert(RELAY_CHANNELS >= 1 && RELAY_CHANNELS * RELAY_CODE_BITS <= 16, "Every channel's relay code must fit in a relayValue_T");
+#define RELAY_VALUE_MAX ((relayValue_T)((1UL << (RELAY_CHANNELS * RELAY_CODE_BITS)) - 1))
+#define RELAY_VALUE_CODE(value, channel) (((value) >> ((channel) * RELAY_CODE_BITS)) & 0x0F)
+#define RELAY_VALUE_WITH_CODE(value, channel, code) ((relayValue_T)(((value) & ~(0x0FU << ((channel) * RELAY_CODE_BITS))) \
+    | (((code) & 0x0FU) << ((channel) * RELAY_CODE_BITS))))
+#define RELAY_VALUE_ALL(code) ((relayValue_T)(((code) & 0x0FU) * (RELAY_VALUE_MAX / 0x0FU)))  // The same code on every channel
+
+// Tags for modules with their own runtime log level, see logControl.h
+#define POWER_TAG "power"
+#define MQTT_TAG "mqtt"
+
+// Operating modes, offered in this order by the mode select entity
+typedef enum {
+    OPERATING_MODE_MANUAL = 0,  // Relays follow the relay number entity
+    OPERATING_MODE_AUTO,        // Curtail export automatically
+    OPERATING_MODE_OFF,         // Don't curtail, relays at 0 for maximum solar output
+    OPERATING_MODE_COUNT
+} operatingMode_T;
+
+#define OPERATING_MODE_NAMES { "manual", "auto", "off" }
+
 #endif // __COMMONVALUES_H__
\ No newline at end of file
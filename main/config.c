@@ -19,11 +19,16 @@
 
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 #include "esp_spiffs.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
 #include <cJSON.h>
 
 #include "lwip/sockets.h"
@@ -31,11 +36,22 @@
 #include "lwip/netdb.h"
 #include "mqtt_client.h"
 
+#include "commonvalues.h"
 #include "config.h"
+#include "powerManager.h"
+#include "powerPoll.h"
 #include "utilities.h"
 
 Configuration config;
 
+// Stored alongside the Configuration in NVS
+typedef struct {
+    uint32_t magic;
+    uint16_t schema;        // CONFIG_SCHEMA_VERSION
+    uint16_t size;          // sizeof(Configuration)
+    uint32_t crc;           // CRC32 of the Configuration
+} configBlobHeader_T;
+
 void SetDefaultConfig()
 {
     // Create the default config file
@@ -49,114 +65,406 @@ void SetDefaultConfig()
     strcpy(config.mqttUsername, "Not Set!");
     strcpy(config.mqttPassword, "Not Set!");
     config.battVCalFactor = 1.0;
+    config.controllerMode = 0;  // Open loop
+    config.ctlKp = 1.0;
+    config.ctlKi = 0.1;
+    config.ctlDeadbandkW = 0.1;
+    config.ctlTargetGridkW = 0.05;
+    config.ctlMinDwellMs = 10000;
+    config.ctlMaxStepsPerUpdate = 3;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) { config.maxSolarkW[channel] = POWER_DEFAULT_MAX_SOLAR_KW; }
+    config.maxBatteryChargekW = POWER_DEFAULT_MAX_BATTERY_CHARGE_KW;
+    config.relayCalibrationEnabled = true;
+    config.relayCalibrationSettleMs = 15000;
+    config.relayCalibrationWindowMs = 60000;
+    config.controlTaskCore = 1;     // App core, away from WiFi and MQTT on the protocol core
+    config.controlTaskPriority = 6; // Above the MQTT task so relay updates preempt it
+    config.mqttTaskPriority = 5;
+    config.mqttTaskStack = 6144;
+    config.mqttReconnectBaseMs = 500;
+    config.mqttReconnectMaxMs = 60000;
+    config.mqttRebuildAfterFailures = 10;
+    config.wifiFastConnect = true;
+    strcpy(config.staticIP, "");
+    strcpy(config.staticNetmask, "");
+    strcpy(config.staticGateway, "");
+    strcpy(config.staticDNS, "");
+    config.relayRestoreMaxAgeS = 3600;
+    config.relayRestoreUnknownAge = true;
+    config.availabilityPeriodMs = 10000;
+    config.powerMaxAgeMs = 30000;
+    config.powerStaleRelayValue = 0; // Maximum solar output, the same as curtailment disabled
+    config.relayMinDwellMs = 5000;
+    config.relayPublishSettleMs = 1000;
+    config.metricsPeriodMs = 60000;
+    strcpy(config.logLevels, "");
+    strcpy(config.envoyUrl, "");    // Power comes from Home Assistant
+    strcpy(config.envoyToken, "");
+    strcpy(config.envoyCert, "");
+    config.envoyPollMs = 1000;
+    config.operatingMode = OPERATING_MODE_MANUAL;
+    config.policyEnabled = false;   // Curtail whatever the price
+    config.policyExportThreshold = 0.0;
+    config.idleModeEnabled = false; // Always at full power
+    config.idleSolarkW = 0.0;
+    config.idleEnterMs = 600000;
+    config.idleListenInterval = 10;
+    config.idlePollMs = 10000;
 }
 
-// Loads the configuration from a file
-bool LoadConfiguration()
+// -----------------------------------------------
+// Mount the SPIFFS partition holding the JSON configuration, the first time it's needed
+// -----------------------------------------------
+static bool MountStorage(void)
 {
-    // Open file for reading
-    FILE *f = fopen(filename, "r");
-    if (f == NULL)
-    {
-        printf("Failed to open file for reading.\r\n");
+    static bool mounted = false;
+    if (mounted) { return true; }
+
+    esp_vfs_spiffs_conf_t spiffs_conf = {
+        .base_path = "/spiffs",
+        .partition_label = NULL,
+        .max_files = 5,
+        .format_if_mount_failed = true};
+    esp_err_t err = esp_vfs_spiffs_register(&spiffs_conf);
+    if (err != ESP_OK) {
+        printf("SPIFFS mount failed: %s\r\n", esp_err_to_name(err));
         return false;
     }
+    mounted = true;
+    return true;
+}
 
-    // Initialise the json document
-    char doc[2048];
-    memset(doc, '\0', sizeof(doc));
-
-    // Read the settings file
-    int p = 0;
-    while(1) {
-      char c = fgetc(f);
-      if( feof(f) || p >= sizeof(doc) - 1) { break; } 
-      doc[p++] = c;
+// -----------------------------------------------
+// Read an optional integer setting, which must be from min to max. Out of range
+// values are left unchanged and the setting's name added to invalid.
+// -----------------------------------------------
+static void DecodeIntInRange(const cJSON* json, const char* name, int min, int max, int* value, char* invalid, size_t invalidLen)
+{
+    const cJSON* item = cJSON_GetObjectItemCaseSensitive(json, name);
+    if (!cJSON_IsNumber(item)) { return; }
+    if (item->valuedouble >= min && item->valuedouble <= max) {
+        *value = item->valueint;
+    } else {
+        strlcat(invalid, name, invalidLen);
+        strlcat(invalid, " ", invalidLen);
     }
-    fclose(f);
+}
+
+// -----------------------------------------------
+// Decode the configuration from a JSON document, or a patch of just some of its fields
+//
+// Out of range values are left at their defaults in a document, but fail a patch.
+// -----------------------------------------------
+static bool DecodeConfigurationJSON(Configuration* cfg, const char* doc, size_t len, bool patch, char* invalidString, size_t invalidLen)
+{
+    invalidString[0] = 0;   // Optional fields with out of range values
 
     // Parse the json config document
-    cJSON* settingsJSON = cJSON_Parse(doc);
+    cJSON* settingsJSON = cJSON_ParseWithLength(doc, len);
     if (settingsJSON == NULL) {
         printf("Error parsing json config file.\r\n");
         return false;
     }
 
     // Extract the config information
-    char errorString[80];
+    char errorString[128];   // Room for every required field name
     memset (errorString, '\0', sizeof(errorString));
     errorString[0] = ' ';
 
     cJSON* item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "configOK");
     if (cJSON_IsBool(item)) {
-        config.configOK = (bool)(item->valueint);
+        cfg->configOK = (bool)(item->valueint);
     } else { strcat(errorString, "configOK "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "Name");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.Name, item->valuestring);
+        strlcpy(cfg->Name, item->valuestring, sizeof(cfg->Name));
     } else { strcat(errorString, "Name "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "DeviceID");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.DeviceID, item->valuestring);
+        strlcpy(cfg->DeviceID, item->valuestring, sizeof(cfg->DeviceID));
     } else { strcat(errorString, "DeviceID "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "UID");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.UID, item->valuestring);
+        strlcpy(cfg->UID, item->valuestring, sizeof(cfg->UID));
     } else { strcat(errorString, "UID "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "battVCalFactor");
     if (cJSON_IsNumber(item)) {
-        config.battVCalFactor = (float)(item->valuedouble);
+        cfg->battVCalFactor = (float)(item->valuedouble);
     } else { strcat(errorString, "battVCalFactor "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "ssid");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.ssid, item->valuestring);
+        strlcpy(cfg->ssid, item->valuestring, sizeof(cfg->ssid));
     } else { strcat(errorString, "ssid "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "pass");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.pass, item->valuestring);
+        strlcpy(cfg->pass, item->valuestring, sizeof(cfg->pass));
     } else { strcat(errorString, "pass "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqttBrokerUrl");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.mqttBrokerUrl, item->valuestring);
+        strlcpy(cfg->mqttBrokerUrl, item->valuestring, sizeof(cfg->mqttBrokerUrl));
     } else { strcat(errorString, "mqttBrokerUrl "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqttUsername");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.mqttUsername, item->valuestring);
+        strlcpy(cfg->mqttUsername, item->valuestring, sizeof(cfg->mqttUsername));
     } else { strcat(errorString, "mqttUsername "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "mqttPassword");
     if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strcpy(config.mqttPassword, item->valuestring);
+        strlcpy(cfg->mqttPassword, item->valuestring, sizeof(cfg->mqttPassword));
     } else { strcat(errorString, "mqttPassword "); } // record which value failed
 
     item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "retries");
     if (cJSON_IsNumber(item)) {
-        config.retries = item->valueint;
+        cfg->retries = item->valueint;
     } else { strcat(errorString, "retries "); } // record which value failed
 
-    // Report any decoding errors
-    if (strlen(errorString) != 1) {
-        printf("Error decoding these configuration elements: %s\r\n", errorString);
-        return false;
+    // Optional controller settings. Older config files won't have these, so keep the defaults.
+    DecodeIntInRange(settingsJSON, "controllerMode", CONTROLLER_MODE_OPEN_LOOP, CONTROLLER_MODE_PI, &cfg->controllerMode, invalidString, invalidLen);
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "ctlKp");
+    if (cJSON_IsNumber(item)) { cfg->ctlKp = (float)(item->valuedouble); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "ctlKi");
+    if (cJSON_IsNumber(item)) { cfg->ctlKi = (float)(item->valuedouble); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "ctlDeadbandkW");
+    if (cJSON_IsNumber(item)) { cfg->ctlDeadbandkW = (float)(item->valuedouble); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "ctlTargetGridkW");
+    if (cJSON_IsNumber(item)) { cfg->ctlTargetGridkW = (float)(item->valuedouble); }
+    DecodeIntInRange(settingsJSON, "ctlMinDwellMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->ctlMinDwellMs, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "ctlMaxStepsPerUpdate", 1, 255, &cfg->ctlMaxStepsPerUpdate, invalidString, invalidLen);
+
+    // Optional system limits. maxSolarkW is a number with one relay channel, or an array of one per channel.
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "maxSolarkW");
+    if (cJSON_IsNumber(item) && item->valuedouble > 0.0) { cfg->maxSolarkW[0] = (float)(item->valuedouble); }
+    if (cJSON_IsArray(item) && cJSON_GetArraySize(item) == RELAY_CHANNELS) {
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+            cJSON* element = cJSON_GetArrayItem(item, channel);
+            if (cJSON_IsNumber(element) && element->valuedouble > 0.0) { cfg->maxSolarkW[channel] = (float)(element->valuedouble); }
+        }
+    }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "maxBatteryChargekW");
+    if (cJSON_IsNumber(item) && item->valuedouble >= 0.0) { cfg->maxBatteryChargekW = (float)(item->valuedouble); }
+
+    // Optional relay power curve calibration settings
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "relayCalibrationEnabled");
+    if (cJSON_IsBool(item)) { cfg->relayCalibrationEnabled = (bool)(item->valueint); }
+    DecodeIntInRange(settingsJSON, "relayCalibrationSettleMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->relayCalibrationSettleMs, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "relayCalibrationWindowMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->relayCalibrationWindowMs, invalidString, invalidLen);
+
+    // Optional task layout settings
+    DecodeIntInRange(settingsJSON, "controlTaskCore", -1, portNUM_PROCESSORS - 1, &cfg->controlTaskCore, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "controlTaskPriority", 1, configMAX_PRIORITIES - 1, &cfg->controlTaskPriority, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "mqttTaskPriority", 1, configMAX_PRIORITIES - 1, &cfg->mqttTaskPriority, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "mqttTaskStack", CONFIG_TASK_STACK_MIN, CONFIG_TASK_STACK_MAX, &cfg->mqttTaskStack, invalidString, invalidLen);
+
+    // Optional MQTT reconnect settings
+    DecodeIntInRange(settingsJSON, "mqttReconnectBaseMs", CONFIG_MQTT_RECONNECT_MIN_MS, CONFIG_MQTT_RECONNECT_MAX_MS,
+        &cfg->mqttReconnectBaseMs, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "mqttReconnectMaxMs", CONFIG_MQTT_RECONNECT_MIN_MS, CONFIG_MQTT_RECONNECT_MAX_MS,
+        &cfg->mqttReconnectMaxMs, invalidString, invalidLen);
+    if (cfg->mqttReconnectMaxMs < cfg->mqttReconnectBaseMs) {
+        strlcat(invalidString, "mqttReconnectMaxMs ", invalidLen);
+        cfg->mqttReconnectMaxMs = cfg->mqttReconnectBaseMs;
     }
+    DecodeIntInRange(settingsJSON, "mqttRebuildAfterFailures", 0, 1000, &cfg->mqttRebuildAfterFailures, invalidString, invalidLen);
+
+    // Optional WiFi fast connect and static IP settings
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "wifiFastConnect");
+    if (cJSON_IsBool(item)) { cfg->wifiFastConnect = (bool)(item->valueint); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "staticIP");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->staticIP, item->valuestring, sizeof(cfg->staticIP)); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "staticNetmask");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->staticNetmask, item->valuestring, sizeof(cfg->staticNetmask)); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "staticGateway");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->staticGateway, item->valuestring, sizeof(cfg->staticGateway)); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "staticDNS");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->staticDNS, item->valuestring, sizeof(cfg->staticDNS)); }
+
+    // Optional relay restore settings
+    DecodeIntInRange(settingsJSON, "relayRestoreMaxAgeS", 0, INT32_MAX, &cfg->relayRestoreMaxAgeS, invalidString, invalidLen);
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "relayRestoreUnknownAge");
+    if (cJSON_IsBool(item)) { cfg->relayRestoreUnknownAge = (bool)(item->valueint); }
+
+    // Optional availability heartbeat period
+    DecodeIntInRange(settingsJSON, "availabilityPeriodMs", 1000, CONFIG_PERIOD_MAX_MS, &cfg->availabilityPeriodMs, invalidString, invalidLen);
+
+    // Optional power value staleness settings
+    DecodeIntInRange(settingsJSON, "powerMaxAgeMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->powerMaxAgeMs, invalidString, invalidLen);
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "powerStaleRelayValue");
+    if (cJSON_IsNumber(item) && item->valueint >= 0 && item->valueint <= 15) { cfg->powerStaleRelayValue = item->valueint; }
+
+    // Optional relay transition settings
+    DecodeIntInRange(settingsJSON, "relayMinDwellMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->relayMinDwellMs, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "relayPublishSettleMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->relayPublishSettleMs, invalidString, invalidLen);
+
+    // Optional metrics period
+    DecodeIntInRange(settingsJSON, "metricsPeriodMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->metricsPeriodMs, invalidString, invalidLen);
+
+    // Optional module log levels
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "logLevels");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->logLevels, item->valuestring, sizeof(cfg->logLevels)); }
+
+    // Optional operating mode
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "operatingMode");
+    if (cJSON_IsNumber(item) && item->valueint >= 0 && item->valueint < OPERATING_MODE_COUNT) { cfg->operatingMode = item->valueint; }
+
+    // Optional local Envoy polling settings
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "envoyUrl");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->envoyUrl, item->valuestring, sizeof(cfg->envoyUrl)); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "envoyToken");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) { strlcpy(cfg->envoyToken, item->valuestring, sizeof(cfg->envoyToken)); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "envoyCert");
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) {
+        if (strlen(item->valuestring) < sizeof(cfg->envoyCert)) {
+            strlcpy(cfg->envoyCert, item->valuestring, sizeof(cfg->envoyCert));
+        } else { printf("envoyCert is longer than %u bytes, ignoring it.\r\n", (unsigned int)sizeof(cfg->envoyCert)); }
+    }
+    DecodeIntInRange(settingsJSON, "envoyPollMs", POWER_POLL_MIN_PERIOD_MS, CONFIG_PERIOD_MAX_MS, &cfg->envoyPollMs, invalidString, invalidLen);
+
+    // Optional price policy settings
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "policyEnabled");
+    if (cJSON_IsBool(item)) { cfg->policyEnabled = (bool)(item->valueint); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "policyExportThreshold");
+    if (cJSON_IsNumber(item)) { cfg->policyExportThreshold = item->valuedouble; }
+
+    // Optional idle power saving settings
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "idleModeEnabled");
+    if (cJSON_IsBool(item)) { cfg->idleModeEnabled = (bool)(item->valueint); }
+    item = cJSON_GetObjectItemCaseSensitive(settingsJSON, "idleSolarkW");
+    if (cJSON_IsNumber(item) && item->valuedouble >= 0.0) { cfg->idleSolarkW = (float)(item->valuedouble); }
+    DecodeIntInRange(settingsJSON, "idleEnterMs", 0, CONFIG_PERIOD_MAX_MS, &cfg->idleEnterMs, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "idleListenInterval", 1, 255, &cfg->idleListenInterval, invalidString, invalidLen);
+    DecodeIntInRange(settingsJSON, "idlePollMs", POWER_POLL_MIN_PERIOD_MS, CONFIG_PERIOD_MAX_MS, &cfg->idlePollMs, invalidString, invalidLen);
 
     // Remove the cJSON documents to recover memory
     cJSON_Delete(settingsJSON);
 
+    // Report any decoding errors. A patch leaves out whatever it isn't changing.
+    if (!patch && strlen(errorString) != 1) {
+        printf("Error decoding these configuration elements: %s\r\n", errorString);
+        return false;
+    }
+    if (strlen(invalidString) > 0) {
+        printf("These configuration elements are out of range: %s\r\n", invalidString);
+        if (patch) { return false; }
+    }
     return true;
 }
 
-// Saves the configuration to a file
-bool SaveConfiguration()
+// -----------------------------------------------
+// Load the configuration blob from NVS, checking its schema and CRC
+//
+// Reads straight into config, which the caller resets if this fails.
+// -----------------------------------------------
+static bool LoadConfigurationBlob(void)
+{
+    configBlobHeader_T header;
+    size_t len = sizeof(header);
+    nvs_handle_t handle;
+
+    if (nvs_open(CONFIG_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) { return false; }
+    esp_err_t err = nvs_get_blob(handle, CONFIG_NVS_HEADER_KEY, &header, &len);
+    if (err != ESP_OK || len != sizeof(header)) {
+        nvs_close(handle);
+        return false;
+    }
+    if (header.magic != CONFIG_BLOB_MAGIC || header.schema != CONFIG_SCHEMA_VERSION || header.size != sizeof(config)) {
+        printf("Configuration in NVS is schema %u, %u bytes, expected schema %u, %u bytes.\r\n",
+            header.schema, header.size, CONFIG_SCHEMA_VERSION, (unsigned int)sizeof(config));
+        nvs_close(handle);
+        return false;
+    }
+    len = sizeof(config);
+    err = nvs_get_blob(handle, CONFIG_NVS_KEY, &config, &len);
+    nvs_close(handle);
+    if (err != ESP_OK || len != sizeof(config)) { return false; }
+
+    if (header.crc != esp_rom_crc32_le(0, (const uint8_t*)&config, sizeof(config))) {
+        printf("Configuration in NVS failed its CRC check.\r\n");
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------
+// Save the configuration blob to NVS
+//
+// The blob is always saved as configOK, which is what loading it back gives.
+// -----------------------------------------------
+static bool SaveConfigurationBlob(void)
 {
+    configBlobHeader_T header = { .magic = CONFIG_BLOB_MAGIC, .schema = CONFIG_SCHEMA_VERSION, .size = sizeof(config) };
+    nvs_handle_t handle;
+
+    bool configOK = config.configOK;
+    config.configOK = true;
+    header.crc = esp_rom_crc32_le(0, (const uint8_t*)&config, sizeof(config));
+
+    // The blob goes first, so an interrupted save leaves a header whose CRC doesn't match rather than a stale pair
+    esp_err_t err = nvs_open(CONFIG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, CONFIG_NVS_KEY, &config, sizeof(config));
+        if (err == ESP_OK) { err = nvs_set_blob(handle, CONFIG_NVS_HEADER_KEY, &header, sizeof(header)); }
+        if (err == ESP_OK) { err = nvs_commit(handle); }
+        nvs_close(handle);
+    }
+    config.configOK = configOK;
+    if (err != ESP_OK) {
+        printf("Error saving the configuration to NVS: %s\r\n", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------
+// Import the configuration from the JSON file
+// -----------------------------------------------
+static bool ImportConfigurationJSON(void)
+{
+    if (!MountStorage()) { return false; }
+
+    // Open file for reading
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        printf("Failed to open file for reading.\r\n");
+        return false;
+    }
+
+    // Read the whole settings file in one go
+    struct stat st;
+    char* doc = NULL;
+    size_t len = 0;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0 && st.st_size <= CONFIG_JSON_MAX_LEN) {
+        doc = malloc(st.st_size + 1);
+        if (doc != NULL) { len = fread(doc, 1, st.st_size, f); }
+    }
+    fclose(f);
+    if (doc == NULL) {
+        printf("Config file is empty, too long or couldn't be read.\r\n");
+        return false;
+    }
+    doc[len] = 0;
+
+    char invalid[128];
+    bool ok = DecodeConfigurationJSON(&config, doc, len, false, invalid, sizeof(invalid));
+    free(doc);
+    return ok;
+}
+
+// -----------------------------------------------
+// Export the configuration to the JSON file
+// -----------------------------------------------
+static bool ExportConfigurationJSON(void)
+{
+    if (!MountStorage()) { return false; }
+
     // Allocate a temporary JsonDocument
     cJSON *root = cJSON_CreateObject();
 
@@ -172,39 +480,206 @@ bool SaveConfiguration()
     cJSON_AddItemToObject(root, "mqttUsername", cJSON_CreateString(config.mqttUsername));
     cJSON_AddItemToObject(root, "mqttPassword", cJSON_CreateString(config.mqttPassword));
     cJSON_AddItemToObject(root, "retries", cJSON_CreateNumber(config.retries));
-
-    // Write the values to the file
+    cJSON_AddItemToObject(root, "controllerMode", cJSON_CreateNumber(config.controllerMode));
+    cJSON_AddItemToObject(root, "ctlKp", cJSON_CreateNumber(config.ctlKp));
+    cJSON_AddItemToObject(root, "ctlKi", cJSON_CreateNumber(config.ctlKi));
+    cJSON_AddItemToObject(root, "ctlDeadbandkW", cJSON_CreateNumber(config.ctlDeadbandkW));
+    cJSON_AddItemToObject(root, "ctlTargetGridkW", cJSON_CreateNumber(config.ctlTargetGridkW));
+    cJSON_AddItemToObject(root, "ctlMinDwellMs", cJSON_CreateNumber(config.ctlMinDwellMs));
+    cJSON_AddItemToObject(root, "ctlMaxStepsPerUpdate", cJSON_CreateNumber(config.ctlMaxStepsPerUpdate));
+    if (RELAY_CHANNELS == 1) {
+        cJSON_AddItemToObject(root, "maxSolarkW", cJSON_CreateNumber(config.maxSolarkW[0]));
+    } else {
+        cJSON* maxSolar = cJSON_CreateArray();
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) { cJSON_AddItemToArray(maxSolar, cJSON_CreateNumber(config.maxSolarkW[channel])); }
+        cJSON_AddItemToObject(root, "maxSolarkW", maxSolar);
+    }
+    cJSON_AddItemToObject(root, "maxBatteryChargekW", cJSON_CreateNumber(config.maxBatteryChargekW));
+    cJSON_AddItemToObject(root, "relayCalibrationEnabled", cJSON_CreateBool(config.relayCalibrationEnabled));
+    cJSON_AddItemToObject(root, "relayCalibrationSettleMs", cJSON_CreateNumber(config.relayCalibrationSettleMs));
+    cJSON_AddItemToObject(root, "relayCalibrationWindowMs", cJSON_CreateNumber(config.relayCalibrationWindowMs));
+    cJSON_AddItemToObject(root, "controlTaskCore", cJSON_CreateNumber(config.controlTaskCore));
+    cJSON_AddItemToObject(root, "controlTaskPriority", cJSON_CreateNumber(config.controlTaskPriority));
+    cJSON_AddItemToObject(root, "mqttTaskPriority", cJSON_CreateNumber(config.mqttTaskPriority));
+    cJSON_AddItemToObject(root, "mqttTaskStack", cJSON_CreateNumber(config.mqttTaskStack));
+    cJSON_AddItemToObject(root, "mqttReconnectBaseMs", cJSON_CreateNumber(config.mqttReconnectBaseMs));
+    cJSON_AddItemToObject(root, "mqttReconnectMaxMs", cJSON_CreateNumber(config.mqttReconnectMaxMs));
+    cJSON_AddItemToObject(root, "mqttRebuildAfterFailures", cJSON_CreateNumber(config.mqttRebuildAfterFailures));
+    cJSON_AddItemToObject(root, "wifiFastConnect", cJSON_CreateBool(config.wifiFastConnect));
+    cJSON_AddItemToObject(root, "staticIP", cJSON_CreateString(config.staticIP));
+    cJSON_AddItemToObject(root, "staticNetmask", cJSON_CreateString(config.staticNetmask));
+    cJSON_AddItemToObject(root, "staticGateway", cJSON_CreateString(config.staticGateway));
+    cJSON_AddItemToObject(root, "staticDNS", cJSON_CreateString(config.staticDNS));
+    cJSON_AddItemToObject(root, "relayRestoreMaxAgeS", cJSON_CreateNumber(config.relayRestoreMaxAgeS));
+    cJSON_AddItemToObject(root, "relayRestoreUnknownAge", cJSON_CreateBool(config.relayRestoreUnknownAge));
+    cJSON_AddItemToObject(root, "availabilityPeriodMs", cJSON_CreateNumber(config.availabilityPeriodMs));
+    cJSON_AddItemToObject(root, "powerMaxAgeMs", cJSON_CreateNumber(config.powerMaxAgeMs));
+    cJSON_AddItemToObject(root, "powerStaleRelayValue", cJSON_CreateNumber(config.powerStaleRelayValue));
+    cJSON_AddItemToObject(root, "relayMinDwellMs", cJSON_CreateNumber(config.relayMinDwellMs));
+    cJSON_AddItemToObject(root, "relayPublishSettleMs", cJSON_CreateNumber(config.relayPublishSettleMs));
+    cJSON_AddItemToObject(root, "metricsPeriodMs", cJSON_CreateNumber(config.metricsPeriodMs));
+    cJSON_AddItemToObject(root, "logLevels", cJSON_CreateString(config.logLevels));
+    cJSON_AddItemToObject(root, "policyEnabled", cJSON_CreateBool(config.policyEnabled));
+    cJSON_AddItemToObject(root, "policyExportThreshold", cJSON_CreateNumber(config.policyExportThreshold));
+    cJSON_AddItemToObject(root, "envoyUrl", cJSON_CreateString(config.envoyUrl));
+    cJSON_AddItemToObject(root, "envoyToken", cJSON_CreateString(config.envoyToken));
+    cJSON_AddItemToObject(root, "envoyCert", cJSON_CreateString(config.envoyCert));
+    cJSON_AddItemToObject(root, "envoyPollMs", cJSON_CreateNumber(config.envoyPollMs));
+    cJSON_AddItemToObject(root, "operatingMode", cJSON_CreateNumber(config.operatingMode));
+    cJSON_AddItemToObject(root, "idleModeEnabled", cJSON_CreateBool(config.idleModeEnabled));
+    cJSON_AddItemToObject(root, "idleSolarkW", cJSON_CreateNumber(config.idleSolarkW));
+    cJSON_AddItemToObject(root, "idleEnterMs", cJSON_CreateNumber(config.idleEnterMs));
+    cJSON_AddItemToObject(root, "idleListenInterval", cJSON_CreateNumber(config.idleListenInterval));
+    cJSON_AddItemToObject(root, "idlePollMs", cJSON_CreateNumber(config.idlePollMs));
+
+    // Render the values, then remove the cJSON documents to recover memory
     char* rendered = cJSON_Print(root);
-    //printf("Rendered JSON: %s\r\n", rendered);
-
-    // Remove the cJSON documents to recover memory
     cJSON_Delete(root);
+    if (rendered == NULL) { return false; }
 
     // Open file for writing, overwite if exists
     FILE *f = fopen(filename, "w");
     if (f == NULL)
     {
         printf("Failed to create file.\r\n");
+        cJSON_free(rendered);
         return false;
     }
-    fprintf(f, "%s", rendered);
-    fclose(f);
+    bool ok = fputs(rendered, f) >= 0;
+    ok = (fclose(f) == 0) && ok;
+    cJSON_free(rendered);
+    return ok;
+}
 
-    // Open file for reading
-    f = fopen(filename, "r");
-    if (f == NULL)
-    {
-        printf("Failed to open file to read it back.\r\n");
-        return false;
-    }
+// ---------------------------------------------------
+// Load the configuration
+//
+// Normally one read of the binary blob in NVS. If that's missing, or from
+// an older schema, the JSON file on SPIFFS is imported and the blob
+// rewritten from it, which is how the configuration migrates across
+// schema changes. The file is only as current as the last ExportConfiguration.
+//
+// Returns- true if a configuration was loaded, false if it needs entering
+// ---------------------------------------------------
+bool LoadConfiguration()
+{
+    SetDefaultConfig();
+    if (LoadConfigurationBlob()) { return true; }
 
+    printf("No usable configuration in NVS, importing %s.\r\n", filename);
+    SetDefaultConfig();
+    if (!ImportConfigurationJSON()) { return false; }
+    if (config.configOK && !SaveConfigurationBlob()) { printf("Couldn't migrate the configuration to NVS.\r\n"); }
     return true;
 }
 
+// ---------------------------------------------------
+// Save the configuration to the NVS blob
+//
+// Returns- true if the NVS blob was saved
+// ---------------------------------------------------
+bool SaveConfiguration()
+{
+    return SaveConfigurationBlob();
+}
+
+// ---------------------------------------------------
+// Export the configuration to the JSON file on SPIFFS
+//
+// Only on request, as it mounts SPIFFS and builds the whole configuration
+// on the heap. Export before installing firmware with a new configuration
+// schema, so the migration carries over the latest settings.
+//
+// Returns- true if the file was written
+// ---------------------------------------------------
+bool ExportConfiguration()
+{
+    if (ExportConfigurationJSON()) { return true; }
+    printf("Failed to export the configuration to %s.\r\n", filename);
+    return false;
+}
+
+// -----------------------------------------------
+// Work out which subsystems need re-applying between two configurations
+// -----------------------------------------------
+#define CONFIG_FIELD_CHANGED(field) (memcmp(&a->field, &b->field, sizeof(a->field)) != 0)
+static int ConfigurationChanges(const Configuration* a, const Configuration* b)
+{
+    int changed = 0;
+
+    if (CONFIG_FIELD_CHANGED(controllerMode) || CONFIG_FIELD_CHANGED(ctlKp) || CONFIG_FIELD_CHANGED(ctlKi)
+        || CONFIG_FIELD_CHANGED(ctlDeadbandkW) || CONFIG_FIELD_CHANGED(ctlTargetGridkW)
+        || CONFIG_FIELD_CHANGED(ctlMinDwellMs) || CONFIG_FIELD_CHANGED(ctlMaxStepsPerUpdate)
+        || CONFIG_FIELD_CHANGED(maxSolarkW) || CONFIG_FIELD_CHANGED(maxBatteryChargekW)
+        || CONFIG_FIELD_CHANGED(relayCalibrationEnabled) || CONFIG_FIELD_CHANGED(relayCalibrationSettleMs)
+        || CONFIG_FIELD_CHANGED(relayCalibrationWindowMs)) {
+        changed |= CONFIG_CHANGED_CONTROLLER;
+    }
+    if (CONFIG_FIELD_CHANGED(relayMinDwellMs) || CONFIG_FIELD_CHANGED(relayPublishSettleMs)
+        || CONFIG_FIELD_CHANGED(relayRestoreMaxAgeS) || CONFIG_FIELD_CHANGED(relayRestoreUnknownAge)) {
+        changed |= CONFIG_CHANGED_RELAY;
+    }
+    if (CONFIG_FIELD_CHANGED(availabilityPeriodMs) || CONFIG_FIELD_CHANGED(metricsPeriodMs)) {
+        changed |= CONFIG_CHANGED_TIMERS;
+    }
+    if (CONFIG_FIELD_CHANGED(logLevels)) { changed |= CONFIG_CHANGED_LOG; }
+    if (CONFIG_FIELD_CHANGED(operatingMode)) { changed |= CONFIG_CHANGED_MODE; }
+    if (CONFIG_FIELD_CHANGED(policyEnabled) || CONFIG_FIELD_CHANGED(policyExportThreshold)) {
+        changed |= CONFIG_CHANGED_POLICY;
+    }
+    if (CONFIG_FIELD_CHANGED(ssid) || CONFIG_FIELD_CHANGED(pass) || CONFIG_FIELD_CHANGED(staticIP)
+        || CONFIG_FIELD_CHANGED(staticNetmask) || CONFIG_FIELD_CHANGED(staticGateway) || CONFIG_FIELD_CHANGED(staticDNS)) {
+        changed |= CONFIG_CHANGED_WIFI;
+    }
+    if (CONFIG_FIELD_CHANGED(mqttBrokerUrl) || CONFIG_FIELD_CHANGED(mqttUsername) || CONFIG_FIELD_CHANGED(mqttPassword)) {
+        changed |= CONFIG_CHANGED_MQTT;
+    }
+    if (CONFIG_FIELD_CHANGED(Name) || CONFIG_FIELD_CHANGED(DeviceID) || CONFIG_FIELD_CHANGED(UID)
+        || CONFIG_FIELD_CHANGED(controlTaskCore) || CONFIG_FIELD_CHANGED(controlTaskPriority)
+        || CONFIG_FIELD_CHANGED(mqttTaskPriority) || CONFIG_FIELD_CHANGED(mqttTaskStack) || CONFIG_FIELD_CHANGED(wifiFastConnect)
+        || CONFIG_FIELD_CHANGED(envoyUrl) || CONFIG_FIELD_CHANGED(envoyToken) || CONFIG_FIELD_CHANGED(envoyCert)
+        || CONFIG_FIELD_CHANGED(envoyPollMs)
+        || CONFIG_FIELD_CHANGED(idleModeEnabled) || CONFIG_FIELD_CHANGED(idleSolarkW) || CONFIG_FIELD_CHANGED(idleEnterMs)
+        || CONFIG_FIELD_CHANGED(idleListenInterval) || CONFIG_FIELD_CHANGED(idlePollMs)) {
+        changed |= CONFIG_CHANGED_RESTART;
+    }
+    return changed;
+}
+
+// ---------------------------------------------------
+// Apply a partial configuration
+//
+// The patch is a JSON object holding any of the configuration file's
+// fields. It's decoded over a copy of the configuration, so a patch that
+// doesn't parse changes nothing. The caller saves the result. Settings read
+// where they're used, such as the power staleness limits, take effect
+// without being reported.
+//
+// Params - data - the JSON patch, not necessarily null terminated
+//        - len - its length
+//        - invalid - where to list the fields given out of range values
+//        - invalidLen - its size
+// Returns- the CONFIG_CHANGED_ bits for the subsystems to re-apply,
+//          0 if nothing changed, -1 if the patch was invalid
+// ---------------------------------------------------
+int ConfigurationPatch(const char* data, int len, char* invalid, size_t invalidLen)
+{
+    static Configuration patched;   // Too big for the calling task's stack
+
+    patched = config;
+    if (!DecodeConfigurationJSON(&patched, data, len, true, invalid, invalidLen)) { return -1; }
+    patched.configOK = config.configOK;
+    if (memcmp(&patched, &config, sizeof(config)) == 0) { return 0; }
+
+    int changed = ConfigurationChanges(&config, &patched);
+    config = patched;
+    return changed;
+}
+
 void UserConfigEntry()
 {
     char s[250];
-    Configuration temp;
+    static Configuration temp;  // Too big for the main task's stack
 
     strcpy(temp.Name, config.Name);
     strcpy(temp.DeviceID, config.DeviceID);
@@ -332,6 +807,7 @@ void UserConfigEntry()
             config.retries = 0;
             if (SaveConfiguration()) { printf("\r\nSaved the new configuration.\r\n"); }
             else { printf("\r\nERROR trying to save the new configuration.\r\n"); }
+            ExportConfiguration();
         }
         else
         {
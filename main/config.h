@@ -25,6 +25,28 @@
 #define filename "/spiffs/config.txt"
 #define VinPerBitDefault (3.30/2.0)/4095.0   // ADC FS split in two / resolution
 #define USER_INPUT_TIMEOUT_MS 60000
+#define CONFIG_NVS_NAMESPACE "config"
+#define CONFIG_NVS_KEY "blob"
+#define CONFIG_NVS_HEADER_KEY "header"  // Kept apart from the blob so neither needs staging in a combined buffer
+#define CONFIG_BLOB_MAGIC 0x43464731    // "CFG1"
+#define CONFIG_SCHEMA_VERSION 4         // Bump whenever the Configuration struct changes, the JSON file carries it over
+#define CONFIG_JSON_MAX_LEN 8192
+#define CONFIG_MQTT_RECONNECT_MIN_MS 100        // Shortest reconnect delay, so a failing broker isn't retried every tick
+#define CONFIG_MQTT_RECONNECT_MAX_MS 3600000    // Longest reconnect delay, also keeps it within the timer's tick range
+#define CONFIG_PERIOD_MAX_MS 3600000            // Longest timer or poll period
+#define CONFIG_TASK_STACK_MIN 4096              // mqttTaskStack limits
+#define CONFIG_TASK_STACK_MAX 32768
+
+// Subsystems touched by a configuration patch, from ConfigurationPatch
+#define CONFIG_CHANGED_CONTROLLER (1 << 0)  // Controller mode and gains, system limits and calibration
+#define CONFIG_CHANGED_RELAY      (1 << 1)  // Relay scheduler timing and restore limits
+#define CONFIG_CHANGED_TIMERS     (1 << 2)  // Availability and metrics periods
+#define CONFIG_CHANGED_LOG        (1 << 3)  // Module log levels
+#define CONFIG_CHANGED_MODE       (1 << 4)  // Operating mode
+#define CONFIG_CHANGED_POLICY     (1 << 5)  // Price policy
+#define CONFIG_CHANGED_WIFI       (1 << 6)  // WiFi credentials or addressing, needs a WiFi reconnect
+#define CONFIG_CHANGED_MQTT       (1 << 7)  // Broker or credentials, needs a new MQTT client
+#define CONFIG_CHANGED_RESTART    (1 << 8)  // Identity, task layout, Envoy polling or idle mode, used from the next restart
 
 typedef struct {
   bool configOK;
@@ -38,6 +60,52 @@ typedef struct {
   char mqttPassword[160];
   float battVCalFactor;
   int retries;
+  int controllerMode;       // controllerMode_T
+  float ctlKp;
+  float ctlKi;
+  float ctlDeadbandkW;
+  float ctlTargetGridkW;
+  int ctlMinDwellMs;
+  int ctlMaxStepsPerUpdate;
+  float maxSolarkW[RELAY_CHANNELS]; // Each relay channel's maximum solar production
+  float maxBatteryChargekW; // The most the battery can charge at
+  bool relayCalibrationEnabled; // Learn the relay power curves from the solar response
+  int relayCalibrationSettleMs; // Time after a relay change before the solar output reflects it
+  int relayCalibrationWindowMs; // Longest time between the samples compared either side of a change
+  int controlTaskCore;      // Core to pin the control task to, -1 for no affinity
+  int controlTaskPriority;
+  int mqttTaskPriority;     // The MQTT task's core is set by CONFIG_MQTT_TASK_CORE_SELECTION
+  int mqttTaskStack;
+  int mqttReconnectBaseMs;  // First reconnect delay, doubled on each failure
+  int mqttReconnectMaxMs;   // Longest reconnect delay
+  int mqttRebuildAfterFailures; // Destroy and recreate the client after this many failed reconnects
+  bool wifiFastConnect;     // Connect straight to the last good BSSID and channel
+  char staticIP[16];        // Empty to use DHCP
+  char staticNetmask[16];
+  char staticGateway[16];
+  char staticDNS[16];
+  int relayRestoreMaxAgeS;  // Don't restore a saved relay value at boot if it's older than this
+  bool relayRestoreUnknownAge; // Restore a saved relay value at boot even if its age is unknown
+  int availabilityPeriodMs; // How often to publish the availability heartbeat
+  int powerMaxAgeMs;        // Power values older than this are stale, 0 to never time out
+  int powerStaleRelayValue; // Relay value to fall back to while the power values are stale
+  int relayMinDwellMs;      // Minimum time on a relay step before production is increased by another step
+  int relayPublishSettleMs; // Relay value must be steady this long before it's published
+  int metricsPeriodMs;      // How often to publish the runtime metrics, 0 to disable
+  bool policyEnabled;       // Only curtail when the export price is below policyExportThreshold
+  float policyExportThreshold;
+  char envoyUrl[128];       // Poll the Envoy for power directly, e.g. http://envoy.local/production.json, empty to disable
+  char envoyToken[512];     // Bearer token for newer Envoy firmware, empty for none
+  char envoyCert[1536];     // The Envoy's self signed certificate PEM to pin for https, empty to use the CA bundle.
+                            // Longer than the MQTT receive buffer, so set it in the configuration file rather than a patch.
+  int envoyPollMs;
+  int operatingMode;        // operatingMode_T, from the mode select
+  bool idleModeEnabled;     // Light sleep and WiFi modem sleep while there's no solar production
+  float idleSolarkW;        // Solar at or below this counts as no production
+  int idleEnterMs;          // How long without production before going idle
+  int idleListenInterval;   // Beacon intervals between WiFi wakes while idle
+  int idlePollMs;           // Envoy poll period while idle
+  char logLevels[96];       // Module log levels, e.g. "power=warn,mqtt=debug", see LogControl_SetLevels
 } Configuration;
 
 extern Configuration config;
@@ -45,6 +113,8 @@ extern Configuration config;
 void SetDefaultConfig(void);
 bool LoadConfiguration();
 bool SaveConfiguration();
+bool ExportConfiguration();
+int ConfigurationPatch(const char* data, int len, char* invalid, size_t invalidLen);
 void UserConfigEntry();
 
 #endif // #ifndef __CONFIG_H__
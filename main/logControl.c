@@ -0,0 +1,205 @@
+/* Runtime log levels and deferred logging
+   
+   Each module logs under its own tag with a level that can be changed at
+   runtime, from the configuration or over MQTT. Hot paths don't format
+   anything: they queue a compact record of raw values, and a low priority
+   task formats and prints it, so float formatting and UART time stay out
+   of the MQTT and control tasks.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "logControl.h"
+
+typedef struct {
+    uint32_t timeMs;            // esp_log_timestamp() when the record was queued
+    uint8_t module;
+    uint8_t level;
+    uint8_t event;
+    uint8_t count;
+    logFormatter_T formatter;
+    float values[LOG_CONTROL_VALUES];
+} logRecord_T;
+
+static const char* moduleNames[LOG_MODULE_COUNT] = { "main", "power", "mqtt" };
+static const char* moduleTags[LOG_MODULE_COUNT];
+static atomic_uchar moduleLevels[LOG_MODULE_COUNT];
+static const char* levelNames[] = { "none", "error", "warn", "info", "debug", "verbose" };
+
+static QueueHandle_t logQueue = NULL;
+static atomic_uint droppedRecords = 0;
+
+// -----------------------------------------------
+// Format and print queued log records
+// -----------------------------------------------
+static void LogTask(void* pvParameters)
+{
+    logRecord_T record;
+    char line[LOG_CONTROL_LINE_LEN];
+
+    while (true) {
+        if (xQueueReceive(logQueue, &record, portMAX_DELAY) != pdTRUE) { continue; }
+        record.formatter(record.event, record.values, line, sizeof(line));
+        ESP_LOG_LEVEL((esp_log_level_t)record.level, moduleTags[record.module], "(%lu) %s", (unsigned long)record.timeMs, line);
+
+        unsigned int dropped = atomic_exchange(&droppedRecords, 0);
+        if (dropped > 0) { ESP_LOGW(TAG, "%u deferred log records were dropped.", dropped); }
+    }
+}
+
+// -----------------------------------------------
+// Set one module's level, both ours and ESP-IDF's for its tag
+// -----------------------------------------------
+static void SetModuleLevel(int module, esp_log_level_t level)
+{
+    atomic_store(&moduleLevels[module], level);
+    esp_log_level_set(moduleTags[module], level);
+}
+
+// ---------------------------------------------------
+// Start deferred logging and apply the configured levels
+//
+// Params - levels - module levels as for LogControl_SetLevels, may be empty
+// ---------------------------------------------------
+void LogControl_Initialise(const char* levels)
+{
+    moduleTags[LOG_MODULE_MAIN] = TAG;
+    moduleTags[LOG_MODULE_POWER] = POWER_TAG;
+    moduleTags[LOG_MODULE_MQTT] = MQTT_TAG;
+    for (int m = 0; m < LOG_MODULE_COUNT; m++) { SetModuleLevel(m, ESP_LOG_INFO); }
+    if (levels != NULL && levels[0] != 0 && !LogControl_SetLevels(levels, strlen(levels))) {
+        ESP_LOGE(TAG, "Invalid log levels in the configuration: %s", levels);
+    }
+
+    logQueue = xQueueCreate(LOG_CONTROL_QUEUE_LEN, sizeof(logRecord_T));
+    if (logQueue == NULL || xTaskCreate(LogTask, "log", LOG_CONTROL_TASK_STACK, NULL, LOG_CONTROL_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Error starting the deferred logging task, deferred records will be dropped.");
+        logQueue = NULL;
+    }
+}
+
+// ---------------------------------------------------
+// Set module log levels from text
+//
+// Accepts a comma separated list of module=level, for example
+// "power=warn,mqtt=debug". A module of * sets every module. Modules
+// not mentioned are left alone. Nothing is changed if any part is invalid.
+//
+// Params - levels - the text, not necessarily null terminated
+//        - len - its length
+// Returns- true on success, false if anything couldn't be parsed
+// ---------------------------------------------------
+bool LogControl_SetLevels(const char* levels, int len)
+{
+    int newLevels[LOG_MODULE_COUNT];
+    for (int m = 0; m < LOG_MODULE_COUNT; m++) { newLevels[m] = -1; }
+
+    const char* p = levels;
+    const char* end = levels + len;
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* itemEnd = (comma != NULL) ? comma : end;
+        const char* equals = memchr(p, '=', itemEnd - p);
+        if (equals == NULL) { return false; }
+
+        int module = -2;
+        if (equals - p == 1 && *p == '*') { module = -1; }
+        for (int m = 0; m < LOG_MODULE_COUNT; m++) {
+            if (strlen(moduleNames[m]) == equals - p && strncasecmp(p, moduleNames[m], equals - p) == 0) { module = m; }
+        }
+        int level = -1;
+        for (int l = 0; l < sizeof(levelNames) / sizeof(levelNames[0]); l++) {
+            if (strlen(levelNames[l]) == itemEnd - equals - 1 && strncasecmp(equals + 1, levelNames[l], itemEnd - equals - 1) == 0) { level = l; }
+        }
+        if (module == -2 || level < 0) { return false; }
+        for (int m = 0; m < LOG_MODULE_COUNT; m++) {
+            if (module == -1 || module == m) { newLevels[m] = level; }
+        }
+        p = itemEnd + 1;
+    }
+
+    for (int m = 0; m < LOG_MODULE_COUNT; m++) {
+        if (newLevels[m] >= 0) { SetModuleLevel(m, (esp_log_level_t)newLevels[m]); }
+    }
+    return true;
+}
+
+// ---------------------------------------------------
+// Describe the current module log levels, in the form LogControl_SetLevels accepts
+//
+// Returns- the length of the description, or -1 if it didn't fit
+// ---------------------------------------------------
+int LogControl_DescribeLevels(char* levels, size_t len)
+{
+    int used = 0;
+    for (int m = 0; m < LOG_MODULE_COUNT; m++) {
+        int n = snprintf(&levels[used], len - used, "%s%s=%s", (m > 0) ? "," : "", moduleNames[m], levelNames[atomic_load(&moduleLevels[m])]);
+        if (n < 0 || n >= len - used) { return -1; }
+        used += n;
+    }
+    return used;
+}
+
+// ---------------------------------------------------
+// Check whether a module logs at a level, to skip work for records that won't be printed
+// ---------------------------------------------------
+bool LogControl_Enabled(logModule_T module, esp_log_level_t level)
+{
+    return module < LOG_MODULE_COUNT && level <= atomic_load(&moduleLevels[module]);
+}
+
+// ---------------------------------------------------
+// Queue a log record to be formatted and printed by the logging task
+//
+// Never blocks. The record is dropped if the module doesn't log at this
+// level, or counted and dropped if the queue is full.
+//
+// Params - module - the logging module
+//        - level - the record's level
+//        - formatter - formats the values, called in the logging task
+//        - event - passed to the formatter, to say what the values are
+//        - values - the values, copied into the record
+//        - count - the number of values, up to LOG_CONTROL_VALUES
+// Returns- true if the record was queued
+// ---------------------------------------------------
+bool LogControl_Defer(logModule_T module, esp_log_level_t level, logFormatter_T formatter, uint8_t event, const float* values, int count)
+{
+    if (!LogControl_Enabled(module, level) || logQueue == NULL) { return false; }
+
+    logRecord_T record = {
+        .timeMs = esp_log_timestamp(),
+        .module = module,
+        .level = level,
+        .event = event,
+        .count = (count < LOG_CONTROL_VALUES) ? count : LOG_CONTROL_VALUES,
+        .formatter = formatter,
+    };
+    memcpy(record.values, values, record.count * sizeof(float));
+    if (xQueueSend(logQueue, &record, 0) != pdTRUE) {
+        atomic_fetch_add(&droppedRecords, 1);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef __LOGCONTROL_H__
+#define __LOGCONTROL_H__
+
+#include "esp_log.h"
+
+#define LOG_CONTROL_QUEUE_LEN 32        // Deferred log records waiting to be formatted
+#define LOG_CONTROL_TASK_STACK 3072
+#define LOG_CONTROL_TASK_PRIORITY 1     // Just above idle, formatting and UART time never delays control
+#define LOG_CONTROL_VALUES 8            // Values carried by a deferred log record
+#define LOG_CONTROL_LINE_LEN 200
+
+// Modules with their own runtime log level, each logs under its own tag
+typedef enum {
+    LOG_MODULE_MAIN = 0,    // TAG
+    LOG_MODULE_POWER,       // POWER_TAG
+    LOG_MODULE_MQTT,        // MQTT_TAG
+    LOG_MODULE_COUNT
+} logModule_T;
+
+// Formats a deferred record's values into a line of text, in the logging task
+typedef int (*logFormatter_T)(uint8_t event, const float* values, char* line, size_t len);
+
+void LogControl_Initialise(const char* levels);
+bool LogControl_SetLevels(const char* levels, int len);
+int LogControl_DescribeLevels(char* levels, size_t len);
+bool LogControl_Enabled(logModule_T module, esp_log_level_t level);
+bool LogControl_Defer(logModule_T module, esp_log_level_t level, logFormatter_T formatter, uint8_t event, const float* values, int count);
+
+#endif // __LOGCONTROL_H__
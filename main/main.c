@@ -30,23 +30,29 @@
 #include <math.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/time.h>
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_timer.h"
-#include "esp_spiffs.h"
 #include "esp_sleep.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_check.h"
 #include "esp_system.h"
+#include "esp_random.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 
 #include "esp_wifi.h" 
 #include "esp_event.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
@@ -58,8 +64,21 @@
 #include "commonvalues.h"
 #include "utilities.h"
 #include "config.h"
-#include "main.h"
 #include "powerManager.h"
+#include "soakTest.h"
+#include "mqttRouter.h"
+#include "main.h"
+#include "relayState.h"
+#include "mqttTopics.h"
+#include "relayScheduler.h"
+#include "relayCalibration.h"
+#include "relayOutput.h"
+#include "metrics.h"
+#include "logControl.h"
+#include "pricePolicy.h"
+#include "powerPoll.h"
+#include "mqttPublish.h"
+#include "powerSave.h"
 
 const char *TAG = "EnphaseLimiter";
 
@@ -68,18 +87,43 @@ int retry_num = 0;
 char s[1000]; // general purpose string input
 bool wiFiGotIP = false;
 bool wiFiConnected = false;
-bool mqttConnected = false;
-int mqttMessagesQueued = 0;
+EventGroupHandle_t wifiEventGroup = NULL;
+esp_netif_t* wifiNetif = NULL;
+wifi_config_t wifiConfiguration;
+bool wifiUsingCachedAP = false;    // Connecting to the cached BSSID / channel rather than scanning
+atomic_bool mqttConnected = false;
 bool gotTime = false;
+bool clockSet = false;
+int64_t clockSetUs = 0;
 int year = 0, month = 0, day = 0, hour = 0, minute = 0, seconds = 0;
-uint8_t relayValue = 0x00;
-uint8_t commandedRelayValue = 0x00;
-uint8_t oldRelayValue = 0x00;
-powerManager_T powerValues;
-bool powerValuesUpdated = false;
-bool curtailmentEnabled = false;
-bool manualControl = true;
+// Shared between the MQTT task and the control task. The relay and state values are atomics
+// and the power values are only passed across through the lock free snapshot.
+atomic_uint_fast16_t relayValue = 0x00;             // Relay setting applied by the control task, a relay code per channel
+atomic_uint_fast16_t commandedRelayValue = 0x00;    // Last relay commands from Home Assistant, a relay code per channel
+powerManager_T powerValues;                         // MQTT task's working copy, decoded in place
+powerManager_T powerMerged;                         // Fields from each power source, guarded by powerMergeMutex
+SemaphoreHandle_t powerMergeMutex = NULL;           // Serialises the power sources' snapshot writes
+uint8_t localPowerFields = 0;                       // Fields the local power source provides instead of MQTT
+powerManagerSnapshot_T powerSnapshot;               // Latest power values for the control task
+uint32_t powerBinarySequence = 0;                   // Sequence of the last accepted binary power record
+exportController_T exportController;
+atomic_bool curtailmentEnabled = false;             // Set from the operating mode by operating_mode_apply
+atomic_bool manualControl = true;
+int operatingModePublished = -1;                    // Mode last published to the select state topic, MQTT task only
 esp_mqtt_client_handle_t client;
+TaskHandle_t controlTaskHandle = NULL;
+TimerHandle_t watchdogTimer = NULL;
+esp_timer_handle_t heartbeatTimer = NULL;
+esp_timer_handle_t metricsTimer = NULL;
+atomic_uint_least32_t relayCommandUs = 0;    // Low 32 bits of esp_timer_get_time() when the last relay command arrived
+TimerHandle_t relayStepTimer = NULL;
+TimerHandle_t reconnectTimer = NULL;
+atomic_int mqttReconnectFailures = 0;   // Failed reconnects since the last successful connection
+atomic_int configChanges = 0;           // CONFIG_CHANGED_ bits from configuration patches, for the control task
+atomic_bool configSavePending = false;  // The configuration changed and the control task should save it
+atomic_bool configExportPending = false; // The control task should export the configuration to SPIFFS
+int mqttReconnects = 0;                 // Reconnect attempts since boot
+int mqttRebuilds = 0;                   // Client rebuilds since boot
 
 static void log_error_if_nonzero(const char *message, int error_code)
 {
@@ -90,16 +134,34 @@ static void log_error_if_nonzero(const char *message, int error_code)
 
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
-    if (event_id == WIFI_EVENT_STA_START) {
+    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        wiFiGotIP = true;
+        xEventGroupSetBits(wifiEventGroup, WIFI_GOT_IP_BIT);
+    } else if (event_id == WIFI_EVENT_STA_START) {
         ESP_LOGI(TAG, "WiFi CONNECTING...."); 
     } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
-        ESP_LOGI(TAG, "WiFi CONNECTED"); 
+        wifi_event_sta_connected_t* connected = (wifi_event_sta_connected_t*)event_data;
+        ESP_LOGI(TAG, "WiFi CONNECTED on channel %u", connected->channel); 
         wiFiConnected = true;
+        retry_num = 0;
+        wifiUsingCachedAP = false;  // It worked, so later disconnects are handled normally
+        wifi_cache_save(connected->bssid, connected->channel);
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
         ESP_LOGE(TAG, "WiFi lost connection"); 
         wiFiConnected = false;
         wiFiGotIP = false;
-        if (retry_num < 5) {
+        xEventGroupClearBits(wifiEventGroup, WIFI_GOT_IP_BIT);
+        if (wifiUsingCachedAP) {
+            // The cached access point didn't work, forget it and go back to a full scan
+            ESP_LOGI(TAG, "Fast connect to the cached access point failed, scanning instead."); 
+            wifiUsingCachedAP = false;
+            wifi_cache_clear();
+            wifiConfiguration.sta.bssid_set = false;
+            wifiConfiguration.sta.channel = 0;
+            wifiConfiguration.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+            esp_wifi_set_config(ESP_IF_WIFI_STA, &wifiConfiguration);
+            esp_wifi_connect();
+        } else if (retry_num < 5) {
             esp_wifi_connect();
             retry_num++;
             ESP_LOGI(TAG, "Retrying to Connect, attempt # %d", retry_num); 
@@ -107,22 +169,108 @@ static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_b
             ESP_LOGE(TAG, "Failed to reconnect after %d attempts. Restarting the device", retry_num); 
             esp_restart();
         }
-    } else if (event_id == IP_EVENT_STA_GOT_IP) {
-        wiFiGotIP = true;
     } else {
         ESP_LOGI(TAG, "Unhandled WiFi event %ld", event_id); 
     }
 }
 
+/*
+ * @brief Load the last good access point from NVS
+ *
+ * @param ap Where to put the BSSID and channel.
+ * @return true if there was a valid cached access point.
+ */
+static bool wifi_cache_load(wifiCachedAP_T* ap)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(*ap);
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) { return false; }
+    err = nvs_get_blob(handle, WIFI_NVS_AP_KEY, ap, &len);
+    nvs_close(handle);
+    return (err == ESP_OK && len == sizeof(*ap) && ap->channel != 0);
+}
+
+/*
+ * @brief Save the access point we connected to in NVS
+ *
+ *  Only writes if it has changed, so reconnecting to the same access point
+ *  doesn't wear the flash.
+ *
+ * @param bssid BSSID of the access point.
+ * @param channel Channel of the access point.
+ */
+static void wifi_cache_save(const uint8_t* bssid, uint8_t channel)
+{
+    wifiCachedAP_T cached;
+    wifiCachedAP_T ap;
+    memcpy(ap.bssid, bssid, sizeof(ap.bssid));
+    ap.channel = channel;
+    if (wifi_cache_load(&cached) && memcmp(&cached, &ap, sizeof(ap)) == 0) { return; }
+
+    nvs_handle_t handle;
+    err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error opening NVS to cache the access point: %s", esp_err_to_name(err)); return; }
+    err = nvs_set_blob(handle, WIFI_NVS_AP_KEY, &ap, sizeof(ap));
+    if (err == ESP_OK) { err = nvs_commit(handle); }
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error caching the access point: %s", esp_err_to_name(err)); }
+    nvs_close(handle);
+}
+
+/*
+ * @brief Forget the cached access point
+ */
+static void wifi_cache_clear(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) { return; }
+    nvs_erase_key(handle, WIFI_NVS_AP_KEY);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+/*
+ * @brief Set the station's addressing from the configuration, a static IP or DHCP
+ */
+static void wifi_addressing_apply(void)
+{
+    if (strlen(config.staticIP) == 0) {
+        // Back to DHCP, which may already be running
+        err = esp_netif_dhcpc_start(wifiNetif);
+        if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED) { ESP_LOGE(TAG, "Error at esp_netif_dhcpc_start: %d = %s.", err, esp_err_to_name(err)); }
+        ESP_LOGI(TAG, "Using DHCP");
+        return;
+    }
+
+    esp_netif_ip_info_t ipInfo = { 0 };
+    ipInfo.ip.addr = esp_ip4addr_aton(config.staticIP);
+    ipInfo.netmask.addr = esp_ip4addr_aton(config.staticNetmask);
+    ipInfo.gw.addr = esp_ip4addr_aton(config.staticGateway);
+    err = esp_netif_dhcpc_stop(wifiNetif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) { ESP_LOGE(TAG, "Error at esp_netif_dhcpc_stop: %d = %s.", err, esp_err_to_name(err)); }
+    err = esp_netif_set_ip_info(wifiNetif, &ipInfo);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_netif_set_ip_info: %d = %s.", err, esp_err_to_name(err)); }
+    if (strlen(config.staticDNS) > 0) {
+        esp_netif_dns_info_t dns = { 0 };
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        dns.ip.u_addr.ip4.addr = esp_ip4addr_aton(config.staticDNS);
+        err = esp_netif_set_dns_info(wifiNetif, ESP_NETIF_DNS_MAIN, &dns);
+        if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_netif_set_dns_info: %d = %s.", err, esp_err_to_name(err)); }
+    }
+    ESP_LOGI(TAG, "Using static IP %s, netmask %s, gateway %s", config.staticIP, config.staticNetmask, config.staticGateway);
+}
+
 void wifi_connection()
 {
-    err = nvs_flash_init();
-    if (err != ESP_OK) { ESP_LOGE(TAG, "Error at nvs_flash_init: %d = %s.", err, esp_err_to_name(err)); }
+    wifiEventGroup = xEventGroupCreate();
     err = esp_netif_init();                                                                    // network interface initialization
     if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_netif_init: %d = %s.", err, esp_err_to_name(err)); }
     err = esp_event_loop_create_default();                                                     // responsible for handling and dispatching events
     if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_event_loop_create_default: %d = %s.", err, esp_err_to_name(err)); }
-    esp_netif_create_default_wifi_sta();                                                 // sets up necessary data structs for wifi station interface
+    wifiNetif = esp_netif_create_default_wifi_sta();                                     // sets up necessary data structs for wifi station interface
+
+    // Use a static IP if one is configured, which saves the DHCP exchange
+    if (strlen(config.staticIP) > 0) { wifi_addressing_apply(); }
+
     wifi_init_config_t wifi_initiation = WIFI_INIT_CONFIG_DEFAULT();                     // sets up wifi wifi_init_config struct with default values
     err = esp_wifi_init(&wifi_initiation);                                               // wifi initialised with dafault wifi_initiation
     if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_wifi_init: %d = %s.", err, esp_err_to_name(err)); }
@@ -130,22 +278,420 @@ void wifi_connection()
     if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_event_handler_register(WIFI_EVENT: %d = %s.", err, esp_err_to_name(err)); }
     err = esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, wifi_event_handler, NULL); // creating event handler register for ip event
     if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_event_handler_register(IP_EVENT: %d = %s.", err, esp_err_to_name(err)); }
-    wifi_config_t wifi_configuration = {                                                 // struct wifi_config_t var wifi_configuration
-        .sta = {
-            // we are sending a const char of ssid and password which we will strcpy in following line so leaving it blank
-            .ssid = "",
-            .password = ""
-        }
-    };
-    strcpy((char*)wifi_configuration.sta.ssid, config.ssid);    
-    strcpy((char*)wifi_configuration.sta.password, config.pass);   
-    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_configuration);  // setting up configs when event ESP_IF_WIFI_STA
-    esp_wifi_start();       // start connection with configurations provided in funtion
+    memset(&wifiConfiguration, 0, sizeof(wifiConfiguration));
+    strlcpy((char*)wifiConfiguration.sta.ssid, config.ssid, sizeof(wifiConfiguration.sta.ssid));    
+    strlcpy((char*)wifiConfiguration.sta.password, config.pass, sizeof(wifiConfiguration.sta.password));   
+    if (config.idleModeEnabled) { wifiConfiguration.sta.listen_interval = config.idleListenInterval; }  // Only used in idle mode's modem sleep
+
+    // Go straight to the last access point we connected to rather than scanning every channel
+    wifiCachedAP_T cachedAP;
+    if (config.wifiFastConnect && wifi_cache_load(&cachedAP)) {
+        memcpy(wifiConfiguration.sta.bssid, cachedAP.bssid, sizeof(wifiConfiguration.sta.bssid));
+        wifiConfiguration.sta.bssid_set = true;
+        wifiConfiguration.sta.channel = cachedAP.channel;
+        wifiConfiguration.sta.scan_method = WIFI_FAST_SCAN;
+        wifiUsingCachedAP = true;
+        ESP_LOGI(TAG, "Fast connecting to %02x:%02x:%02x:%02x:%02x:%02x on channel %u", 
+            cachedAP.bssid[0], cachedAP.bssid[1], cachedAP.bssid[2], cachedAP.bssid[3], cachedAP.bssid[4], cachedAP.bssid[5], cachedAP.channel);
+    }
+
     esp_wifi_set_mode(WIFI_MODE_STA);   // station mode selected
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifiConfiguration);  // setting up configs when event ESP_IF_WIFI_STA
+    esp_wifi_start();       // start connection with configurations provided in funtion
     esp_wifi_connect(); // connect with saved ssid and pass
     ESP_LOGI(TAG, "wifi_init_softap finished. SSID:%s  password:%s", config.ssid, config.pass);
 } 
 
+/*
+ * @brief Reconnect WiFi with changed credentials or addressing
+ *
+ *  The disconnect event reconnects with the new settings, scanning as the
+ *  cached access point may not be on the new network.
+ */
+static void wifi_reconfigure(void)
+{
+    ESP_LOGI(TAG, "WiFi settings changed, reconnecting to %s.", config.ssid);
+    wifi_addressing_apply();
+    strlcpy((char*)wifiConfiguration.sta.ssid, config.ssid, sizeof(wifiConfiguration.sta.ssid));
+    strlcpy((char*)wifiConfiguration.sta.password, config.pass, sizeof(wifiConfiguration.sta.password));
+    wifiUsingCachedAP = false;
+    wifi_cache_clear();
+    wifiConfiguration.sta.bssid_set = false;
+    wifiConfiguration.sta.channel = 0;
+    wifiConfiguration.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    retry_num = 0;
+    err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifiConfiguration);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_wifi_set_config: %d = %s.", err, esp_err_to_name(err)); }
+    err = esp_wifi_disconnect();
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error at esp_wifi_disconnect: %d = %s.", err, esp_err_to_name(err)); }
+}
+
+/*
+ * @brief Handle a message from the Home Assistant time feed
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_time_handler(esp_mqtt_event_handle_t event)
+{
+    char timeString[40];
+    int len = (event->data_len < sizeof(timeString)) ? event->data_len : sizeof(timeString) - 1;
+    int64_t now = esp_timer_get_time();
+
+    // Only parse the time when the system clock needs setting, on the first message then hourly,
+    // so saved relay states can be aged. Everything else uses the system clock.
+    gotTime = true;
+    if (clockSet && now - clockSetUs < CLOCK_RESYNC_US) { return; }
+
+    ESP_LOGV(TAG, "Got the time as %.*s.", event->data_len, event->data);
+    memcpy(timeString, event->data, len);
+    timeString[len] = 0;
+    if (sscanf(timeString, "%d.%d.%d %d:%d:%d", &year, &month, &day, &hour, &minute, &seconds) != 6) { return; }
+
+    struct tm t = { .tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_hour = hour, .tm_min = minute, .tm_sec = seconds, .tm_isdst = -1 };
+    struct timeval tv = { .tv_sec = mktime(&t), .tv_usec = 0 };
+    if (tv.tv_sec > 0 && settimeofday(&tv, NULL) == 0) {
+        clockSet = true;
+        clockSetUs = now;
+    }
+}
+
+/*
+ * @brief Handle a relay number command from Home Assistant
+ *
+ *  Each relay channel has its own number entity, and the command topic says which.
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_relay_command_handler(esp_mqtt_event_handle_t event)
+{
+    char command[16];
+    int len = (event->data_len < sizeof(command)) ? event->data_len : sizeof(command) - 1;
+
+    int channel = 0;
+    while (channel < RELAY_CHANNELS && (strlen(mqttTopics.relayCommand[channel]) != event->topic_len
+        || memcmp(mqttTopics.relayCommand[channel], event->topic, event->topic_len) != 0)) { channel++; }
+    if (channel == RELAY_CHANNELS) { return; }
+
+    memcpy(command, event->data, len);
+    command[len] = 0;
+    ESP_LOGV(TAG, "Received command %s for relay %d.", command, channel);
+    int val = atoi((const char*)command);
+    if (val < 0 || val >= RELAY_STEPS) {
+        ESP_LOGW(TAG, "Ignoring relay %d command %s, it must be 0 to %d.", channel, command, RELAY_STEPS - 1);
+        return;
+    }
+    // The control task uses this value to set the relays if we're in manual control
+    uint_fast16_t commanded = atomic_load(&commandedRelayValue);
+    while (!atomic_compare_exchange_weak(&commandedRelayValue, &commanded, RELAY_VALUE_WITH_CODE(commanded, channel, val))) { }
+    atomic_store(&relayCommandUs, (uint32_t)esp_timer_get_time());
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_RELAY, eSetBits); }
+}
+
+/*
+ * @brief Stamp newly decoded power values and hand them to the control task
+ *
+ *  The fields from each source are merged, and only a source of the power fields
+ *  updates the snapshot, so the age of the power values is the age of those.
+ *
+ * @param values The decoded values.
+ * @param fields The POWER_FIELDS_ the source provides.
+ * @param sourceSequence The sample's sequence number from its source.
+ */
+static void power_accept(powerManager_T* values, uint8_t fields, uint32_t sourceSequence)
+{
+    values->receivedUs = esp_timer_get_time();
+    values->sourceSequence = sourceSequence;
+    xSemaphoreTake(powerMergeMutex, portMAX_DELAY);
+    PowerManager_Merge(&powerMerged, values, fields);
+    if (fields & POWER_FIELDS_POWER) {
+        PowerManager_SnapshotWrite(&powerSnapshot, &powerMerged);    // Hand the valid power values to the control task
+    }
+    xSemaphoreGive(powerMergeMutex);
+    if ((fields & POWER_FIELDS_POWER) && controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_POWER, eSetBits); }
+}
+
+/*
+ * @brief Stamp power values from Home Assistant, less any the local source provides
+ *
+ * @param sourceSequence The sample's sequence number from its source.
+ */
+static void mqtt_power_accept(uint32_t sourceSequence)
+{
+    power_accept(&powerValues, POWER_FIELDS_ALL & ~localPowerFields, sourceSequence);
+}
+
+/*
+ * @brief Accept power values polled from the local source, in the poll task
+ *
+ * @param values The decoded values.
+ * @param fields The POWER_FIELDS_ the source provides.
+ */
+static void local_power_handler(powerManager_T* values, uint8_t fields)
+{
+    power_accept(values, fields, values->sourceSequence);
+}
+
+/*
+ * @brief Handle a message from the Home Assistant power data feed
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_power_handler(esp_mqtt_event_handle_t event)
+{
+    ESP_LOGV(TAG, "Received power data: %.*s", event->data_len, event->data);
+    int64_t decodeStartUs = esp_timer_get_time();
+    int decodeStatus = PowerManager_DecodeStream(&powerValues, event->data, event->data_len);
+#if POWERMANAGER_VERIFY_DECODE
+    if (decodeStatus == 0 && event->data_len < sizeof(s)) {
+        powerManager_T check = powerValues;
+        strncpy(s, event->data, event->data_len);
+        s[event->data_len] = 0;
+        if (PowerManager_Decode(&check, (const char*)s) != 0 || memcmp(&check, &powerValues, sizeof(check)) != 0) {
+            ESP_LOGW(TAG, "Streaming and cJSON power decoders disagree on: %s", s);
+        }
+    }
+#endif // POWERMANAGER_VERIFY_DECODE
+    if (decodeStatus != 0 && event->data_len < sizeof(s)) {
+        // Fall back to the cJSON decoder, which also reports what was wrong
+        ESP_LOGW(TAG, "Streaming decode of power data failed, retrying with cJSON.");
+        strncpy(s, event->data, event->data_len);
+        s[event->data_len] = 0;
+        decodeStatus = PowerManager_Decode(&powerValues, (const char*)s);
+    }
+    Metrics_RecordDecode((uint32_t)(esp_timer_get_time() - decodeStartUs));
+    if (decodeStatus == 0) {
+        ESP_LOGV(TAG, "Successfully decoded power values from JSON string.");
+        mqtt_power_accept(powerValues.sourceSequence + 1);
+    } else {
+        ESP_LOGE(TAG, "Error decoding power values from JSON string.");
+    }
+}
+
+/*
+ * @brief Handle a compact binary power record from Home Assistant
+ *
+ *  Feeds the same snapshot as the JSON power message.
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_power_binary_handler(esp_mqtt_event_handle_t event)
+{
+    int decodeStatus = PowerManager_DecodeBinary(&powerValues, event->data, event->data_len, &powerBinarySequence);
+    if (decodeStatus == 0) {
+        mqtt_power_accept(powerValues.sourceSequence);
+    } else if (decodeStatus == 2) {
+        ESP_LOGW(TAG, "Dropped a repeated or out of order binary power record.");
+    } else {
+        ESP_LOGE(TAG, "Error decoding a binary power record of %d bytes.", event->data_len);
+    }
+}
+
+/*
+ * @brief Handle a module log level command, and keep the new levels in the configuration
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_log_level_handler(esp_mqtt_event_handle_t event)
+{
+    char levels[sizeof(config.logLevels)];
+
+    if (!LogControl_SetLevels(event->data, event->data_len)) {
+        ESP_LOGE(TAG, "Invalid log level command: %.*s", event->data_len, event->data);
+        return;
+    }
+    if (LogControl_DescribeLevels(levels, sizeof(levels)) > 0 && strcmp(levels, config.logLevels) != 0) {
+        strlcpy(config.logLevels, levels, sizeof(config.logLevels));
+        config_save_request();
+    }
+    ESP_LOGI(TAG, "Log levels are now %s", config.logLevels);
+}
+
+/*
+ * @brief Handle a tariff forecast, replanning curtailment from it
+ *
+ * A forecast longer than the MQTT receive buffer arrives in fragments, and only the
+ * first carries the topic, so it's rejected rather than parsed incomplete.
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_tariff_handler(esp_mqtt_event_handle_t event)
+{
+    if (event->data_len < event->total_data_len) {
+        ESP_LOGE(TAG, "Tariff forecast too large, %d bytes. The limit is the %d byte MQTT receive buffer.", event->total_data_len, CONFIG_MQTT_BUFFER_SIZE);
+        return;
+    }
+    if (PricePolicy_Update(event->data, event->data_len) >= 0 && controlTaskHandle != NULL) {
+        xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_POWER, eSetBits); // Re-decide with the new plan
+    }
+}
+
+/*
+ * @brief Put the control task into an operating mode
+ *
+ * @param mode The operatingMode_T.
+ */
+static void operating_mode_apply(int mode)
+{
+    static const char* names[] = OPERATING_MODE_NAMES;
+
+    atomic_store(&manualControl, mode == OPERATING_MODE_MANUAL);
+    atomic_store(&curtailmentEnabled, mode == OPERATING_MODE_AUTO);
+    ESP_LOGI(TAG, "Operating mode is %s.", names[mode]);
+
+    // Re-decide now, from the commanded relay value or the latest power values
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_RELAY | CONTROL_NOTIFY_POWER, eSetBits); }
+}
+
+/*
+ * @brief Publish the operating mode to the select's state topic, if it's changed since it was last published
+ */
+static void mqtt_mode_publish(void)
+{
+    static const char* names[] = OPERATING_MODE_NAMES;
+
+    if (config.operatingMode == operatingModePublished) { return; }
+    if (MqttPublish_SendStatic(mqttTopics.modeState, MQTT_CLASS_STATE, names[config.operatingMode])) {
+        operatingModePublished = config.operatingMode;
+    }
+}
+
+/*
+ * @brief Handle an operating mode command from the mode select, and keep the new mode in the configuration
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_mode_handler(esp_mqtt_event_handle_t event)
+{
+    static const char* names[] = OPERATING_MODE_NAMES;
+    int mode = -1;
+
+    for (int m = 0; m < OPERATING_MODE_COUNT; m++) {
+        if (event->data_len == strlen(names[m]) && strncmp(event->data, names[m], event->data_len) == 0) { mode = m; }
+    }
+    if (mode < 0) {
+        ESP_LOGE(TAG, "Unknown operating mode: %.*s", event->data_len, event->data);
+        return;
+    }
+    if (mode != config.operatingMode) {
+        config.operatingMode = mode;
+        operating_mode_apply(mode);
+        config_save_request();
+    }
+    mqtt_mode_publish();
+}
+
+/*
+ * @brief Have the control task save the configuration to NVS
+ *
+ *  Keeps flash writes off the MQTT task. The flag is checked on every
+ *  control task wakeup, so the save still happens if it was set before the
+ *  control task started.
+ */
+static void config_save_request(void)
+{
+    atomic_store(&configSavePending, true);
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_CONFIG, eSetBits); }
+}
+
+/*
+ * @brief Handle a configuration export command, the control task writes the JSON file
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_config_export_handler(esp_mqtt_event_handle_t event)
+{
+    atomic_store(&configExportPending, true);
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_CONFIG, eSetBits); }
+}
+
+/*
+ * @brief Handle a configuration patch, re-applying only the subsystems it changed
+ *
+ *  Log levels, the operating mode and the price policy are applied here.
+ *  Everything owned by the control task is passed over to it. The result,
+ *  with any fields that were out of range, is published to configResult.
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ */
+static void mqtt_config_handler(esp_mqtt_event_handle_t event)
+{
+    char invalid[128];
+    char payload[CONFIG_RESULT_PAYLOAD_LEN];
+    int changed = ConfigurationPatch(event->data, event->data_len, invalid, sizeof(invalid));
+    if (changed < 0) {
+        ESP_LOGE(TAG, "Invalid configuration patch, %d bytes.", event->data_len);  // Not logged, it may hold credentials
+        snprintf(payload, sizeof(payload), "{\"result\": \"invalid\", \"outOfRange\": \"%s\"}", invalid);
+        MqttPublish_Send(mqttTopics.configResult, MQTT_CLASS_STATE, payload);
+        return;
+    }
+    ESP_LOGI(TAG, "Configuration patch applied, changed subsystems 0x%03X.", changed);
+    if (changed != 0) { config_save_request(); }
+    snprintf(payload, sizeof(payload), "{\"result\": \"applied\", \"changed\": %d}", changed);
+    MqttPublish_Send(mqttTopics.configResult, MQTT_CLASS_STATE, payload);
+
+    if (changed & CONFIG_CHANGED_LOG) {
+        if (!LogControl_SetLevels(config.logLevels, strlen(config.logLevels))) { ESP_LOGE(TAG, "Invalid log levels %s.", config.logLevels); }
+    }
+    if (changed & CONFIG_CHANGED_MODE) {
+        operating_mode_apply(config.operatingMode);
+        mqtt_mode_publish();
+    }
+    if (changed & CONFIG_CHANGED_POLICY) {
+        PricePolicy_Configure(config.policyEnabled, config.policyExportThreshold);
+        if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_POWER, eSetBits); }
+    }
+    if (changed & CONFIG_CHANGED_RESTART) {
+        ESP_LOGW(TAG, "The identity, task layout, Envoy polling and idle mode settings are only used from the next restart.");
+    }
+    if ((changed & CONFIG_CHANGED_CONTROL_TASK) && controlTaskHandle != NULL) {
+        atomic_fetch_or(&configChanges, changed & CONFIG_CHANGED_CONTROL_TASK);
+        xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_CONFIG, eSetBits);
+    }
+}
+
+/*
+ * @brief Send the power manager's hot path logging to the deferred log queue
+ */
+static void power_log_hook(int level, uint8_t event, const float* values, int count)
+{
+    LogControl_Defer(LOG_MODULE_POWER, (esp_log_level_t)level, PowerManager_FormatLog, event, values, count);
+}
+
+/*
+ * @brief Add an inbound topic route, logging if the table can't take it
+ *
+ * @param topic The topic to subscribe to.
+ * @param qos The subscription QoS.
+ * @param handler Called for each message on the topic.
+ */
+static void mqtt_route_add(const char* topic, int qos, mqttTopicHandler_T handler)
+{
+    if (!MqttRouter_Add(topic, qos, handler)) {
+        ESP_LOGE(TAG, "Unable to add an MQTT route for topic %s, too long or too many routes. It won't be subscribed to.", topic);
+    }
+}
+
+/*
+ * @brief Build the inbound topic routing table from the configuration
+ *
+ *  The same table drives the subscriptions made when MQTT connects.
+ */
+static void mqtt_routes_build(void)
+{
+    MqttRouter_Clear();
+    mqtt_route_add("homeassistant/CurrentTime", 0, mqtt_time_handler);
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        mqtt_route_add(mqttTopics.relayCommand[channel], 0, mqtt_relay_command_handler);
+    }
+    mqtt_route_add("homeassistant/Power", 0, mqtt_power_handler);
+    mqtt_route_add(mqttTopics.powerBinary, 0, mqtt_power_binary_handler);
+    mqtt_route_add(mqttTopics.logLevelSet, 0, mqtt_log_level_handler);
+    mqtt_route_add(mqttTopics.tariff, 1, mqtt_tariff_handler);
+    mqtt_route_add(mqttTopics.modeCommand, 1, mqtt_mode_handler);
+    mqtt_route_add(mqttTopics.configSet, 1, mqtt_config_handler);
+    mqtt_route_add(mqttTopics.configExport, 1, mqtt_config_export_handler);
+}
+
 /*
  * @brief Event handler registered to receive MQTT events
  *
@@ -158,205 +704,98 @@ void wifi_connection()
  */
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
-    char topic[160];
-    char payload[2000];
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
-    int msg_id;
 
-    ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
+    Metrics_SampleMqttStack();
+
+    ESP_LOGD(MQTT_TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
 
     switch ((esp_mqtt_event_id_t)event_id) {
         case MQTT_EVENT_BEFORE_CONNECT:
-            ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_BEFORE_CONNECT");
             break;
         case MQTT_EVENT_CONNECTED:
             mqttConnected = true;
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-
-            // Subscribe to the time feed
-            msg_id = esp_mqtt_client_subscribe(client, "homeassistant/CurrentTime", 0);
-            ESP_LOGI(TAG, "Subscribe sent for time feed, msg_id=%d", msg_id);
-
-            // Subscribe to the command feed
-            sprintf(s, "homeassistant/number/%s/command", config.Name);
-            msg_id = esp_mqtt_client_subscribe(client, s, 0);
-            ESP_LOGI(TAG, "Subscribe sent for the relay number command feed, msg_id=%d", msg_id);
-
-            /*
-            // Subscribe to the curtailment switch feed
-            sprintf(s, "homeassistant/switch/%s/command", config.Name);
-            msg_id = esp_mqtt_client_subscribe(client, s, 0);
-            ESP_LOGI(TAG, "Subscribe sent for the switch command feed, msg_id=%d", msg_id);
-
-            // Subscribe to the manual switch feed
-            sprintf(s, "homeassistant/switch/%s-manual/command", config.Name);
-            msg_id = esp_mqtt_client_subscribe(client, s, 0);
-            ESP_LOGI(TAG, "Subscribe sent for the switch command feed, msg_id=%d", msg_id);
-            */
-
-            // Send the relay configuration.
-            // Use the same command and state topics so we don't have to echo commands to state
-            sprintf(topic, "homeassistant/number/%s/config",config.Name);
-            sprintf(payload, "{\"unique_id\": \"T_%s\", \
-                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
-                \"availability\": {\"topic\": \"homeassistant/number/%s/availability\", \"payload_available\": \"online\", \"payload_not_available\": \"offline\"}, \
-                \"min\":0, \"max\":15, \"retain\":true, \
-                \"command_topic\": \"homeassistant/number/%s/command\", \"state_topic\": \"homeassistant/number/%s/command\"}"
-                ,config.UID, config.DeviceID, config.Name, config.Name, config.Name, config.Name);
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Published Envoy Relay config message successfully, msg_id=%d", msg_id);
-
-            /*
-            // Send the curtailment enable switch configuration. Use the relay number availability topic
-            // Use the same command and state topics so we don't have to echo commands to state
-            sprintf(topic, "homeassistant/switch/%s/config",config.Name);
-            sprintf(payload, "{\"unique_id\": \"S_%s\", \"retain\": \"true\", \
-                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
-                \"availability\": {\"topic\": \"homeassistant/number/%s/availability\", \"payload_available\": \"online\", \"payload_not_available\": \"offline\"}, \
-                \"command_topic\": \"homeassistant/switch/%s/command\", \"state_topic\": \"homeassistant/switch/%s/command\"}"
-                ,config.UID, config.DeviceID, config.Name, config.Name, config.Name, config.Name);
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Published Envoy Relay config message successfully, msg_id=%d", msg_id);
-
-            // Send the manual control switch configuration. Use the relay number availability topic
-            // Use the same command and state topics so we don't have to echo commands to state
-            sprintf(topic, "homeassistant/switch/%s-manual/config",config.Name);
-            sprintf(payload, "{\"unique_id\": \"S_%s-manual\", \"retain\": \"true\", \
-                \"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, \
-                \"availability\": {\"topic\": \"homeassistant/number/%s/availability\", \"payload_available\": \"online\", \"payload_not_available\": \"offline\"}, \
-                \"command_topic\": \"homeassistant/switch/%s-manual/command\", \"state_topic\": \"homeassistant/switch/%s-manual/command\"}"
-                ,config.UID, config.DeviceID, config.Name, config.Name, config.Name, config.Name);
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Published Envoy Relay config message successfully, msg_id=%d", msg_id);
-            */
-
-            // Send an online message
-            sprintf(topic, "homeassistant/number/%s/availability", config.Name);
-            sprintf(payload, "online");
-            msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Published Envoy Relay online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-
-            /*
-            // Subscribe to the power data feed
-            msg_id = esp_mqtt_client_subscribe(client, "homeassistant/Power", 0);
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Subscribe sent for the power data feed, msg_id=%d", msg_id);
-            */
+            atomic_store(&mqttReconnectFailures, 0);
+            ESP_LOGI(MQTT_TAG, "MQTT_EVENT_CONNECTED");
+
+            // Subscribe to every topic in the routing table
+            MqttRouter_Subscribe(client);
+
+            // Send whatever was held back while we were disconnected
+            MqttPublish_Connected(client);
+
+            // Send the discovery payloads, all prebuilt by MqttTopics_Build, and an online message
+            for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+                MqttPublish_SendStatic(mqttTopics.relayConfig[channel], MQTT_CLASS_DISCOVERY, mqttTopics.relayDiscovery[channel]);
+            }
+            MqttPublish_SendStatic(mqttTopics.metricsConfig, MQTT_CLASS_DISCOVERY, mqttTopics.metricsDiscovery);
+            MqttPublish_SendStatic(mqttTopics.modeConfig, MQTT_CLASS_DISCOVERY, mqttTopics.modeDiscovery);
+            MqttPublish_SendStatic(mqttTopics.availability, MQTT_CLASS_STATE, MQTT_PAYLOAD_ONLINE);
+            ESP_LOGI(MQTT_TAG, "Queued the discovery and online messages.");
+
+            // Send the mode select's state if that hasn't been published since it changed
+            mqtt_mode_publish();
 
             break;
         case MQTT_EVENT_DISCONNECTED:
             mqttConnected = false;
-            ESP_LOGE(TAG, "MQTT_EVENT_DISCONNECTED");
+            MqttPublish_Disconnected();
+            ESP_LOGE(MQTT_TAG, "MQTT_EVENT_DISCONNECTED");
+            if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_MQTT_DOWN, eSetBits); }
             break;
         case MQTT_EVENT_SUBSCRIBED:
-            ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-            mqttMessagesQueued--;
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_UNSUBSCRIBED:
-            ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-            mqttMessagesQueued--;
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            MqttPublish_Acknowledged(event->msg_id);
+            break;
+        case MQTT_EVENT_DELETED:
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+            MqttPublish_Expired(event->msg_id);
             break;
         case MQTT_EVENT_DATA:
-            //ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            strncpy(s, event->topic, event->topic_len);
-            s[event->topic_len] = '\0';
-            ESP_LOGV(TAG, "Received an event - topic was %s", s);
-            if (strcmp(s, "homeassistant/CurrentTime") == 0) {
-                // Process the time
-                ESP_LOGV(TAG, "Got the time from %s, as %.*s.", s, event->data_len, event->data);
-                gotTime = true;
-                strncpy(s, event->data, event->data_len);
-                s[event->data_len] = 0;
-                sscanf(s, "%d.%d.%d %d:%d:%d", &year, &month, &day, &hour, &minute, &seconds);
-
-                // Send an online every 10 seconds
-                if (seconds % 10 == 0) {
-                    sprintf(topic, "homeassistant/number/%s/availability", config.Name);
-                    sprintf(payload, "online");
-                    msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-                    mqttMessagesQueued++;
-                    ESP_LOGV(TAG, "Published Envoy Relay online message successfully, msg_id=%d, topic=%s", msg_id, topic);
-                }
-
-            } else if (strstr(s, "command") != NULL) {
-                if (strstr(s, "number")) {
-                    strncpy(s, event->data, event->data_len);
-                    s[event->data_len] = 0;
-                    ESP_LOGV(TAG, "Received command %s.", s);
-                    uint8_t val = (uint8_t)(atoi((const char*)s));
-                    // use this value to set the relays if we're in manual control
-                    commandedRelayValue = val;
-                    if (manualControl == true && val <= 15) { // Unsigned so always >= 0
-                        oldRelayValue = relayValue;
-                        relayValue = val;
-                        ESP_LOGV(TAG, "Set relay value to $%02X", relayValue);
-                    }      
-                } /* else if (strstr(s, "switch")) {
-                    // Switch state changed from Home Assistant
-                    if (strstr(s, "manual")) { // Enable switch?
-                        strncpy(s, event->data, event->data_len);
-                        s[event->data_len] = 0;
-                        if (strstr(s, "ON")) { 
-                            manualControl = true; 
-                            relayValue = commandedRelayValue;
-                        } else { manualControl = false; }
-                        ESP_LOGI(TAG, "Manual control switch state change received %s - changed to %d", s, manualControl);
-                    } else { // must be the curtailment switch
-                        strncpy(s, event->data, event->data_len);
-                        s[event->data_len] = 0;
-                        if (strstr(s, "ON")) { curtailmentEnabled  = true; } else { curtailmentEnabled = false; }
-                        ESP_LOGI(TAG, "Curtailment switch state change received %s - changed to %d", s, curtailmentEnabled);
-                    } 
-                } */ else {
-                    // Don't know what this topic was
-                    ESP_LOGE(TAG, "Received unknown command topic: %s", s);
-                }
-            } else if (strcmp(s, "homeassistant/Power") == 0) {
-                strncpy(s, event->data, event->data_len);
-                s[event->data_len] = 0;
-                ESP_LOGV(TAG, "Received power data: %s", s);
-                if (PowerManager_Decode(&powerValues, (const char*)s) == 0) {
-                    ESP_LOGV(TAG, "Successfully decoded power values from JSON string.");
-                    powerValuesUpdated = true;    // Flag that we have received valid power values
-                } else {
-                    ESP_LOGE(TAG, "Error decoding power values from JSON string.");
-                }
-            } else {
-                ESP_LOGI(TAG, "Received unexpected message, topic %s", s);
+            ESP_LOGV(MQTT_TAG, "Received an event - topic was %.*s", event->topic_len, event->topic);
+            if (!MqttRouter_Dispatch(event)) {
+                ESP_LOGI(MQTT_TAG, "Received unexpected message, topic %.*s", event->topic_len, event->topic);
             }
             break;
+#if SOAK_TEST_ENABLE
+        case MQTT_USER_EVENT:
+            SoakTest_Handle(event);
+            break;
+#endif // SOAK_TEST_ENABLE
         case MQTT_EVENT_ERROR:
-            ESP_LOGE(TAG, "MQTT_EVENT_ERROR. ");
+            ESP_LOGE(MQTT_TAG, "MQTT_EVENT_ERROR. ");
             if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
                 log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
                 log_error_if_nonzero("reported from tls stack", event->error_handle->esp_tls_stack_err);
                 log_error_if_nonzero("captured as transport's socket errno",  event->error_handle->esp_transport_sock_errno);
-                ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
-                ESP_LOGI(TAG, "WiFi connected = %d", wiFiConnected);
+                ESP_LOGI(MQTT_TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
+                ESP_LOGI(MQTT_TAG, "WiFi connected = %d", wiFiConnected);
             }
             break;
         default:
-            ESP_LOGE(TAG, "Other event id:%d", event->event_id);
+            ESP_LOGE(MQTT_TAG, "Other event id:%d", event->event_id);
             break;
     }
 }
 
 static void mqtt_app_start(void)
 {
-    char lwTopic[100];
-    sprintf(lwTopic, "homeassistant/number/%s/availability", config.Name);
-    const char* lwMessage = "offline\0";
+    const char* lwMessage = MQTT_PAYLOAD_OFFLINE;
     esp_mqtt_client_config_t mqtt_cfg = {
         .network = {
-            .reconnect_timeout_ms = 250, // Reconnect MQTT broker after this many ms
+            .disable_auto_reconnect = true, // The control task reconnects with backoff
+        },
+        .task = {
+            .priority = config.mqttTaskPriority,
+            .stack_size = config.mqttTaskStack,
         },
         .broker.address.uri = config.mqttBrokerUrl,
         .credentials = { 
@@ -370,7 +809,7 @@ static void mqtt_app_start(void)
             .protocol_ver = MQTT_PROTOCOL_V_3_1_1,
             .keepalive = 30, // 30 second keepalive timeout
             .last_will = {
-                .topic = lwTopic,
+                .topic = mqttTopics.availability,
                 .msg = (const char*)lwMessage,
                 .msg_len = strlen(lwMessage),
                 .qos = 1,
@@ -385,6 +824,425 @@ static void mqtt_app_start(void)
     if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client start error: %s", esp_err_to_name(err)); }
 }
 
+/*
+ * @brief Watchdog timer callback
+ *
+ *  Fires every WATCHDOG_KICK_MS from the FreeRTOS timer task and wakes the
+ *  control task so it can reset the watchdog and check the MQTT client,
+ *  independently of how often relay commands or power data arrive.
+ *
+ * @param xTimer The timer that expired.
+ */
+static void watchdog_timer_callback(TimerHandle_t xTimer)
+{
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_WATCHDOG, eSetBits); }
+}
+
+/*
+ * @brief Reconnect timer callback
+ *
+ *  Fires when the reconnect backoff delay has expired.
+ *
+ * @param xTimer The timer that expired.
+ */
+static void reconnect_timer_callback(TimerHandle_t xTimer)
+{
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_MQTT_RETRY, eSetBits); }
+}
+
+/*
+ * @brief Relay scheduler timer callback, wakes the control task for the next step or publish
+ */
+static void relay_step_timer_callback(TimerHandle_t xTimer)
+{
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_RELAY_STEP, eSetBits); }
+}
+
+/*
+ * @brief Metrics timer callback, wakes the control task to publish the metrics
+ */
+static void metrics_timer_callback(void* arg)
+{
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_METRICS, eSetBits); }
+}
+
+/*
+ * @brief Availability heartbeat timer callback
+ *
+ *  Runs in the esp_timer task, so just wake the control task to publish.
+ */
+static void heartbeat_timer_callback(void* arg)
+{
+    if (controlTaskHandle != NULL) { xTaskNotify(controlTaskHandle, CONTROL_NOTIFY_HEARTBEAT, eSetBits); }
+}
+
+/*
+ * @brief Schedule the next MQTT reconnect attempt
+ *
+ *  The delay doubles with each consecutive failure up to mqttReconnectMaxMs,
+ *  and half of it is randomised so a fleet of devices doesn't reconnect to
+ *  a restarted broker in lock step.
+ */
+static void mqtt_reconnect_schedule(void)
+{
+    if (mqttConnected || xTimerIsTimerActive(reconnectTimer) != pdFALSE) { return; }
+
+    int failures = atomic_load(&mqttReconnectFailures);
+    uint32_t delayMs = (config.mqttReconnectBaseMs > 0) ? config.mqttReconnectBaseMs : 500;
+    for (int i = 0; i < failures && delayMs < config.mqttReconnectMaxMs; i++) { delayMs *= 2; }
+    if (delayMs > config.mqttReconnectMaxMs) { delayMs = config.mqttReconnectMaxMs; }
+    delayMs = delayMs / 2 + esp_random() % (delayMs / 2 + 1);
+
+    ESP_LOGI(TAG, "MQTT reconnect %d scheduled in %lu ms.", failures + 1, (unsigned long)delayMs);
+    TickType_t ticks = pdMS_TO_TICKS(delayMs);
+    xTimerChangePeriod(reconnectTimer, (ticks > 0) ? ticks : 1, 0);   // Also starts the timer
+}
+
+/*
+ * @brief Stop and destroy the MQTT client, then start a new one from the configuration
+ */
+static void mqtt_client_rebuild(void)
+{
+    mqttRebuilds++;
+    MqttPublish_Reset();        // The old client's outbox goes with it
+    err = esp_mqtt_client_stop(client);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client stop error: %s", esp_err_to_name(err)); }
+    err = esp_mqtt_client_destroy(client);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client destroy error: %s", esp_err_to_name(err)); }
+    mqttConnected = false;
+    mqtt_app_start();
+}
+
+/*
+ * @brief Set up the relay model and the closed loop controller from the configuration
+ *
+ *  Also used when a configuration patch changes the gains, limits or
+ *  calibration, which starts the integral afresh.
+ */
+static void controller_configure(void)
+{
+    PowerManager_SetRelayLimits(config.maxSolarkW, config.maxBatteryChargekW);
+    relayCalibrationConfig_T calibrationConfig = {
+        .enabled = config.relayCalibrationEnabled,
+        .settleMs = config.relayCalibrationSettleMs,
+        .windowMs = config.relayCalibrationWindowMs,
+    };
+    RelayCalibration_Configure(&calibrationConfig);
+
+    exportControllerConfig_T controllerConfig = {
+        .kp = config.ctlKp,
+        .ki = config.ctlKi,
+        .deadbandkW = config.ctlDeadbandkW,
+        .targetGridkW = config.ctlTargetGridkW,
+        .minDwellMs = config.ctlMinDwellMs,
+        .maxStepsPerUpdate = config.ctlMaxStepsPerUpdate,
+    };
+    ExportController_Initialise(&exportController, &controllerConfig);
+}
+
+/*
+ * @brief Start, or restart, the metrics and availability heartbeat timers at their configured periods
+ */
+static void periodic_timers_configure(void)
+{
+    const esp_timer_create_args_t metricsArgs = { .callback = metrics_timer_callback, .name = "metrics" };
+    const esp_timer_create_args_t heartbeatArgs = { .callback = heartbeat_timer_callback, .name = "heartbeat" };
+
+    // Publish the runtime metrics periodically, unless they're disabled
+    if (metricsTimer == NULL && esp_timer_create(&metricsArgs, &metricsTimer) != ESP_OK) { metricsTimer = NULL; }
+    if (metricsTimer != NULL) { esp_timer_stop(metricsTimer); }   // Fails harmlessly if it isn't running
+    if (config.metricsPeriodMs > 0) {
+        uint64_t metricsUs = (uint64_t)((config.metricsPeriodMs >= 1000) ? config.metricsPeriodMs : 1000) * 1000;
+        if (metricsTimer == NULL || esp_timer_start_periodic(metricsTimer, metricsUs) != ESP_OK) {
+            ESP_LOGE(TAG, "Error starting the metrics timer.");
+        }
+    }
+
+    // Publish availability on a fixed period, independent of the time feed
+    if (heartbeatTimer == NULL && esp_timer_create(&heartbeatArgs, &heartbeatTimer) != ESP_OK) { heartbeatTimer = NULL; }
+    if (heartbeatTimer != NULL) { esp_timer_stop(heartbeatTimer); }
+    uint64_t heartbeatUs = (uint64_t)((config.availabilityPeriodMs >= 1000) ? config.availabilityPeriodMs : 10000) * 1000;
+    if (heartbeatTimer == NULL || esp_timer_start_periodic(heartbeatTimer, heartbeatUs) != ESP_OK) {
+        ESP_LOGE(TAG, "Error starting the availability heartbeat timer.");
+    }
+}
+
+/*
+ * @brief Re-apply the control task's subsystems after a configuration patch
+ *
+ * @param changed The CONFIG_CHANGED_ bits.
+ */
+static void config_changes_apply(int changed)
+{
+    if (changed & CONFIG_CHANGED_CONTROLLER) { controller_configure(); }
+    if (changed & CONFIG_CHANGED_RELAY) {
+        RelayScheduler_SetTimings(config.relayMinDwellMs, config.relayPublishSettleMs);
+        RelayState_SetLimits(config.relayRestoreMaxAgeS, config.relayRestoreUnknownAge);
+    }
+    if (changed & CONFIG_CHANGED_TIMERS) { periodic_timers_configure(); }
+    if (changed & CONFIG_CHANGED_WIFI) { wifi_reconfigure(); }
+    if (changed & CONFIG_CHANGED_MQTT) {
+        ESP_LOGI(TAG, "MQTT settings changed, starting a new client.");
+        mqtt_client_rebuild();
+    }
+}
+
+/*
+ * @brief Make an MQTT reconnect attempt
+ *
+ *  Reuses the existing client, and only destroys and recreates it after
+ *  mqttRebuildAfterFailures consecutive failures. If the attempt fails the
+ *  client posts another disconnect, which schedules the next attempt.
+ */
+static void mqtt_reconnect_attempt(void)
+{
+    if (mqttConnected) { return; }
+
+    int failures = atomic_fetch_add(&mqttReconnectFailures, 1) + 1;
+    mqttReconnects++;
+    if (config.mqttRebuildAfterFailures > 0 && failures % config.mqttRebuildAfterFailures == 0) {
+        ESP_LOGE(TAG, "MQTT client failed to reconnect %d times. Attempting to stop, destroy then restart it.", failures);
+        mqtt_client_rebuild();
+    } else {
+        err = esp_mqtt_client_reconnect(client);
+        if (err != ESP_OK) { 
+            ESP_LOGE(TAG, "MQTT client reconnect error: %s", esp_err_to_name(err)); 
+            mqtt_reconnect_schedule();
+        }
+    }
+}
+
+#if SOAK_TEST_ENABLE
+/*
+ * @brief Hand a soak test message to the MQTT task, which passes it to SoakTest_Handle
+ *
+ * @param event The synthetic message, copied by the client's event loop.
+ * @return true if it was queued.
+ */
+static bool soak_inject(esp_mqtt_event_handle_t event)
+{
+    return client != NULL && esp_mqtt_dispatch_custom_event(client, event) == ESP_OK;
+}
+
+/*
+ * @brief Publish a soak test report
+ *
+ * @param payload The report JSON, which stays valid until it's been sent.
+ */
+static void soak_report(const char* payload)
+{
+    MqttPublish_SendStatic(mqttTopics.soakState, MQTT_CLASS_TELEMETRY, payload);
+}
+#endif // SOAK_TEST_ENABLE
+
+/*
+ * @brief Relay control task
+ *
+ *  Blocks until the MQTT event handler or the watchdog timer notifies it,
+ *  then applies any relay change. Nothing runs between events.
+ *
+ * @param pvParameters Unused.
+ */
+static void control_task(void *pvParameters)
+{
+    uint32_t events = CONTROL_NOTIFY_RELAY; // Apply anything that arrived before the task started
+    relayValue_T oldRelayValue = atomic_load(&relayValue);  // Value currently on the relays
+    relayValue_T targetRelayValue = oldRelayValue;          // Value the relay scheduler is moving towards
+    uint32_t powerSequence = 0;                         // Snapshot sequence of the last power values used
+    bool powerStale = false;                            // The power values are too old to act on
+    uint32_t actuatedEventUs = 0;                       // Arrival time of the event behind the last relay change
+    bool stackWarned = false;                           // The low stack warning has been logged
+    powerManager_T power;
+
+#if !CONFIG_ESP_TASK_WDT_INIT
+    // Subscribe this task to the watchdog we manually configured
+    err = esp_task_wdt_add(NULL);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error subscribing the control task to the watchdog: %d = %s", err, esp_err_to_name(err)); }
+#endif // !CONFIG_ESP_TASK_WDT_INIT
+
+    while(true) {
+        if (events & CONTROL_NOTIFY_WATCHDOG) {
+            Metrics_RecordLoopTick(esp_timer_get_time(), WATCHDOG_KICK_MS * 1000);
+
+            // Catch a disconnect we weren't told about, or one from before the task started
+            if (!mqttConnected && xTimerIsTimerActive(reconnectTimer) == pdFALSE) { events |= CONTROL_NOTIFY_MQTT_DOWN; }
+
+#if !CONFIG_ESP_TASK_WDT_INIT
+            // Reset the watchdog if we manually configured it.
+            err = esp_task_wdt_reset();
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Error resetting the watchdog: %d = %s", err, esp_err_to_name(err));
+            }
+#endif // #if !CONFIG_ESP_TASK_WDT_INIT
+
+            // Keep the saved relay state and learned relay power curves current
+            RelayState_Tick();
+            RelayCalibration_Tick();
+
+            // The metrics report the high water mark, this makes sure a near overflow gets noticed
+            UBaseType_t stackFree = uxTaskGetStackHighWaterMark(NULL);
+            if (!stackWarned && stackFree < CONTROL_TASK_STACK_WARN) {
+                ESP_LOGW(TAG, "Control task stack is down to %u bytes free of %u.", (unsigned int)stackFree, CONTROL_TASK_STACK);
+                stackWarned = true;
+            }
+        }
+
+        // Re-apply whatever a configuration patch changed, then save or export it
+        if (events & CONTROL_NOTIFY_CONFIG) { config_changes_apply(atomic_exchange(&configChanges, 0)); }
+        if (atomic_exchange(&configSavePending, false) && !SaveConfiguration()) { ESP_LOGE(TAG, "Error saving the configuration."); }
+        if (atomic_exchange(&configExportPending, false) && ExportConfiguration()) { ESP_LOGI(TAG, "Exported the configuration."); }
+
+        // Publish availability at QoS 0 without retain. The retained online on connect and the
+        // retained offline last will carry the state, so the heartbeat doesn't rewrite the broker's copy.
+        if ((events & CONTROL_NOTIFY_HEARTBEAT) && atomic_load(&mqttConnected)) {
+            MqttPublish_SendStatic(mqttTopics.availability, MQTT_CLASS_TELEMETRY, MQTT_PAYLOAD_ONLINE);
+        }
+
+        // Publish the runtime metrics, they're only of use while fresh
+        if ((events & CONTROL_NOTIFY_METRICS) && atomic_load(&mqttConnected)) {
+            static char payload[METRICS_PAYLOAD_LEN];   // Only this task uses it, so keep it off the stack
+            metricsCounters_T counters = {
+                .mqttReconnects = mqttReconnects,
+                .mqttRebuilds = mqttRebuilds,
+                .mqttMessagesQueued = MqttPublish_Backlog(),
+                .mqttOutboxBytes = esp_mqtt_client_get_outbox_size(client),
+            };
+            if (Metrics_Format(payload, sizeof(payload), &counters) > 0) {
+                MqttPublish_Send(mqttTopics.metricsState, MQTT_CLASS_TELEMETRY, payload);
+                ESP_LOGV(TAG, "Published metrics message, payload=%s", payload);
+            } else {
+                ESP_LOGE(TAG, "Metrics payload too long.");
+            }
+        }
+
+        if (events & CONTROL_NOTIFY_MQTT_RETRY) {
+            mqtt_reconnect_attempt();
+        } else if (events & CONTROL_NOTIFY_MQTT_DOWN) {
+            mqtt_reconnect_schedule();
+        }
+
+        // Save power while there's no solar production, and wake on the first sample with some.
+        // While idle the Envoy is polled less often.
+        if ((events & CONTROL_NOTIFY_POWER) && config.idleModeEnabled) {
+            PowerManager_SnapshotRead(&powerSnapshot, &power);
+            if (PowerSave_Update(power.solarPowerkW, esp_timer_get_time()) && localPowerFields != 0) {
+                PowerPoll_SetPeriod(PowerSave_Idle() ? config.idlePollMs : config.envoyPollMs);
+            }
+        }
+
+        relayValue_T newRelayValue = targetRelayValue;
+        bool manual = atomic_load(&manualControl);
+
+        // Use the commanded value to set the relays if we're in manual control. The command
+        // handler only accepts valid relay codes.
+        if ((events & CONTROL_NOTIFY_RELAY) && manual) {
+            newRelayValue = atomic_load(&commandedRelayValue);
+            ESP_LOGV(TAG, "Set relay value to $%0*X", RELAY_CHANNELS, newRelayValue);
+        }
+
+        // Curtail only if it's enabled and the price policy wants it for now
+        bool curtail = false;
+        uint32_t sequence = powerSequence;
+        if (manual == false && atomic_load(&curtailmentEnabled)) {
+            sequence = PowerManager_SnapshotRead(&powerSnapshot, &power);
+            curtail = PricePolicy_Curtail(clockSet ? time(NULL) : 0, power.exportPrice);
+        }
+
+        // If we're not curtailing & not manual force the relay value to zero (maximum solar output)
+        if (curtail == false && manual == false) {
+            newRelayValue = 0;
+        } else if ((events & CONTROL_NOTIFY_POWER) && manual == false) {
+            // We're curtailing and not manual - calculate the desired relay settings 
+            // if we have received new valid power information
+            if (sequence != powerSequence) {
+                powerSequence = sequence;
+                PowerManager_HistoryAdd(&power, oldRelayValue);
+                RelayCalibration_Sample(power.solarPowerkW, oldRelayValue, power.receivedUs);
+                if (config.controllerMode == CONTROLLER_MODE_PI) {
+                    newRelayValue = ExportController_Update(&exportController, &power, oldRelayValue, esp_timer_get_time());
+                } else {
+                    newRelayValue = CalculateRelaySettings(&power, oldRelayValue);
+                }
+            }
+        }
+
+        // Don't act on power values of unknown or excessive age, fall back to a safe relay value instead.
+        // Checked on every wakeup, so the watchdog tick bounds how late this is noticed.
+        if (curtail && manual == false && config.powerMaxAgeMs > 0) {
+            PowerManager_SnapshotRead(&powerSnapshot, &power);
+            int64_t ageMs = (esp_timer_get_time() - power.receivedUs) / 1000;
+            bool stale = ageMs > config.powerMaxAgeMs;
+            if (stale) { newRelayValue = RELAY_VALUE_ALL(config.powerStaleRelayValue); }
+            if (stale != powerStale) {
+                powerStale = stale;
+                char payload[POWER_STATUS_PAYLOAD_LEN];
+                snprintf(payload, sizeof(payload), "{\"state\": \"%s\", \"ageMs\": %lld, \"sequence\": %lu}",
+                    stale ? "stale" : "fresh", (long long)ageMs, (unsigned long)power.sourceSequence);
+                if (stale) {
+                    ESP_LOGW(TAG, "Power values are %lld ms old, falling back to relay value %d.", (long long)ageMs, config.powerStaleRelayValue);
+                } else {
+                    ESP_LOGI(TAG, "Power values are fresh again.");
+                }
+                MqttPublish_Send(mqttTopics.powerStatus, MQTT_CLASS_STATE, payload);
+                ESP_LOGV(TAG, "Published power status message, payload=%s", payload);
+            }
+        }
+
+        // Remember when the event behind this decision arrived, to measure actuation latency
+        uint32_t eventUs = 0;
+        if ((events & CONTROL_NOTIFY_RELAY) && manual) {
+            eventUs = atomic_load(&relayCommandUs);
+        } else if ((events & CONTROL_NOTIFY_POWER) && manual == false && curtail) {
+            eventUs = (uint32_t)power.receivedUs;   // Read by the power decision above
+        }
+
+        // Let the scheduler decide how far towards the new value we can go right now
+        int64_t nowUs = esp_timer_get_time();
+        targetRelayValue = newRelayValue;
+        newRelayValue = RelayScheduler_Step(targetRelayValue, nowUs);
+        SoakTest_Mark(SOAK_STAGE_DECISION, eventUs);
+
+        // Has the relay value changed?
+        if (newRelayValue != oldRelayValue) {
+            ESP_LOGI(TAG, "Relay value changed from %0*X to %0*X (target %0*X) ... setting relays.",
+                RELAY_CHANNELS, oldRelayValue, RELAY_CHANNELS, newRelayValue, RELAY_CHANNELS, targetRelayValue);
+            oldRelayValue = newRelayValue; // update the relay value
+            atomic_store(&relayValue, newRelayValue);
+            RelayState_Update(newRelayValue);
+
+            // Set the relays
+            RelayOutput_Write(newRelayValue);
+            if (eventUs != 0) { Metrics_RecordActuation((uint32_t)esp_timer_get_time() - eventUs); }
+            SoakTest_Mark(SOAK_STAGE_ACTUATION, eventUs);
+            actuatedEventUs = eventUs;
+        }
+
+        // Update the MQTT relay value messages once the value has settled, for the channels that changed
+        relayValue_T settledRelayValue, previousRelayValue;
+        if (RelayScheduler_TakePublish(nowUs, &settledRelayValue, &previousRelayValue)) {
+            for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+                unsigned int code = RELAY_VALUE_CODE(settledRelayValue, channel);
+                if (code == RELAY_VALUE_CODE(previousRelayValue, channel)) { continue; }
+                char payload[4];
+                snprintf(payload, sizeof(payload), "%u", code);
+                MqttPublish_Send(mqttTopics.relayCommand[channel], MQTT_CLASS_STATE, payload);
+                ESP_LOGI(TAG, "Published Envoy Relay command message, topic=%s, payload=%s", mqttTopics.relayCommand[channel], payload);
+            }
+            SoakTest_Mark(SOAK_STAGE_PUBLISH, actuatedEventUs);
+        }
+
+        // Come back when the next step or publish is due
+        int64_t waitUs = RelayScheduler_NextWakeUs(nowUs);
+        if (waitUs >= 0) {
+            TickType_t ticks = pdMS_TO_TICKS(waitUs / 1000) + 1;
+            xTimerChangePeriod(relayStepTimer, ticks, 0);
+        }
+
+        // Sleep until the MQTT handler or the watchdog timer has something for us
+        xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY);
+    }
+}
+
 void app_main(void)
 {
     bool configMode = false;
@@ -404,42 +1262,46 @@ void app_main(void)
     }
 #endif // !CONFIG_ESP_TASK_WDT_INIT
 
+    // NVS is needed for the saved relay state, before anything else
+    err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGE(TAG, "NVS partition needs erasing: %d = %s.", err, esp_err_to_name(err));
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error at nvs_flash_init: %d = %s.", err, esp_err_to_name(err)); }
+
+    // Put the relays back the way they were before the reset, so curtailment carries on while
+    // the network comes up. Otherwise start at 0 (maximum output).
+    relayValue_T bootRelayValue = 0;
+    if (RelayState_Restore(&bootRelayValue)) {
+        ESP_LOGI(TAG, "Restored relay value %0*X from before the reset.", RELAY_CHANNELS, bootRelayValue);
+    }
+    atomic_store(&relayValue, bootRelayValue);
+    atomic_store(&commandedRelayValue, bootRelayValue);
+    RelayState_Update(bootRelayValue);
+
     // GPIO setup
     gpio_set_direction(BUTTON_PIN, GPIO_MODE_INPUT);
     gpio_set_pull_mode(BUTTON_PIN, GPIO_PULLUP_ONLY);
-    gpio_set_direction(RELAY0, GPIO_MODE_OUTPUT);
-    gpio_set_level(RELAY0, 0);
-    gpio_set_direction(RELAY1, GPIO_MODE_OUTPUT);
-    gpio_set_level(RELAY1, 0);
-    gpio_set_direction(RELAY2, GPIO_MODE_OUTPUT);
-    gpio_set_level(RELAY2, 0);
-    gpio_set_direction(RELAY3, GPIO_MODE_OUTPUT);
-    gpio_set_level(RELAY3, 0);
-
-    /*
+    RelayOutput_Initialise(bootRelayValue);
+
     // init the power values
     PowerManager_Initialise(&powerValues);
-    */
+    PowerManager_Initialise(&powerMerged);
+    powerMergeMutex = xSemaphoreCreateMutex();
+    PowerManager_SnapshotInitialise(&powerSnapshot);
+    if (!PowerManager_RelayModelInitialise()) {
+        ESP_LOGE(TAG, "FATAL error in the built in relay power tables. Resetting.");
+        vTaskDelay(5000 / portTICK_PERIOD_MS); // Sleep for 5 seconds in case someone is trying to read the error
+        esp_restart();
+    }
+    PowerManager_HistoryInitialise();
 
     // If the config button is pressed (or jumped to ground) go into config mode.
     if (gpio_get_level(BUTTON_PIN) == 0) { ESP_LOGI(TAG, "Button pressed, config mode active"); configMode = true; }
 
-    // Initialise the SPIFFS system
-    esp_vfs_spiffs_conf_t spiffs_conf = {
-        .base_path = "/spiffs",
-        .partition_label = NULL,
-        .max_files = 5,
-        .format_if_mount_failed = true};
-    
-    err = esp_vfs_spiffs_register(&spiffs_conf);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "SPIFFS Mount Failed: %s\r\n", esp_err_to_name(err));
-        ESP_LOGE(TAG, "Reformatting the SPIFFs partition, please restart.");
-        return;
-    }
-
-    // Load the configuration from the file system
+    // Load the configuration from NVS. SPIFFS is only mounted if the JSON file has to be imported.
     bool configLoad = LoadConfiguration();
     if (configLoad == false || config.configOK == false) 
     {
@@ -470,75 +1332,111 @@ void app_main(void)
         if (c == 'y' || c == 'Y') { UserConfigEntry(); }
     }
 
+    // Apply the configured log levels and move the power manager's logging off the hot path
+    LogControl_Initialise(config.logLevels);
+    PowerManager_SetLogHook(power_log_hook);
+
+    // Build all the MQTT topics and discovery payloads once
+    if (!MqttTopics_Build()) {
+        ESP_LOGE(TAG, "FATAL error building the MQTT topics. Resetting.");
+        vTaskDelay(5000 / portTICK_PERIOD_MS); // Sleep for 5 seconds in case someone is trying to read the error
+        esp_restart();
+    }
+
+    // Start in the operating mode saved before the reset
+    operating_mode_apply(config.operatingMode);
+
+    // Register every outbound topic with the publish layer, with room for the payloads it copies
+    bool publishOK = MqttPublish_Initialise();
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.availability, 0);
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        publishOK = publishOK && MqttPublish_Register(mqttTopics.relayConfig[channel], 0);
+        publishOK = publishOK && MqttPublish_Register(mqttTopics.relayCommand[channel], 4);
+    }
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.metricsConfig, 0);
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.metricsState, METRICS_PAYLOAD_LEN);
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.powerStatus, POWER_STATUS_PAYLOAD_LEN);
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.configResult, CONFIG_RESULT_PAYLOAD_LEN);
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.modeConfig, 0);
+    publishOK = publishOK && MqttPublish_Register(mqttTopics.modeState, 0);
+    if (!publishOK) {
+        ESP_LOGE(TAG, "FATAL error setting up the MQTT publish layer. Resetting.");
+        vTaskDelay(5000 / portTICK_PERIOD_MS); // Sleep for 5 seconds in case someone is trying to read the error
+        esp_restart();
+    }
+
+    // Curtail on price if the policy is enabled
+    PricePolicy_Initialise(config.policyEnabled, config.policyExportThreshold);
+
+    // Saved relay states carry the staleness limits for the next boot
+    RelayState_SetLimits(config.relayRestoreMaxAgeS, config.relayRestoreUnknownAge);
+
+    // Set up the closed loop controller from the configuration
+    controller_configure();
+
+    // Scale the CPU frequency and light sleep while there's no solar production, if enabled
+    if (config.idleModeEnabled) {
+        powerSaveConfig_T saveConfig = {
+            .idleSolarkW = config.idleSolarkW,
+            .idleEnterMs = config.idleEnterMs,
+            .listenInterval = config.idleListenInterval,
+        };
+        PowerSave_Initialise(&saveConfig);
+    }
+
     // Start WiFi, wait for WiFi to connect and get IP
     wifi_connection();
-    int loops = 0;
-    while (loops < 30 && !wiFiGotIP) {
-        vTaskDelay(2000 / portTICK_PERIOD_MS); // Wait 2 seconds
+    EventBits_t wifiBits = xEventGroupWaitBits(wifiEventGroup, WIFI_GOT_IP_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(WIFI_CONNECT_TIMEOUT_MS));
+    if (wifiBits & WIFI_GOT_IP_BIT) {
+        ESP_LOGI(TAG, "WiFi got an IP address %lld ms after boot.", esp_timer_get_time() / 1000);
+    } else {
+        ESP_LOGE(TAG, "WiFi didn't get an IP address within %d seconds.", WIFI_CONNECT_TIMEOUT_MS / 1000);
     }
 
-    // Start mqtt, then wait up to 40 * 0.25 = 10 seconds for it to start
+    // Reconnects are driven from the control task, timed by this one shot timer
+    reconnectTimer = xTimerCreate("mqttReconnect", 1, pdFALSE, NULL, reconnect_timer_callback);
+
+    // Relay transitions are paced by the scheduler, which wakes the control task with this one shot timer
+    relayStepTimer = xTimerCreate("relayStep", 1, pdFALSE, NULL, relay_step_timer_callback);
+    RelayScheduler_Initialise(atomic_load(&relayValue), config.relayMinDwellMs, config.relayPublishSettleMs, esp_timer_get_time());
+
+    // Build the MQTT topic routing table, then start mqtt and wait up to 40 * 0.25 = 10 seconds for it to start
+    mqtt_routes_build();
     mqtt_app_start();
     int mqttWaits = 0;
     while (!mqttConnected && mqttWaits < 40) { vTaskDelay(250 / portTICK_PERIOD_MS); mqttWaits++; } 
     ESP_LOGI(TAG, "MQTT client started after %f seconds.", ((float)mqttWaits) * 0.25);
 
-    // Loop forever, processing MQTT events.
-    while(true) {
-        if (!mqttConnected) { 
-            ESP_LOGE(TAG, "Detected the MQTT client is offline in the main loop. Attempting to stop, destroy then restart it.");
-            err = esp_mqtt_client_stop(client);
-            if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client stop error: %s", esp_err_to_name(err)); }
-            err = esp_mqtt_client_destroy(client);
-            if (err != ESP_OK) { ESP_LOGE(TAG, "MQTT client destroy error: %s", esp_err_to_name(err)); }
-            mqtt_app_start();
-        }        
-
-        /*
-        // If curtailment is not enabled & not manual force the relay value to zero (maximum solar output)
-        if (curtailmentEnabled == false && manualControl == false) {
-            relayValue = 0;
-        } else if (powerValuesUpdated == true && manualControl == false) {
-            // We're curtailing and not manual - calculate the desired relay settings 
-            // if we have received valid power information
-            relayValue = CalculateRelaySettings(&powerValues, relayValue);
-            powerValuesUpdated = false;
-        }
-        */
-
-        // Has the relay value changed?
-        if (relayValue != oldRelayValue) {
-            ESP_LOGI(TAG, "Relay value changed from %u to %u ... setting relays.", oldRelayValue, relayValue);
-            oldRelayValue = relayValue; // update the relay value
-
-            // Set the relays
-            if (relayValue & 0x01) { gpio_set_level(RELAY0, 1); } else { gpio_set_level(RELAY0, 0); }
-            if (relayValue & 0x02) { gpio_set_level(RELAY1, 1); } else { gpio_set_level(RELAY1, 0); }
-            if (relayValue & 0x04) { gpio_set_level(RELAY2, 1); } else { gpio_set_level(RELAY2, 0); }
-            if (relayValue & 0x08) { gpio_set_level(RELAY3, 1); } else { gpio_set_level(RELAY3, 0);  }
-
-            // Update the MQTT relay value message
-            char topic[80];
-            char payload[80];
-            sprintf(topic, "homeassistant/number/%s/command", config.Name);
-            sprintf(payload, "%u", relayValue);
-            int msg_id = esp_mqtt_client_publish(client, topic, payload, 0, 1, 1); // Temp sensor config, set the retain flag on the message
-            mqttMessagesQueued++;
-            ESP_LOGI(TAG, "Published Envoy Relay command message successfully, msg_id=%d, topic=%s, payload=%s", msg_id, topic, payload);
-
-        }
+    // Poll the Envoy directly for the power values if it's configured. Home Assistant still provides the rest.
+    if (config.envoyUrl[0] != 0 && PowerPoll_Start(config.envoyUrl, config.envoyToken, config.envoyCert, config.envoyPollMs, &PowerSource_Envoy, local_power_handler)) {
+        localPowerFields = PowerSource_Envoy.fields;
+    }
 
-#if !CONFIG_ESP_TASK_WDT_INIT
-        // Reset the watchdog if we manually configured it.
-        err = esp_task_wdt_reset();
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error resetting the watchdog: %d = %s", err, esp_err_to_name(err));
-        }
-#endif // #if !CONFIG_ESP_TASK_WDT_INIT
+    // Hand over to the control task, woken by MQTT events and the watchdog timer. Pin it to its own
+    // core if we have one so relay updates aren't held up by the network stack.
+    BaseType_t controlCore = (config.controlTaskCore >= 0 && config.controlTaskCore < portNUM_PROCESSORS) ? config.controlTaskCore : tskNO_AFFINITY;
+    UBaseType_t controlPriority = (config.controlTaskPriority > 0 && config.controlTaskPriority < configMAX_PRIORITIES) ? config.controlTaskPriority : 5;
+    ESP_LOGI(TAG, "Starting the control task on core %d at priority %u", controlCore, controlPriority);
+    if (xTaskCreatePinnedToCore(control_task, "control", CONTROL_TASK_STACK, NULL, controlPriority, &controlTaskHandle, controlCore) != pdPASS) {
+        ESP_LOGE(TAG, "FATAL error creating the control task. Resetting.");
+        vTaskDelay(5000 / portTICK_PERIOD_MS); // Sleep for 5 seconds in case someone is trying to read the error
+        esp_restart();
+    }
+    watchdogTimer = xTimerCreate("watchdog", pdMS_TO_TICKS(WATCHDOG_KICK_MS), pdTRUE, NULL, watchdog_timer_callback);
+    if (watchdogTimer == NULL || xTimerStart(watchdogTimer, 0) != pdPASS) {
+        ESP_LOGE(TAG, "FATAL error starting the watchdog timer. Resetting.");
+        vTaskDelay(5000 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
 
-        // My app loop sleep, 250ms
-        vTaskDelay(250 / portTICK_PERIOD_MS);
+    // Publish the runtime metrics and availability periodically
+    periodic_timers_configure();
 
+#if SOAK_TEST_ENABLE
+    // Drive the handlers with synthetic messages and report the latencies, for bench testing only
+    if (!MqttPublish_Register(mqttTopics.soakState, 0)
+        || !SoakTest_Start("homeassistant/Power", mqttTopics.relayCommand, soak_inject, soak_report, controlTaskHandle)) {
+        ESP_LOGE(TAG, "Error starting the soak test.");
     }
-
-}
+#endif // SOAK_TEST_ENABLE
+}
\ No newline at end of file
@@ -25,20 +25,85 @@
 
 #define SLEEPTIME 30
 #define TWDT_TIMEOUT_MS 10000 // Watchdog timeout in milliseconds
+#define WATCHDOG_KICK_MS (TWDT_TIMEOUT_MS / 4) // Watchdog reset timer period in milliseconds
+
+#define WIFI_CONNECT_TIMEOUT_MS 60000  // Longest wait for WiFi to connect and get an IP at boot
+#define WIFI_GOT_IP_BIT BIT0
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "lastAP"
+
+#define CONTROL_TASK_STACK 6144             // Publish flush copy (512 bytes) under an NVS save or client rebuild, plus logging
+#define CONTROL_TASK_STACK_WARN 768         // Warn once if the control task's stack high water mark falls below this
+#define CONTROL_NOTIFY_RELAY    (1 << 0)    // A relay command was received
+#define CONTROL_NOTIFY_POWER    (1 << 1)    // New power values were decoded
+#define CONTROL_NOTIFY_WATCHDOG (1 << 2)    // Watchdog timer tick
+#define CONTROL_NOTIFY_MQTT_DOWN (1 << 3)   // The MQTT client disconnected or failed to connect
+#define CONTROL_NOTIFY_MQTT_RETRY (1 << 4)  // Reconnect backoff timer expired
+#define CONTROL_NOTIFY_HEARTBEAT (1 << 5)   // Time to publish availability
+#define CONTROL_NOTIFY_RELAY_STEP (1 << 6)  // The relay scheduler has a step or publish due
+#define CONTROL_NOTIFY_METRICS  (1 << 7)    // Time to publish the runtime metrics
+#define CONTROL_NOTIFY_CONFIG   (1 << 8)    // A configuration patch changed something the control task owns
+#define CONFIG_CHANGED_CONTROL_TASK (CONFIG_CHANGED_CONTROLLER | CONFIG_CHANGED_RELAY | CONFIG_CHANGED_TIMERS \
+    | CONFIG_CHANGED_WIFI | CONFIG_CHANGED_MQTT)
+#define CLOCK_RESYNC_US (3600LL * 1000000LL) // Reset the system clock from the time feed this often
+#define POWER_STATUS_PAYLOAD_LEN 96         // Power staleness JSON
+#define CONFIG_RESULT_PAYLOAD_LEN 192       // Configuration patch result JSON
 
 #define BUTTON_PIN GPIO_NUM_13
-#define RELAY0 GPIO_NUM_26
-#define RELAY1 GPIO_NUM_27
-#define RELAY2 GPIO_NUM_9
-#define RELAY3 GPIO_NUM_10
+// Relay output pins are in relayOutput.h
 #define S_TO_uS(s) (s * 1000000)
 #define uS_TO_S(s) (s / 1000000)
 
+// Last access point we connected to, cached in NVS for fast connect
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifiCachedAP_T;
+
 static void log_error_if_nonzero(const char *message, int error_code);
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+static bool wifi_cache_load(wifiCachedAP_T* ap);
+static void wifi_cache_save(const uint8_t* bssid, uint8_t channel);
+static void wifi_cache_clear(void);
+static void wifi_addressing_apply(void);
 void wifi_connection(void);
+static void wifi_reconfigure(void);
+static void mqtt_time_handler(esp_mqtt_event_handle_t event);
+static void mqtt_relay_command_handler(esp_mqtt_event_handle_t event);
+static void power_accept(powerManager_T* values, uint8_t fields, uint32_t sourceSequence);
+static void mqtt_power_accept(uint32_t sourceSequence);
+static void local_power_handler(powerManager_T* values, uint8_t fields);
+static void mqtt_power_handler(esp_mqtt_event_handle_t event);
+static void mqtt_power_binary_handler(esp_mqtt_event_handle_t event);
+static void mqtt_log_level_handler(esp_mqtt_event_handle_t event);
+static void mqtt_tariff_handler(esp_mqtt_event_handle_t event);
+static void operating_mode_apply(int mode);
+static void mqtt_mode_publish(void);
+static void mqtt_mode_handler(esp_mqtt_event_handle_t event);
+static void config_save_request(void);
+static void mqtt_config_export_handler(esp_mqtt_event_handle_t event);
+static void mqtt_config_handler(esp_mqtt_event_handle_t event);
+static void power_log_hook(int level, uint8_t event, const float* values, int count);
+static void mqtt_route_add(const char* topic, int qos, mqttTopicHandler_T handler);
+static void mqtt_routes_build(void);
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
 static void mqtt_app_start(void);
+static void watchdog_timer_callback(TimerHandle_t xTimer);
+static void reconnect_timer_callback(TimerHandle_t xTimer);
+static void heartbeat_timer_callback(void* arg);
+static void metrics_timer_callback(void* arg);
+static void relay_step_timer_callback(TimerHandle_t xTimer);
+static void mqtt_reconnect_schedule(void);
+static void mqtt_client_rebuild(void);
+static void controller_configure(void);
+static void periodic_timers_configure(void);
+static void config_changes_apply(int changed);
+static void mqtt_reconnect_attempt(void);
+static void control_task(void *pvParameters);
+#if SOAK_TEST_ENABLE
+static bool soak_inject(esp_mqtt_event_handle_t event);
+static void soak_report(const char* payload);
+#endif // SOAK_TEST_ENABLE
 void app_main(void);
 
 #endif // __MAIN_H__
\ No newline at end of file
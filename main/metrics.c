@@ -0,0 +1,136 @@
+/* Runtime metrics
+   
+   Cheap counters and timings recorded on the hot paths, formatted into a
+   single JSON payload for a Home Assistant diagnostic sensor. Timings cover
+   the period since the last report, heap and stack figures are sampled
+   when the report is made.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "metrics.h"
+
+// Each timing is only written by one task. A report racing an update at worst
+// mixes two periods, which doesn't matter for diagnostics.
+static metricTiming_T decodeTiming;         // MQTT task, power message decode
+static metricTiming_T actuationTiming;      // Control task, event arrival to relay write
+static metricTiming_T jitterTiming;         // Control task, watchdog tick lateness
+static int64_t lastTickUs = 0;
+static UBaseType_t mqttStackMin = UINT32_MAX;   // MQTT task stack high water mark, bytes on ESP-IDF
+
+static void TimingRecord(metricTiming_T* t, uint32_t us)
+{
+    t->count++;
+    t->totalUs += us;
+    if (us > t->maxUs) { t->maxUs = us; }
+}
+
+static uint32_t TimingMean(const metricTiming_T* t)
+{
+    return (t->count > 0) ? t->totalUs / t->count : 0;
+}
+
+// ---------------------------------------------------
+// Record how long a power message took to decode
+// ---------------------------------------------------
+void Metrics_RecordDecode(uint32_t durationUs)
+{
+    TimingRecord(&decodeTiming, durationUs);
+}
+
+// ---------------------------------------------------
+// Record the latency from an event arriving to the relays being written
+// ---------------------------------------------------
+void Metrics_RecordActuation(uint32_t latencyUs)
+{
+    TimingRecord(&actuationTiming, latencyUs);
+}
+
+// ---------------------------------------------------
+// Record a control loop watchdog tick, to measure how late the loop runs
+//
+// Params - nowUs - esp_timer time of the tick
+//        - expectedPeriodUs - the watchdog timer period
+// ---------------------------------------------------
+void Metrics_RecordLoopTick(int64_t nowUs, uint32_t expectedPeriodUs)
+{
+    if (lastTickUs > 0) {
+        int64_t jitterUs = (nowUs - lastTickUs) - expectedPeriodUs;
+        TimingRecord(&jitterTiming, (uint32_t)((jitterUs < 0) ? -jitterUs : jitterUs));
+    }
+    lastTickUs = nowUs;
+}
+
+// ---------------------------------------------------
+// Sample the stack high water mark of the MQTT task. Call from an MQTT event handler.
+// ---------------------------------------------------
+void Metrics_SampleMqttStack(void)
+{
+    UBaseType_t hwm = uxTaskGetStackHighWaterMark(NULL);
+    if (hwm < mqttStackMin) { mqttStackMin = hwm; }
+}
+
+// ---------------------------------------------------
+// Get the lowest MQTT task stack high water mark seen, 0 if it hasn't been sampled
+// ---------------------------------------------------
+uint32_t Metrics_MqttStackFree(void)
+{
+    return (mqttStackMin == UINT32_MAX) ? 0 : mqttStackMin;
+}
+
+// ---------------------------------------------------
+// Format the metrics as JSON and start a new reporting period
+//
+// Must be called from the control task, as it samples that task's stack.
+//
+// Params - payload - buffer for the JSON
+//        - len - size of the buffer
+//        - counters - counters from other modules to include
+// Returns- the length of the JSON, or -1 if it didn't fit
+// ---------------------------------------------------
+int Metrics_Format(char* payload, size_t len, const metricsCounters_T* counters)
+{
+    int n = snprintf(payload, len, 
+        "{\"freeHeap\": %lu, \"minFreeHeap\": %lu, \"largestFreeBlock\": %lu, "
+        "\"controlStackFree\": %lu, \"mqttStackFree\": %lu, "
+        "\"decodeMeanUs\": %lu, \"decodeMaxUs\": %lu, \"decodes\": %lu, "
+        "\"actuationMeanUs\": %lu, \"actuationMaxUs\": %lu, \"actuations\": %lu, "
+        "\"loopJitterMeanUs\": %lu, \"loopJitterMaxUs\": %lu, "
+        "\"mqttReconnects\": %d, \"mqttRebuilds\": %d, \"mqttQueued\": %d, \"mqttOutboxBytes\": %d, "
+        "\"uptimeS\": %lld}",
+        (unsigned long)esp_get_free_heap_size(), (unsigned long)esp_get_minimum_free_heap_size(),
+        (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+        (unsigned long)uxTaskGetStackHighWaterMark(NULL), (unsigned long)Metrics_MqttStackFree(),
+        (unsigned long)TimingMean(&decodeTiming), (unsigned long)decodeTiming.maxUs, (unsigned long)decodeTiming.count,
+        (unsigned long)TimingMean(&actuationTiming), (unsigned long)actuationTiming.maxUs, (unsigned long)actuationTiming.count,
+        (unsigned long)TimingMean(&jitterTiming), (unsigned long)jitterTiming.maxUs,
+        counters->mqttReconnects, counters->mqttRebuilds, counters->mqttMessagesQueued, counters->mqttOutboxBytes,
+        (long long)(esp_timer_get_time() / 1000000));
+
+    decodeTiming = (metricTiming_T){ 0 };
+    actuationTiming = (metricTiming_T){ 0 };
+    jitterTiming = (metricTiming_T){ 0 };
+    return (n > 0 && n < len) ? n : -1;
+}
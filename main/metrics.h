@@ -0,0 +1,28 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#define METRICS_PAYLOAD_LEN 512
+
+// Count, max and mean of a duration over one reporting period
+typedef struct {
+    uint32_t count;
+    uint32_t totalUs;
+    uint32_t maxUs;
+} metricTiming_T;
+
+// Counters owned by other modules, reported with the metrics
+typedef struct {
+    int mqttReconnects;
+    int mqttRebuilds;
+    int mqttMessagesQueued;
+    int mqttOutboxBytes;
+} metricsCounters_T;
+
+void Metrics_RecordDecode(uint32_t durationUs);
+void Metrics_RecordActuation(uint32_t latencyUs);
+void Metrics_RecordLoopTick(int64_t nowUs, uint32_t expectedPeriodUs);
+void Metrics_SampleMqttStack(void);
+uint32_t Metrics_MqttStackFree(void);
+int Metrics_Format(char* payload, size_t len, const metricsCounters_T* counters);
+
+#endif // __METRICS_H__
@@ -0,0 +1,327 @@
+/* Outbound MQTT publishing
+   
+   Every outbound topic has a slot holding its latest message. Messages are
+   handed to the client with esp_mqtt_client_enqueue, so the caller never
+   waits on the network, and the client's task sends them. While a QoS 1
+   message to a topic waits for its PUBACK, or while disconnected, newer
+   messages to that topic replace the waiting one instead of queueing behind
+   it, so the backlog is at most one message per topic however long the
+   broker is away.
+
+   The client's task holds the client lock while it dispatches events to
+   us, so our lock is never held across a call into the client.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "mqttPublish.h"
+
+#define MQTT_PUBLISH_SENDING (-1)   // inFlightId while the slot's message is being enqueued
+#define MQTT_PUBLISH_EARLY_ACKS 4   // PUBACKs remembered that arrived before their enqueue call returned
+
+typedef struct {
+    uint8_t qos;
+    bool retain;
+} publishClass_T;
+
+static const publishClass_T classes[MQTT_CLASS_COUNT] = {
+    [MQTT_CLASS_DISCOVERY] = { .qos = 1, .retain = true },
+    [MQTT_CLASS_STATE] = { .qos = 1, .retain = true },
+    [MQTT_CLASS_TELEMETRY] = { .qos = 0, .retain = false },
+};
+
+typedef struct {
+    const char* topic;          // From mqttTopics, matched by pointer
+    char* buffer;               // Space for copied payloads, NULL if only static ones are sent
+    size_t bufferLen;
+    const char* payload;        // The latest message, in buffer or static
+    uint8_t cls;
+    bool pending;               // payload hasn't been enqueued yet
+    int inFlightId;             // msg_id of a QoS 1 message waiting for its PUBACK, 0 for none
+} publishSlot_T;
+
+static publishSlot_T slots[MQTT_PUBLISH_SLOTS];
+static int slotCount = 0;
+static char pool[MQTT_PUBLISH_POOL_LEN];
+static size_t poolUsed = 0;
+static SemaphoreHandle_t lock = NULL;
+static esp_mqtt_client_handle_t client = NULL;
+static bool connected = false;
+static int earlyAcks[MQTT_PUBLISH_EARLY_ACKS];
+static int earlyAckNext = 0;
+
+static publishSlot_T* FindSlot(const char* topic)
+{
+    for (int i = 0; i < slotCount; i++) {
+        if (slots[i].topic == topic) { return &slots[i]; }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------
+// Did this message's PUBACK arrive before we knew its msg_id
+// -----------------------------------------------
+static bool TakeEarlyAck(int msgId)
+{
+    for (int i = 0; i < MQTT_PUBLISH_EARLY_ACKS; i++) {
+        if (earlyAcks[i] == msgId) {
+            earlyAcks[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+static publishSlot_T* FindInFlight(int msgId)
+{
+    for (int i = 0; i < slotCount; i++) {
+        if (msgId > 0 && slots[i].inFlightId == msgId) { return &slots[i]; }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------
+// Enqueue a slot's message if it can go now. Called and returns with the lock held.
+// -----------------------------------------------
+static void Flush(publishSlot_T* slot)
+{
+    char message[MQTT_PUBLISH_MAX_PAYLOAD];
+
+    while (connected && slot->pending && slot->inFlightId == 0) {
+        const publishClass_T* c = &classes[slot->cls];
+        const char* payload = slot->payload;
+        if (payload == slot->buffer) {
+            // A newer Send may overwrite the buffer while we're unlocked
+            strlcpy(message, slot->buffer, sizeof(message));
+            payload = message;
+        }
+        esp_mqtt_client_handle_t target = client;
+        slot->pending = false;
+        slot->inFlightId = MQTT_PUBLISH_SENDING;
+
+        xSemaphoreGive(lock);
+        int msgId = esp_mqtt_client_enqueue(target, slot->topic, payload, 0, c->qos, c->retain, true);
+        xSemaphoreTake(lock, portMAX_DELAY);
+
+        if (msgId < 0) {
+            ESP_LOGW(MQTT_TAG, "Couldn't enqueue a message to %s, keeping it for later.", slot->topic);
+            slot->pending = true;   // Still the latest message, or a newer one if it was replaced meanwhile
+            slot->inFlightId = 0;
+            return;                 // Retried on the next send, PUBACK or connection
+        }
+        slot->inFlightId = (c->qos > 0 && !TakeEarlyAck(msgId)) ? msgId : 0;
+        ESP_LOGV(MQTT_TAG, "Enqueued a message to %s, msg_id=%d", slot->topic, msgId);
+    }
+}
+
+static void FlushAll(void)
+{
+    for (int i = 0; i < slotCount; i++) { Flush(&slots[i]); }
+}
+
+// -----------------------------------------------
+// Replace a slot's message and send it if it can go now
+// -----------------------------------------------
+static bool Send(const char* topic, mqttPublishClass_T cls, const char* payload, bool copy)
+{
+    if (lock == NULL || cls >= MQTT_CLASS_COUNT) { return false; }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    publishSlot_T* slot = FindSlot(topic);
+    if (slot == NULL || (copy && (slot->buffer == NULL || strlen(payload) >= slot->bufferLen))) {
+        xSemaphoreGive(lock);
+        ESP_LOGE(MQTT_TAG, "Can't publish to %s, it isn't registered or the payload is too long.", topic);
+        return false;
+    }
+    if (copy) {
+        strcpy(slot->buffer, payload);
+        slot->payload = slot->buffer;
+    } else {
+        slot->payload = payload;
+    }
+    // A waiting message keeps its class if that's stronger, so a heartbeat can't stop the retained online going
+    if (slot->pending) { ESP_LOGV(MQTT_TAG, "Replaced a waiting message to %s.", topic); }
+    if (!slot->pending || cls < slot->cls) { slot->cls = cls; }
+    slot->pending = true;
+    Flush(slot);
+    xSemaphoreGive(lock);
+    return true;
+}
+
+// ---------------------------------------------------
+// Initialise the publish layer
+//
+// Returns- true on success
+// ---------------------------------------------------
+bool MqttPublish_Initialise(void)
+{
+    slotCount = 0;
+    poolUsed = 0;
+    connected = false;
+    if (lock == NULL) { lock = xSemaphoreCreateMutex(); }
+    return lock != NULL;
+}
+
+// ---------------------------------------------------
+// Register an outbound topic
+//
+// Params - topic - the topic, which must stay valid, and is matched by pointer
+//        - maxLen - room for the longest payload copied by MqttPublish_Send,
+//          including its terminator, or 0 if only MqttPublish_SendStatic is used
+// Returns- true on success, false if there are no slots or pool space left
+// ---------------------------------------------------
+bool MqttPublish_Register(const char* topic, size_t maxLen)
+{
+    if (slotCount == MQTT_PUBLISH_SLOTS || maxLen > MQTT_PUBLISH_MAX_PAYLOAD || poolUsed + maxLen > sizeof(pool)) {
+        ESP_LOGE(MQTT_TAG, "No room to register %s for publishing.", topic);
+        return false;
+    }
+    publishSlot_T* slot = &slots[slotCount++];
+    memset(slot, 0, sizeof(*slot));
+    slot->topic = topic;
+    if (maxLen > 0) {
+        slot->buffer = &pool[poolUsed];
+        slot->bufferLen = maxLen;
+        poolUsed += maxLen;
+    }
+    return true;
+}
+
+// ---------------------------------------------------
+// Publish a copy of a payload
+//
+// Params - topic - a registered topic
+//        - cls - sets the QoS and retain flag
+//        - payload - null terminated, copied before returning
+// Returns- true if the message will be sent, false if it couldn't be taken
+// ---------------------------------------------------
+bool MqttPublish_Send(const char* topic, mqttPublishClass_T cls, const char* payload)
+{
+    return Send(topic, cls, payload, true);
+}
+
+// ---------------------------------------------------
+// Publish a payload that stays valid, without copying it
+//
+// Params - topic - a registered topic
+//        - cls - sets the QoS and retain flag
+//        - payload - null terminated, kept until it's replaced
+// Returns- true if the message will be sent, false if it couldn't be taken
+// ---------------------------------------------------
+bool MqttPublish_SendStatic(const char* topic, mqttPublishClass_T cls, const char* payload)
+{
+    return Send(topic, cls, payload, false);
+}
+
+// ---------------------------------------------------
+// The client connected, send everything that was waiting
+//
+// Params - client - the connected client
+// ---------------------------------------------------
+void MqttPublish_Connected(esp_mqtt_client_handle_t mqttClient)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    client = mqttClient;
+    connected = true;
+    FlushAll();
+    xSemaphoreGive(lock);
+}
+
+// ---------------------------------------------------
+// The client disconnected, hold messages until it's back
+// ---------------------------------------------------
+void MqttPublish_Disconnected(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    connected = false;
+    xSemaphoreGive(lock);
+}
+
+// ---------------------------------------------------
+// A QoS 1 message was acknowledged, send the next one to its topic
+//
+// Params - msgId - from MQTT_EVENT_PUBLISHED
+// ---------------------------------------------------
+void MqttPublish_Acknowledged(int msgId)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    publishSlot_T* slot = FindInFlight(msgId);
+    if (slot != NULL) {
+        slot->inFlightId = 0;
+        Flush(slot);
+    } else if (msgId > 0) {
+        earlyAcks[earlyAckNext] = msgId;
+        earlyAckNext = (earlyAckNext + 1) % MQTT_PUBLISH_EARLY_ACKS;
+    }
+    xSemaphoreGive(lock);
+}
+
+// ---------------------------------------------------
+// The client gave up on a message, send it again unless it's been replaced
+//
+// Params - msgId - from MQTT_EVENT_DELETED
+// ---------------------------------------------------
+void MqttPublish_Expired(int msgId)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    publishSlot_T* slot = FindInFlight(msgId);
+    if (slot != NULL) {
+        ESP_LOGW(MQTT_TAG, "Message to %s expired, sending it again.", slot->topic);
+        slot->inFlightId = 0;
+        slot->pending = true;
+        Flush(slot);
+    }
+    xSemaphoreGive(lock);
+}
+
+// ---------------------------------------------------
+// The client and its outbox were destroyed
+//
+// Messages that were waiting for a PUBACK are sent again on the next
+// connection, as their PUBACKs won't come now.
+// ---------------------------------------------------
+void MqttPublish_Reset(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    connected = false;
+    client = NULL;
+    for (int i = 0; i < slotCount; i++) {
+        if (slots[i].inFlightId != 0) {
+            slots[i].inFlightId = 0;
+            slots[i].pending = true;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+// ---------------------------------------------------
+// Count of topics with a message waiting or in flight
+// ---------------------------------------------------
+int MqttPublish_Backlog(void)
+{
+    int backlog = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < slotCount; i++) {
+        if (slots[i].pending || slots[i].inFlightId != 0) { backlog++; }
+    }
+    xSemaphoreGive(lock);
+    return backlog;
+}
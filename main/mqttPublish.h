@@ -0,0 +1,29 @@
+#ifndef __MQTTPUBLISH_H__
+#define __MQTTPUBLISH_H__
+
+#include "mqtt_client.h"
+
+#define MQTT_PUBLISH_SLOTS 16           // Outbound topics, each holds at most one waiting message
+#define MQTT_PUBLISH_POOL_LEN 1024      // Copied payload space shared by all the slots
+#define MQTT_PUBLISH_MAX_PAYLOAD 512    // Largest copied payload, METRICS_PAYLOAD_LEN
+
+// Message classes, each with its own QoS and retain flag, strongest first
+typedef enum {
+    MQTT_CLASS_DISCOVERY = 0,   // Discovery payloads, QoS 1 retained
+    MQTT_CLASS_STATE,           // Entity state and availability, QoS 1 retained, only the latest value matters
+    MQTT_CLASS_TELEMETRY,       // Heartbeats and metrics, QoS 0 not retained, only of use while fresh
+    MQTT_CLASS_COUNT
+} mqttPublishClass_T;
+
+bool MqttPublish_Initialise(void);
+bool MqttPublish_Register(const char* topic, size_t maxLen);
+bool MqttPublish_Send(const char* topic, mqttPublishClass_T cls, const char* payload);
+bool MqttPublish_SendStatic(const char* topic, mqttPublishClass_T cls, const char* payload);
+void MqttPublish_Connected(esp_mqtt_client_handle_t client);
+void MqttPublish_Disconnected(void);
+void MqttPublish_Acknowledged(int msgId);
+void MqttPublish_Expired(int msgId);
+void MqttPublish_Reset(void);
+int MqttPublish_Backlog(void);
+
+#endif // __MQTTPUBLISH_H__
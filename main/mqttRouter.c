@@ -0,0 +1,113 @@
+/* MQTT topic router
+   
+   Maps exact inbound MQTT topics to handler functions using a small
+   open addressed hash table, and drives the subscriptions from the
+   same table so the two can't drift apart.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "mqtt_client.h"
+#include "commonvalues.h"
+#include "mqttRouter.h"
+
+static mqttRoute_T routes[MQTT_ROUTER_MAX_ROUTES];
+static int routeCount = 0;
+
+// -----------------------------------------------
+// FNV-1a hash of a (not null terminated) topic
+// -----------------------------------------------
+static uint32_t TopicHash(const char* topic, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) { h ^= (uint8_t)topic[i]; h *= 16777619u; }
+    return h;
+}
+
+// -----------------------------------------------
+// Remove all routes
+// -----------------------------------------------
+void MqttRouter_Clear(void)
+{
+    memset(routes, 0, sizeof(routes));
+    routeCount = 0;
+}
+
+// ---------------------------------------------------
+// Add a route for an exact topic
+//
+// Params - topic - the full topic to match
+//        - qos - QoS to subscribe with
+//        - handler - called with the event when a message arrives on topic
+// Returns- true on success, false if the table is full or the topic too long
+// ---------------------------------------------------
+bool MqttRouter_Add(const char* topic, int qos, mqttTopicHandler_T handler)
+{
+    int len = strlen(topic);
+    if (len >= MQTT_ROUTER_TOPIC_LEN || routeCount >= MQTT_ROUTER_MAX_ROUTES - 1) { return false; }
+
+    uint32_t h = TopicHash(topic, len);
+    int slot = h & (MQTT_ROUTER_MAX_ROUTES - 1);
+    while (routes[slot].handler != NULL) {
+        if (routes[slot].hash == h && routes[slot].len == len && memcmp(routes[slot].topic, topic, len) == 0) {
+            break; // Replace the existing route
+        }
+        slot = (slot + 1) & (MQTT_ROUTER_MAX_ROUTES - 1);
+    }
+    if (routes[slot].handler == NULL) { routeCount++; }
+    strcpy(routes[slot].topic, topic);
+    routes[slot].len = len;
+    routes[slot].hash = h;
+    routes[slot].qos = qos;
+    routes[slot].handler = handler;
+    return true;
+}
+
+// -----------------------------------------------
+// Subscribe to every routed topic
+// -----------------------------------------------
+void MqttRouter_Subscribe(esp_mqtt_client_handle_t client)
+{
+    for (int i = 0; i < MQTT_ROUTER_MAX_ROUTES; i++) {
+        if (routes[i].handler != NULL) {
+            int msg_id = esp_mqtt_client_subscribe(client, routes[i].topic, routes[i].qos);
+            ESP_LOGI(TAG, "Subscribe sent for %s, msg_id=%d", routes[i].topic, msg_id);
+        }
+    }
+}
+
+// ---------------------------------------------------
+// Dispatch an MQTT_EVENT_DATA event to its handler
+//
+// Params - event - the MQTT event
+// Returns- true if a handler was found for the topic
+// ---------------------------------------------------
+bool MqttRouter_Dispatch(esp_mqtt_event_handle_t event)
+{
+    uint32_t h = TopicHash(event->topic, event->topic_len);
+    int slot = h & (MQTT_ROUTER_MAX_ROUTES - 1);
+    while (routes[slot].handler != NULL) {
+        if (routes[slot].hash == h && routes[slot].len == event->topic_len && memcmp(routes[slot].topic, event->topic, event->topic_len) == 0) {
+            routes[slot].handler(event);
+            return true;
+        }
+        slot = (slot + 1) & (MQTT_ROUTER_MAX_ROUTES - 1);
+    }
+    return false;
+}
@@ -0,0 +1,22 @@
+#ifndef __MQTTROUTER_H__
+#define __MQTTROUTER_H__
+
+#define MQTT_ROUTER_MAX_ROUTES 16    // Must be a power of two, and leave some slots free
+#define MQTT_ROUTER_TOPIC_LEN 160
+
+typedef void (*mqttTopicHandler_T)(esp_mqtt_event_handle_t event);
+
+typedef struct {
+    char topic[MQTT_ROUTER_TOPIC_LEN];
+    int len;
+    uint32_t hash;
+    int qos;
+    mqttTopicHandler_T handler;
+} mqttRoute_T;
+
+void MqttRouter_Clear(void);
+bool MqttRouter_Add(const char* topic, int qos, mqttTopicHandler_T handler);
+void MqttRouter_Subscribe(esp_mqtt_client_handle_t client);
+bool MqttRouter_Dispatch(esp_mqtt_event_handle_t event);
+
+#endif // __MQTTROUTER_H__
@@ -0,0 +1,127 @@
+/* MQTT topics and Home Assistant discovery payloads
+   
+   Formats every topic and discovery payload once from the configuration,
+   so publishing never needs to build strings on the MQTT event path.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "config.h"
+#include "mqttTopics.h"
+
+mqttTopics_T mqttTopics;
+
+static char arena[MQTT_TOPICS_ARENA_SIZE];
+static size_t arenaUsed = 0;
+static bool arenaOverflow = false;
+
+// -----------------------------------------------
+// Format a string into the next free part of the arena
+// -----------------------------------------------
+static const char* ArenaPrintf(const char* format, ...)
+{
+    va_list args;
+    size_t space = sizeof(arena) - arenaUsed;
+
+    va_start(args, format);
+    int len = vsnprintf(&arena[arenaUsed], space, format, args);
+    va_end(args);
+    if (len < 0 || len >= space) {
+        arenaOverflow = true;
+        return "";
+    }
+    const char* result = &arena[arenaUsed];
+    arenaUsed += len + 1;
+    return result;
+}
+
+// ---------------------------------------------------
+// Build all the topics and discovery payloads
+//
+// Must be called after the configuration is loaded, and again if it changes.
+//
+// Returns- true on success, false if the arena was too small
+// ---------------------------------------------------
+bool MqttTopics_Build(void)
+{
+    arenaUsed = 0;
+    arenaOverflow = false;
+
+    mqttTopics.availability = ArenaPrintf("homeassistant/number/%s/availability", config.Name);
+    mqttTopics.powerBinary = ArenaPrintf("homeassistant/%s/power/bin", config.Name);
+    mqttTopics.powerStatus = ArenaPrintf("homeassistant/%s/power/status", config.Name);
+    mqttTopics.logLevelSet = ArenaPrintf("homeassistant/%s/log/set", config.Name);
+    mqttTopics.tariff = ArenaPrintf("homeassistant/%s/tariff", config.Name);
+    mqttTopics.configSet = ArenaPrintf("homeassistant/%s/config/set", config.Name);
+    mqttTopics.configResult = ArenaPrintf("homeassistant/%s/config/result", config.Name);
+    mqttTopics.configExport = ArenaPrintf("homeassistant/%s/config/export", config.Name);
+    mqttTopics.soakState = ArenaPrintf("homeassistant/%s/soak", config.Name);
+
+    // Use the same command and state topics so we don't have to echo commands to state. The first
+    // relay channel keeps the topics and unique_id from before there were more channels.
+    mqttTopics.relayCommand[0] = ArenaPrintf("homeassistant/number/%s/command", config.Name);
+    mqttTopics.relayConfig[0] = ArenaPrintf("homeassistant/number/%s/config", config.Name);
+    mqttTopics.relayDiscovery[0] = ArenaPrintf("{\"unique_id\": \"T_%s\", "
+        "\"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, "
+        "\"availability\": {\"topic\": \"%s\", \"payload_available\": \"" MQTT_PAYLOAD_ONLINE "\", \"payload_not_available\": \"" MQTT_PAYLOAD_OFFLINE "\"}, "
+        "\"min\":0, \"max\":15, \"retain\":true, "
+        "\"command_topic\": \"%s\", \"state_topic\": \"%s\"}",
+        config.UID, config.DeviceID, config.Name, mqttTopics.availability, mqttTopics.relayCommand[0], mqttTopics.relayCommand[0]);
+    for (unsigned int channel = 1; channel < RELAY_CHANNELS; channel++) {
+        mqttTopics.relayCommand[channel] = ArenaPrintf("homeassistant/number/%s/relay%u/command", config.Name, channel);
+        mqttTopics.relayConfig[channel] = ArenaPrintf("homeassistant/number/%s/relay%u/config", config.Name, channel);
+        mqttTopics.relayDiscovery[channel] = ArenaPrintf("{\"unique_id\": \"T_%s_%u\", \"name\": \"%s relay %u\", "
+            "\"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, "
+            "\"availability\": {\"topic\": \"%s\", \"payload_available\": \"" MQTT_PAYLOAD_ONLINE "\", \"payload_not_available\": \"" MQTT_PAYLOAD_OFFLINE "\"}, "
+            "\"min\":0, \"max\":15, \"retain\":true, "
+            "\"command_topic\": \"%s\", \"state_topic\": \"%s\"}",
+            config.UID, channel, config.Name, channel, config.DeviceID, config.Name, mqttTopics.availability,
+            mqttTopics.relayCommand[channel], mqttTopics.relayCommand[channel]);
+    }
+
+    // One diagnostic sensor for all the metrics, free heap as its state and everything else as attributes
+    mqttTopics.metricsConfig = ArenaPrintf("homeassistant/sensor/%s/metrics/config", config.Name);
+    mqttTopics.metricsState = ArenaPrintf("homeassistant/sensor/%s/metrics/state", config.Name);
+    mqttTopics.metricsDiscovery = ArenaPrintf("{\"unique_id\": \"M_%s\", \"name\": \"%s metrics\", "
+        "\"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, "
+        "\"availability\": {\"topic\": \"%s\", \"payload_available\": \"" MQTT_PAYLOAD_ONLINE "\", \"payload_not_available\": \"" MQTT_PAYLOAD_OFFLINE "\"}, "
+        "\"entity_category\": \"diagnostic\", \"unit_of_measurement\": \"B\", "
+        "\"state_topic\": \"%s\", \"value_template\": \"{{ value_json.freeHeap }}\", \"json_attributes_topic\": \"%s\"}",
+        config.UID, config.Name, config.DeviceID, config.Name, mqttTopics.availability, mqttTopics.metricsState, mqttTopics.metricsState);
+
+    // Operating mode select. Commands aren't retained, the state is, and we publish it when it changes.
+    mqttTopics.modeConfig = ArenaPrintf("homeassistant/select/%s/mode/config", config.Name);
+    mqttTopics.modeCommand = ArenaPrintf("homeassistant/select/%s/mode/set", config.Name);
+    mqttTopics.modeState = ArenaPrintf("homeassistant/select/%s/mode/state", config.Name);
+    mqttTopics.modeDiscovery = ArenaPrintf("{\"unique_id\": \"O_%s\", \"name\": \"%s mode\", "
+        "\"device\": {\"identifiers\": [\"%s\"], \"name\": \"%s\"}, "
+        "\"availability\": {\"topic\": \"%s\", \"payload_available\": \"" MQTT_PAYLOAD_ONLINE "\", \"payload_not_available\": \"" MQTT_PAYLOAD_OFFLINE "\"}, "
+        "\"options\": [\"manual\", \"auto\", \"off\"], "   // OPERATING_MODE_NAMES
+        "\"command_topic\": \"%s\", \"state_topic\": \"%s\"}",
+        config.UID, config.Name, config.DeviceID, config.Name, mqttTopics.availability, mqttTopics.modeCommand, mqttTopics.modeState);
+
+    if (arenaOverflow) {
+        ESP_LOGE(TAG, "MQTT topic arena is too small (%u bytes).", (unsigned int)sizeof(arena));
+        return false;
+    }
+    ESP_LOGI(TAG, "Built MQTT topics and discovery payloads, %u of %u bytes used.", (unsigned int)arenaUsed, (unsigned int)sizeof(arena));
+    return true;
+}
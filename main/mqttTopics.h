@@ -0,0 +1,43 @@
+#ifndef __MQTTTOPICS_H__
+#define __MQTTTOPICS_H__
+
+// Topics and discovery payloads are built once from the configuration into a static arena.
+// This is sized for the longest Name, DeviceID and UID the configuration can hold.
+// Every relay channel after the first adds its own number entity.
+#define MQTT_TOPICS_FIXED_SIZE 2048
+#define MQTT_TOPICS_RELAY_FIXED_SIZE 512
+#define MQTT_TOPICS_ARENA_SIZE (MQTT_TOPICS_FIXED_SIZE + 36 * sizeof(((Configuration*)0)->Name) \
+    + 3 * sizeof(((Configuration*)0)->DeviceID) + 3 * sizeof(((Configuration*)0)->UID) \
+    + (RELAY_CHANNELS - 1) * (MQTT_TOPICS_RELAY_FIXED_SIZE + 7 * sizeof(((Configuration*)0)->Name) \
+    + sizeof(((Configuration*)0)->DeviceID) + sizeof(((Configuration*)0)->UID)))
+
+#define MQTT_PAYLOAD_ONLINE "online"
+#define MQTT_PAYLOAD_OFFLINE "offline"
+
+typedef struct {
+    const char* availability;       // Availability for all of the device's entities
+    const char* relayCommand[RELAY_CHANNELS];   // Relay number commands, also used as their state topics
+    const char* relayConfig[RELAY_CHANNELS];    // Relay number discovery topics
+    const char* relayDiscovery[RELAY_CHANNELS]; // Relay number discovery payloads
+    const char* powerBinary;        // Compact binary power records
+    const char* powerStatus;        // Power value staleness diagnostic
+    const char* metricsConfig;      // Metrics sensor discovery topic
+    const char* metricsDiscovery;   // Metrics sensor discovery payload
+    const char* metricsState;       // Metrics JSON, the sensor's state and attributes
+    const char* logLevelSet;        // Module log level commands, see LogControl_SetLevels
+    const char* tariff;             // Tariff forecasts for the price policy
+    const char* configSet;          // Partial configuration patches, see ConfigurationPatch
+    const char* configResult;       // Result of the last configuration patch
+    const char* configExport;       // Any message exports the configuration to the JSON file
+    const char* modeConfig;         // Mode select discovery topic
+    const char* modeDiscovery;      // Mode select discovery payload
+    const char* modeCommand;        // Mode select commands
+    const char* modeState;          // Mode select state, published by us on change
+    const char* soakState;          // Soak test results, see soakTest.h
+} mqttTopics_T;
+
+extern mqttTopics_T mqttTopics;
+
+bool MqttTopics_Build(void);
+
+#endif // __MQTTTOPICS_H__
@@ -20,16 +20,198 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "esp_log.h"
 #include "cJSON.h"
 #include "commonvalues.h"
 #include "powerManager.h"
 
-// Relay power % table
-const float relayPower[16] = {1.0, 0.94, 0.88, 0.82, 0.76, 0.64, 0.58, 0.52, 0.46, 0.40, 0.34, 0.28, 0.22, 0.16, 0.10};
-const float maxSolarPowerkW = 8.2;
-const float maxBatteryChargekW = 5.0;
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "PowerManager_DecodeBinary assumes a little endian target"
+#endif
+
+#if POWERMANAGER_TRACE
+#define PM_TRACE(...) ESP_LOGI(POWER_TAG, __VA_ARGS__)
+#else
+#define PM_TRACE(...)
+#endif
+
+// Built in relay power % tables, one per channel with an entry per DRM relay code. Each table must
+// be strictly decreasing. RelayCalibration replaces them with curves learned from the site.
+#define RELAY_POWER_6PC_STEPS {1.00, 0.94, 0.88, 0.82, 0.76, 0.70, 0.64, 0.58, 0.52, 0.46, 0.40, 0.34, 0.28, 0.22, 0.16, 0.10}
+#define RELAY_CHANNEL0_POWER RELAY_POWER_6PC_STEPS
+#define RELAY_CHANNEL1_POWER RELAY_POWER_6PC_STEPS
+#define RELAY_CHANNEL2_POWER RELAY_POWER_6PC_STEPS
+#define RELAY_CHANNEL3_POWER RELAY_POWER_6PC_STEPS
+
+// A short table would otherwise be zero filled, breaking the strictly decreasing order
+#define RELAY_POWER_ENTRIES(table) (sizeof((float[])table) / sizeof(float))
+_Static_assert(RELAY_POWER_ENTRIES(RELAY_CHANNEL0_POWER) == RELAY_STEPS, "RELAY_CHANNEL0_POWER must have an entry for every relay code");
+_Static_assert(RELAY_POWER_ENTRIES(RELAY_CHANNEL1_POWER) == RELAY_STEPS, "RELAY_CHANNEL1_POWER must have an entry for every relay code");
+_Static_assert(RELAY_POWER_ENTRIES(RELAY_CHANNEL2_POWER) == RELAY_STEPS, "RELAY_CHANNEL2_POWER must have an entry for every relay code");
+_Static_assert(RELAY_POWER_ENTRIES(RELAY_CHANNEL3_POWER) == RELAY_STEPS, "RELAY_CHANNEL3_POWER must have an entry for every relay code");
+
+static const float defaultRelayPower[RELAY_CHANNELS][RELAY_STEPS] = {
+    RELAY_CHANNEL0_POWER,
+#if RELAY_CHANNELS > 1
+    RELAY_CHANNEL1_POWER,
+#endif
+#if RELAY_CHANNELS > 2
+    RELAY_CHANNEL2_POWER,
+#endif
+#if RELAY_CHANNELS > 3
+    RELAY_CHANNEL3_POWER,
+#endif
+};
+static float relayPower[RELAY_CHANNELS][RELAY_STEPS];      // Tables in use
+static float channelMaxSolarkW[RELAY_CHANNELS];            // Each channel's maximum solar production
+static float maxBatteryChargekW = POWER_DEFAULT_MAX_BATTERY_CHARGE_KW;
+
+// Curtailment levels across all of the channels, rebuilt by RelayModelBuild whenever a table or limit changes.
+// Adjacent levels are one relay step apart on one channel, so moving n levels costs n steps.
+static relayValue_T levelValue[RELAY_LEVELS];   // Relay value at each level, level 0 is full production
+static float levelPower[RELAY_LEVELS];          // Fraction of the total production at each level, strictly decreasing
+static float channelShare[RELAY_CHANNELS];      // Each channel's fraction of the total production
+static float maxSolarPowerkW = 0.0;             // All of the channels together
+
+// Monotonic queue of history slots, for sliding window min or max in amortised O(1)
+typedef struct {
+    uint16_t slot[POWER_HISTORY_SAMPLES];
+    uint16_t front;
+    uint16_t len;
+} historyQueue_T;
+
+// Power history ring buffer, structure of arrays in int16 watts. Only the control task uses it.
+static struct {
+    int16_t valueW[POWER_FIELD_COUNT][POWER_HISTORY_SAMPLES];
+    int16_t solarMaxW[POWER_HISTORY_SAMPLES];   // Maximum possible solar at the sample's relay value
+    relayValue_T relayValue[POWER_HISTORY_SAMPLES];
+    uint16_t head;                              // Next slot to write
+    uint16_t count;
+    int64_t lastUs;                             // receivedUs of the newest sample
+    int32_t sumW[POWER_FIELD_COUNT];
+    int64_t sumSqW2[POWER_FIELD_COUNT];
+    int32_t smoothSumW;                         // Sum of the last POWER_SMOOTHING_SAMPLES solarMaxW
+    historyQueue_T minQueue[POWER_FIELD_COUNT];
+    historyQueue_T maxQueue[POWER_FIELD_COUNT];
+} history;
+
+// Keys recognised by the streaming decoder, matched on length and FNV-1a hash
+typedef enum {
+    KEY_IMPORT_PRICE = 0,
+    KEY_EXPORT_PRICE,
+    KEY_BATTERY_LEVEL,
+    KEY_POWER_VALUES,
+    KEY_NAME,
+    KEY_UNITS,
+    KEY_VALUE,
+    KEY_HOUSE,
+    KEY_SOLAR,
+    KEY_BATTERY,
+    KEY_GRID,
+    KEY_COUNT,
+    KEY_UNKNOWN = KEY_COUNT
+} jsonKeyId_T;
+
+typedef struct {
+    const char* key;
+    uint8_t len;
+    uint32_t hash;
+} jsonKey_T;
+
+static const jsonKey_T jsonKeys[KEY_COUNT] = {
+    { "importPrice",  11, 0xff55bd61 },
+    { "exportPrice",  11, 0x6ff0857c },
+    { "batteryLevel", 12, 0xd43b058c },
+    { "powerValues",  11, 0x65ffdc9c },
+    { "name",          4, 0x8d39bde6 },
+    { "units",         5, 0xc918a49c },
+    { "value",         5, 0x425ed3ca },
+    { "House",         5, 0xb532b2fb },
+    { "Solar",         5, 0x34e82f56 },
+    { "Battery",       7, 0x840ae12e },
+    { "Grid",          4, 0x2fb366b1 },
+};
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define JSON_MAX_DEPTH 8
+#define JSON_MAX_NUMBER_LEN 32
+
+// Read position within a (not null terminated) JSON buffer
+typedef struct {
+    const char* p;
+    const char* end;
+} jsonCursor_T;
+
+// A string token, pointing into the source buffer
+typedef struct {
+    const char* s;
+    int len;
+} jsonString_T;
+
+static powerManagerLogHook_T logHook = NULL;
+
+// ---------------------------------------------------
+// Route the hot path logging somewhere else, such as a deferred log queue
+//
+// Params - hook - receives the raw values of each log event, NULL to format and log them directly
+// ---------------------------------------------------
+void PowerManager_SetLogHook(powerManagerLogHook_T hook)
+{
+    logHook = hook;
+}
+
+// ---------------------------------------------------
+// Format the values of a hot path log event
+//
+// Params - event - a powerLogEvent_T
+//        - values - the event's values
+//        - line - where to put the text
+//        - len - size of line
+// Returns- the snprintf result
+// ---------------------------------------------------
+int PowerManager_FormatLog(uint8_t event, const float* v, char* line, size_t len)
+{
+    switch (event) {
+        case POWER_LOG_VALUES:
+            return snprintf(line, len, "Power data: Import = $%0.2f, Export = $%0.2f, BatteryLevel=%0.1f%%, House = %0.3fkW, Grid = %0.3fkW, Solar = %0.3fkW, Battery = %0.3fkW",
+                v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
+        case POWER_LOG_RELAY_SELECTED:
+            return snprintf(line, len, "Selected relay = %0.0f which is %0.0f%% power, which is %0.3fkw for a %0.3fkW load.", v[0], v[1], v[2], v[3]);
+        case POWER_LOG_CONTROLLER:
+            return snprintf(line, len, "Controller: grid error = %0.3fkW, integral = %0.3fkWs, desired = %0.3fkW of %0.3fkW, relay %0.0f -> %0.0f",
+                v[0], v[1], v[2], v[3], v[4], v[5]);
+        default:
+            return snprintf(line, len, "Unknown power log event %u", event);
+    }
+}
+
+// -----------------------------------------------
+// Log a hot path event, through the hook if there is one
+// -----------------------------------------------
+static void PowerLog(uint8_t event, const float* values, int count)
+{
+    if (logHook != NULL) {
+        logHook(ESP_LOG_INFO, event, values, count);
+    } else {
+        char line[200];
+        PowerManager_FormatLog(event, values, line, sizeof(line));
+        ESP_LOGI(POWER_TAG, "%s", line);
+    }
+}
+
+// -----------------------------------------------
+// Log a set of decoded power values
+// -----------------------------------------------
+static void LogPowerValues(const powerManager_T* instance)
+{
+    float values[] = { instance->importPrice, instance->exportPrice, instance->batteryLevel, instance->housePowerkW, 
+        instance->gridPowerkW, instance->solarPowerkW, instance->batteryPowerkW };
+    PowerLog(POWER_LOG_VALUES, values, sizeof(values) / sizeof(values[0]));
+}
 
 // -----------------------------------------------
 // Initialise a power manager instance
@@ -38,10 +220,58 @@ void PowerManager_Initialise(powerManager_T* instance)
 {
     instance->importPrice = 0.0;
     instance->exportPrice = 0.0;
+    instance->batteryLevel = 0.0;
     instance->gridPowerkW = 0.0;
     instance->housePowerkW = 0.0;
     instance->solarPowerkW = 0.0;
     instance->batteryPowerkW = 0.0;
+    instance->receivedUs = 0;
+    instance->sourceSequence = 0;
+}
+
+// -----------------------------------------------
+// Initialise a shared power value snapshot
+// -----------------------------------------------
+void PowerManager_SnapshotInitialise(powerManagerSnapshot_T* snapshot)
+{
+    PowerManager_Initialise(&snapshot->buffer[0]);
+    PowerManager_Initialise(&snapshot->buffer[1]);
+    SeqLock_Initialise(&snapshot->sequence);
+}
+
+// ---------------------------------------------------
+// Publish new power values to a snapshot
+//
+// Only one task may write to a snapshot. The values are written to the
+// buffer readers aren't using, then made current.
+//
+// Params - snapshot - the shared snapshot
+//        - instance - the new values
+// ---------------------------------------------------
+void PowerManager_SnapshotWrite(powerManagerSnapshot_T* snapshot, const powerManager_T* instance)
+{
+    snapshot->buffer[SeqLock_WriteBegin(&snapshot->sequence)] = *instance;
+    SeqLock_WriteEnd(&snapshot->sequence);
+}
+
+// ---------------------------------------------------
+// Read a consistent copy of the latest power values
+//
+// Never blocks the writer. Retries if the writer started or finished an
+// update while we were copying, which could have torn our copy.
+//
+// Params - snapshot - the shared snapshot
+//        - instance - where to copy the values
+// Returns- the sequence number of the values read, which changes with each update
+// ---------------------------------------------------
+uint32_t PowerManager_SnapshotRead(const powerManagerSnapshot_T* snapshot, powerManager_T* instance)
+{
+    unsigned int seq;
+    do {
+        seq = SeqLock_ReadBegin(&snapshot->sequence);
+        *instance = snapshot->buffer[SeqLock_Current(seq)];
+    } while (SeqLock_ReadRetry(&snapshot->sequence, seq));
+    return SeqLock_Updates(seq);
 }
 
 // ---------------------------------------------------
@@ -63,7 +293,7 @@ int PowerManager_Decode(powerManager_T* instance, const char* s)
         const char *error_ptr = cJSON_GetErrorPtr();
         if (error_ptr != NULL)
         {
-            ESP_LOGE(TAG, "Error decoding JSON power data. Received: %s\r\nError before: %s\r\n", s, error_ptr);
+            ESP_LOGE(POWER_TAG, "Error decoding JSON power data. Received: %s\r\nError before: %s\r\n", s, error_ptr);
         }
         return 1;
     }
@@ -89,7 +319,7 @@ int PowerManager_Decode(powerManager_T* instance, const char* s)
             const cJSON* v = cJSON_GetObjectItem(ai, "value");
             if (n == NULL || u == NULL || v == NULL) {
                 status = 1;
-                ESP_LOGE(TAG, "Error decoding JSON power data. Error in values array item %d", i + 1);
+                ESP_LOGE(POWER_TAG, "Error decoding JSON power data. Error in values array item %d", i + 1);
                 break;
             } else {
                 if (cJSON_IsString(n)) { strcpy(name, cJSON_GetStringValue(n)); } else { status = 1; }
@@ -102,21 +332,18 @@ int PowerManager_Decode(powerManager_T* instance, const char* s)
                     else if (strcmp(name, "Battery") == 0) { instance->batteryPowerkW = val; }
                     else if (strcmp(name, "Grid") == 0) { instance->gridPowerkW = val; }
                     else {
-                        ESP_LOGE(TAG, "Error decoding JSON power data. Element %d had unknown type %s.", i, name);
+                        ESP_LOGE(POWER_TAG, "Error decoding JSON power data. Element %d had unknown type %s.", i, name);
                         //status = 1;
                     }
                 }
             }
         }
     } else {
-        ESP_LOGE(TAG, "Error decoding JSON power data. Couldn't find the powervalues array tag.");
+        ESP_LOGE(POWER_TAG, "Error decoding JSON power data. Couldn't find the powervalues array tag.");
         status = 1;
     }
 
-    if (status == 0) {
-        ESP_LOGI(TAG, "Power data: Import = $%0.2f, Export = $%0.2f, BatteryLevel=%0.1f%%, House = %0.3fkW, Grid = %0.3fkW, Solar = %0.3fkW, Battery = %0.3fkW",
-            instance->importPrice, instance->exportPrice, instance->batteryLevel, instance->housePowerkW, instance->gridPowerkW, instance->solarPowerkW, instance->batteryPowerkW);
-    }
+    if (status == 0) { LogPowerValues(instance); }
 
     
     //if (monitor_json != NULL) { cJSON_Delete(monitor_json); }
@@ -125,6 +352,294 @@ int PowerManager_Decode(powerManager_T* instance, const char* s)
     return status;
 }
 
+// -----------------------------------------------
+// Convert kW to int16 watts, saturating
+// -----------------------------------------------
+static int16_t ToFixedW(float kW)
+{
+    float w = kW * 1000.0;
+    if (!(w > -32767.0)) { return -32767; }     // Also catches NaN
+    if (w > 32767.0) { return 32767; }
+    return (int16_t)lrintf(w);
+}
+
+// -----------------------------------------------
+// Push a slot onto a monotonic queue
+//
+// Drops the queued slots the new one supersedes. For a min queue that's
+// every slot with a value no smaller, for a max queue no larger.
+// -----------------------------------------------
+static void HistoryQueuePush(historyQueue_T* q, const int16_t* values, uint16_t slot, bool isMax)
+{
+    while (q->len > 0) {
+        uint16_t back = q->slot[(q->front + q->len - 1) % POWER_HISTORY_SAMPLES];
+        if (isMax ? (values[back] > values[slot]) : (values[back] < values[slot])) { break; }
+        q->len--;
+    }
+    q->slot[(q->front + q->len) % POWER_HISTORY_SAMPLES] = slot;
+    q->len++;
+}
+
+// -----------------------------------------------
+// Drop a slot from the front of a monotonic queue if it's about to be overwritten
+// -----------------------------------------------
+static void HistoryQueueExpire(historyQueue_T* q, uint16_t slot)
+{
+    if (q->len > 0 && q->slot[q->front] == slot) {
+        q->front = (q->front + 1) % POWER_HISTORY_SAMPLES;
+        q->len--;
+    }
+}
+
+// -----------------------------------------------
+// Build the curtailment levels from the channels' relay power tables
+//
+// Greedy, from full production each level takes one more step on the
+// channel that gives up the least production for it. That keeps the
+// levels as fine grained as the tables allow, and lets the controllers
+// treat every channel together as one table to search.
+// -----------------------------------------------
+static void RelayModelBuild(void)
+{
+    uint8_t code[RELAY_CHANNELS] = { 0 };
+
+    maxSolarPowerkW = 0.0;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) { maxSolarPowerkW += channelMaxSolarkW[channel]; }
+    levelValue[0] = 0;
+    levelPower[0] = 0.0;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        channelShare[channel] = channelMaxSolarkW[channel] / maxSolarPowerkW;
+        levelPower[0] += channelShare[channel] * relayPower[channel][0];
+    }
+
+    for (int level = 1; level < RELAY_LEVELS; level++) {
+        int best = -1;
+        float bestDrop = 0.0;
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+            if (code[channel] >= RELAY_STEPS - 1) { continue; }
+            float drop = channelShare[channel] * (relayPower[channel][code[channel]] - relayPower[channel][code[channel] + 1]);
+            // Ties go to the channel curtailed least, so equal channels take turns
+            if (best < 0 || drop < bestDrop - 1.0e-6 || (drop <= bestDrop + 1.0e-6 && code[channel] < code[best])) {
+                best = channel;
+                bestDrop = drop;
+            }
+        }
+        code[best]++;
+        levelValue[level] = RELAY_VALUE_WITH_CODE(levelValue[level - 1], best, code[best]);
+        levelPower[level] = levelPower[level - 1] - bestDrop;
+    }
+}
+
+// -----------------------------------------------
+// Check a relay power table is strictly decreasing and within (0, 1]
+// -----------------------------------------------
+static bool RelayPowerValid(const float* power)
+{
+    if (!(power[0] > 0.0 && power[0] <= 1.0)) { return false; }
+    for (int code = 1; code < RELAY_STEPS; code++) {
+        if (!(power[code] > 0.0 && power[code] < power[code - 1])) { return false; }
+    }
+    return true;
+}
+
+// ---------------------------------------------------
+// Set up the relay model with the built in tables and limits
+//
+// Must be called before any of the relay decisions are made.
+//
+// Returns- true on success, false if a built in table isn't valid
+// ---------------------------------------------------
+bool PowerManager_RelayModelInitialise(void)
+{
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        if (!RelayPowerValid(defaultRelayPower[channel])) {
+            ESP_LOGE(POWER_TAG, "The built in relay %d power table isn't strictly decreasing within (0, 1].", channel);
+            return false;
+        }
+    }
+    memcpy(relayPower, defaultRelayPower, sizeof(relayPower));
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) { channelMaxSolarkW[channel] = POWER_DEFAULT_MAX_SOLAR_KW; }
+    maxBatteryChargekW = POWER_DEFAULT_MAX_BATTERY_CHARGE_KW;
+    RelayModelBuild();
+    return true;
+}
+
+// ---------------------------------------------------
+// Set the system's limits
+//
+// Params - maxSolarkW - each channel's maximum solar production
+//        - maxBatterykW - the most the battery can charge at
+// ---------------------------------------------------
+void PowerManager_SetRelayLimits(const float* maxSolarkW, float maxBatterykW)
+{
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        channelMaxSolarkW[channel] = (maxSolarkW[channel] > 0.0) ? maxSolarkW[channel] : POWER_DEFAULT_MAX_SOLAR_KW;
+    }
+    maxBatteryChargekW = (maxBatterykW >= 0.0) ? maxBatterykW : 0.0;
+    RelayModelBuild();
+}
+
+// ---------------------------------------------------
+// Replace one channel's relay power table
+//
+// Params - channel - which relay channel
+//        - power - RELAY_STEPS fractions of full production, strictly
+//          decreasing and within (0, 1], or NULL for the built in table
+// Returns- true on success, false if the table isn't valid
+// ---------------------------------------------------
+bool PowerManager_SetRelayPower(int channel, const float* power)
+{
+    if (channel < 0 || channel >= RELAY_CHANNELS) { return false; }
+    if (power == NULL) { power = defaultRelayPower[channel]; }
+    if (!RelayPowerValid(power)) { return false; }
+    memcpy(relayPower[channel], power, sizeof(relayPower[channel]));
+    RelayModelBuild();
+    return true;
+}
+
+// ---------------------------------------------------
+// Get the relay power table in use for a channel
+//
+// Params - channel - which relay channel
+// Returns- RELAY_STEPS fractions of full production
+// ---------------------------------------------------
+const float* PowerManager_RelayPower(int channel)
+{
+    return relayPower[channel];
+}
+
+// ---------------------------------------------------
+// Get the fraction of the total production allowed by a relay value
+//
+// Params - relayValue - a relay code per channel
+// Returns- the fraction of full production, weighted by the channels' sizes
+// ---------------------------------------------------
+float PowerManager_RelayPowerFraction(relayValue_T relayValue)
+{
+    float fraction = 0.0;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        fraction += channelShare[channel] * relayPower[channel][RELAY_VALUE_CODE(relayValue, channel)];
+    }
+    return fraction;
+}
+
+// -----------------------------------------------
+// Curtailment level of a relay value, or the nearest level allowing no more production if
+// it isn't one of the levels (eg a manual setting)
+// -----------------------------------------------
+static int RelayLevel(relayValue_T relayValue)
+{
+    float fraction = PowerManager_RelayPowerFraction(relayValue) + 1.0e-6;
+    int lo = 0;
+    int hi = RELAY_LEVELS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (levelPower[mid] <= fraction) { hi = mid; } else { lo = mid + 1; }
+    }
+    return lo;
+}
+
+// ---------------------------------------------------
+// Empty the power history
+// ---------------------------------------------------
+void PowerManager_HistoryInitialise(void)
+{
+    memset(&history, 0, sizeof(history));
+}
+
+// ---------------------------------------------------
+// Add a power sample to the history
+//
+// Updates all of the rolling statistics in constant time, overwriting the
+// oldest sample once the history is full. Samples are only added while
+// curtailing, so after a gap (curtailment off, manual control, stale power
+// values) the old samples no longer describe now and are dropped.
+//
+// Params - instance - the new power values
+//        - relayValue - the relay value in force when the values were measured
+// ---------------------------------------------------
+void PowerManager_HistoryAdd(const powerManager_T* instance, relayValue_T relayValue)
+{
+    if (history.count > 0 && instance->receivedUs - history.lastUs > (int64_t)POWER_HISTORY_MAX_GAP_MS * 1000) {
+        PowerManager_HistoryInitialise();
+    }
+    history.lastUs = instance->receivedUs;
+
+    uint16_t slot = history.head;
+    int16_t newW[POWER_FIELD_COUNT] = {
+        [POWER_FIELD_GRID] = ToFixedW(instance->gridPowerkW),
+        [POWER_FIELD_SOLAR] = ToFixedW(instance->solarPowerkW),
+        [POWER_FIELD_HOUSE] = ToFixedW(instance->housePowerkW),
+    };
+
+    // Retire the oldest sample if we're full
+    bool full = (history.count == POWER_HISTORY_SAMPLES);
+    for (int f = 0; f < POWER_FIELD_COUNT; f++) {
+        if (full) {
+            int32_t oldW = history.valueW[f][slot];
+            history.sumW[f] -= oldW;
+            history.sumSqW2[f] -= oldW * oldW;
+            HistoryQueueExpire(&history.minQueue[f], slot);
+            HistoryQueueExpire(&history.maxQueue[f], slot);
+        }
+        history.valueW[f][slot] = newW[f];
+        history.sumW[f] += newW[f];
+        history.sumSqW2[f] += (int32_t)newW[f] * newW[f];
+        HistoryQueuePush(&history.minQueue[f], history.valueW[f], slot, false);
+        HistoryQueuePush(&history.maxQueue[f], history.valueW[f], slot, true);
+    }
+
+    // Maximum possible solar at full production, given the relay value the sample was measured at
+    relayValue &= RELAY_VALUE_MAX;
+    float solarkW = (instance->solarPowerkW > 0.0) ? instance->solarPowerkW : 0.0;
+    if (history.count >= POWER_SMOOTHING_SAMPLES) {
+        history.smoothSumW -= history.solarMaxW[(slot + POWER_HISTORY_SAMPLES - POWER_SMOOTHING_SAMPLES) % POWER_HISTORY_SAMPLES];
+    }
+    history.solarMaxW[slot] = ToFixedW(solarkW / PowerManager_RelayPowerFraction(relayValue));
+    history.smoothSumW += history.solarMaxW[slot];
+    history.relayValue[slot] = relayValue;
+
+    history.head = (slot + 1) % POWER_HISTORY_SAMPLES;
+    if (!full) { history.count++; }
+}
+
+// ---------------------------------------------------
+// Get the rolling statistics for one power value over the history
+//
+// Params - field - which power value
+//        - stats - where to put the statistics
+// Returns- true on success, false if the history is empty
+// ---------------------------------------------------
+bool PowerManager_HistoryStats(powerField_T field, powerStats_T* stats)
+{
+    if (field >= POWER_FIELD_COUNT || history.count == 0) { return false; }
+
+    float n = history.count;
+    float mean = history.sumW[field] / n;
+    float variance = history.sumSqW2[field] / n - mean * mean;
+    stats->count = history.count;
+    stats->meankW = mean / 1000.0;
+    stats->minkW = history.valueW[field][history.minQueue[field].slot[history.minQueue[field].front]] / 1000.0;
+    stats->maxkW = history.valueW[field][history.maxQueue[field].slot[history.maxQueue[field].front]] / 1000.0;
+    stats->variancekW2 = ((variance > 0.0) ? variance : 0.0) / 1.0e6;
+    return true;
+}
+
+// ---------------------------------------------------
+// Get the smoothed maximum possible solar production
+//
+// The mean over the last POWER_SMOOTHING_SAMPLES samples of what the solar
+// would have produced with no curtailment.
+//
+// Returns- the smoothed maximum in kW, or -1 if the history is empty
+// ---------------------------------------------------
+float PowerManager_HistorySolarMaxPossiblekW(void)
+{
+    if (history.count == 0) { return -1.0; }
+    int n = (history.count < POWER_SMOOTHING_SAMPLES) ? history.count : POWER_SMOOTHING_SAMPLES;
+    return history.smoothSumW / (1000.0 * n);
+}
+
 // -----------------------------------------------------------------------------
 // Calculate the relay settings needed to zero the solar system's export
 // 
@@ -132,9 +647,9 @@ int PowerManager_Decode(powerManager_T* instance, const char* s)
 //
 // Params - instance - struct toi base calculations on
 //        - currentRelayValue - the current relay setting
-// Returns- an 8 bit value with the required relay setting
+// Returns- the required relay setting, a relay code per channel
 // -----------------------------------------------------------------------------
-uint8_t CalculateRelaySettings(powerManager_T* instance, uint8_t currentRelayValue)
+relayValue_T CalculateRelaySettings(powerManager_T* instance, relayValue_T currentRelayValue)
 {
     float loadkW = 0;
 
@@ -161,30 +676,479 @@ uint8_t CalculateRelaySettings(powerManager_T* instance, uint8_t currentRelayVal
         }
     }
 
-    // Possible maximum solar right now
-    float solarMaxPossibleNow = instance->solarPowerkW / relayPower[currentRelayValue];
+    // Possible maximum solar right now, smoothed over the recent history if the sample has been added to it
+    currentRelayValue &= RELAY_VALUE_MAX;
+    float solarMaxPossibleNow = PowerManager_HistorySolarMaxPossiblekW();
+    if (solarMaxPossibleNow < 0.0) { solarMaxPossibleNow = instance->solarPowerkW / PowerManager_RelayPowerFraction(currentRelayValue); }
 
     // Desired production percentage. Avoid exactly zero max possible solar div by zero error
     if (solarMaxPossibleNow == 0.0) { solarMaxPossibleNow = 0.100; }
     float desiredSolarProductionPc = loadkW / solarMaxPossibleNow;
 
-    // Find the appropriate load setting by going through the values and finding the one that is closest
-    // to and higher than the desired percentage. We will assume the index of zero so we will have the
-    // maximum production if we don't find one.
-    uint8_t desiredIndex = 0;
-    for (int i = 0; i < 16; i++) {
-        ESP_LOGI(TAG, "i = %u, desiredIndex = %u, solamMaxPossibleNow = %0.3fkW, prod this index = %0.3fkW", 
-            i, desiredIndex, solarMaxPossibleNow, 
-            (solarMaxPossibleNow * relayPower[i] > maxSolarPowerkW) ? maxSolarPowerkW : solarMaxPossibleNow * relayPower[i]);
-        if (i > desiredIndex && relayPower[i] > desiredSolarProductionPc) {
-            desiredIndex = i;
+    // Find the appropriate load setting, which is the highest level whose production is still above
+    // the desired percentage. The levels are decreasing, so binary search for the number of levels
+    // above it. If there are none we use level zero for maximum production.
+    int lo = 0;
+    int hi = RELAY_LEVELS;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        PM_TRACE("lo = %d, hi = %d, mid = %d, solarMaxPossibleNow = %0.3fkW, prod this level = %0.3fkW", 
+            lo, hi, mid, solarMaxPossibleNow, 
+            (solarMaxPossibleNow * levelPower[mid] > maxSolarPowerkW) ? maxSolarPowerkW : solarMaxPossibleNow * levelPower[mid]);
+        if (levelPower[mid] > desiredSolarProductionPc) { lo = mid + 1; } else { hi = mid; }
+    }
+    int desiredLevel = (lo > 0) ? lo - 1 : 0;
+
+    PM_TRACE("Results of calculation... Maximum possible solar generation now = %0.3fkW", solarMaxPossibleNow);
+    PM_TRACE("                          Desired production to cover house & battery charge is %0.3fkW", loadkW);
+    float values[] = { levelValue[desiredLevel], levelPower[desiredLevel] * 100.0, solarMaxPossibleNow * levelPower[desiredLevel], loadkW };
+    PowerLog(POWER_LOG_RELAY_SELECTED, values, sizeof(values) / sizeof(values[0]));
+
+    return levelValue[desiredLevel];
+}
+
+// -----------------------------------------------
+// Initialise a closed loop export controller
+//
+// Params - ctl - the controller to initialise
+//        - cfg - gains and limits to use
+// -----------------------------------------------
+void ExportController_Initialise(exportController_T* ctl, const exportControllerConfig_T* cfg)
+{
+    ctl->cfg = *cfg;
+    ctl->integralkWs = 0.0;
+    ctl->lastUpdateUs = 0;
+    ctl->lastChangeUs = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Closed loop export controller update
+// 
+// Feed-forward from the measured grid power plus a PI correction, so that
+// the grid power settles on the target. The feed-forward term lets the first
+// correction land close to the right step, and the deadband, minimum dwell
+// time and per update step limit keep relay transitions to a minimum.
+//
+// Params - ctl - controller state
+//        - instance - latest power values
+//        - currentRelayValue - the current relay setting
+//        - nowUs - current time from esp_timer_get_time
+// Returns- the required relay setting
+// -----------------------------------------------------------------------------
+relayValue_T ExportController_Update(exportController_T* ctl, const powerManager_T* instance, relayValue_T currentRelayValue, int64_t nowUs)
+{
+    currentRelayValue &= RELAY_VALUE_MAX;
+    int currentLevel = RelayLevel(currentRelayValue);
+    float dt = (ctl->lastUpdateUs == 0) ? 0.0 : (float)(nowUs - ctl->lastUpdateUs) / 1000000.0;
+    ctl->lastUpdateUs = nowUs;
+
+    // Possible maximum solar right now, limited to what the system can actually produce
+    float solarkW = (instance->solarPowerkW < 0.0) ? 0.0 : instance->solarPowerkW;
+    float solarMaxPossibleNow = solarkW / PowerManager_RelayPowerFraction(currentRelayValue);
+    if (solarMaxPossibleNow > maxSolarPowerkW) { solarMaxPossibleNow = maxSolarPowerkW; }
+
+    // Nothing is being produced (eg at night) so there's nothing to control. Hold the relays.
+    if (solarMaxPossibleNow < 0.050) {
+        ctl->integralkWs = 0.0;
+        return currentRelayValue;
+    }
+
+    // Grid power is +ve for import, so a -ve error means we're exporting more than the target
+    float errorkW = instance->gridPowerkW - ctl->cfg.targetGridkW;
+    if (fabsf(errorkW) <= ctl->cfg.deadbandkW) { return currentRelayValue; }
+    if (ctl->lastChangeUs != 0 && nowUs - ctl->lastChangeUs < (int64_t)ctl->cfg.minDwellMs * 1000) { return currentRelayValue; }
+
+    // Raising production by x kW lowers grid power by x kW. The integral only corrects for the
+    // relay power table not matching the real system, so limit it to the system size. Errors
+    // smaller than one relay step can't be corrected and integrating them would limit cycle.
+    float stepkW = solarMaxPossibleNow * (levelPower[0] - levelPower[1]);
+    if (fabsf(errorkW) > stepkW) { ctl->integralkWs += errorkW * dt; }
+    if (ctl->cfg.ki > 0.0) {
+        float limitkWs = maxSolarPowerkW / ctl->cfg.ki;
+        if (ctl->integralkWs > limitkWs) { ctl->integralkWs = limitkWs; }
+        if (ctl->integralkWs < -limitkWs) { ctl->integralkWs = -limitkWs; }
+    }
+    float desiredkW = solarkW + ctl->cfg.kp * errorkW + ctl->cfg.ki * ctl->integralkWs;
+    float desiredPc = desiredkW / solarMaxPossibleNow;
+
+    // Lowest level (most production) that doesn't exceed the desired production
+    int lo = 0;
+    int hi = RELAY_LEVELS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (levelPower[mid] <= desiredPc) { hi = mid; } else { lo = mid + 1; }
+    }
+    int desiredLevel = lo;
+
+    // Rate limit increases in production. Curtailing is never limited so export is cut straight away.
+    int maxSteps = (ctl->cfg.maxStepsPerUpdate == 0) ? 1 : ctl->cfg.maxStepsPerUpdate;
+    if (desiredLevel + maxSteps < currentLevel) { desiredLevel = currentLevel - maxSteps; }
+
+    // Don't wind up the integral while we're pinned at either end of the levels
+    if ((desiredLevel == 0 && errorkW > 0.0) || (desiredLevel == RELAY_LEVELS - 1 && errorkW < 0.0)) {
+        ctl->integralkWs = 0.0;
+    }
+
+    // Each step change is a fresh feed-forward estimate, so start the integral again from there.
+    // A manual value that isn't one of the levels is held until there's a level to move to.
+    relayValue_T desiredValue = (desiredLevel == currentLevel) ? currentRelayValue : levelValue[desiredLevel];
+    if (desiredValue != currentRelayValue) { 
+        ctl->lastChangeUs = nowUs; 
+        ctl->integralkWs = 0.0;
+    }
+    float values[] = { errorkW, ctl->integralkWs, desiredkW, solarMaxPossibleNow, currentRelayValue, desiredValue };
+    PowerLog(POWER_LOG_CONTROLLER, values, sizeof(values) / sizeof(values[0]));
+
+    return desiredValue;
+}
+
+// -----------------------------------------------
+// Streaming decoder helpers
+// -----------------------------------------------
+static jsonKeyId_T LookupKey(const jsonString_T* k)
+{
+    uint32_t h = FNV_OFFSET_BASIS;
+    for (int i = 0; i < k->len; i++) { h ^= (uint8_t)k->s[i]; h *= FNV_PRIME; }
+    for (int i = 0; i < KEY_COUNT; i++) {
+        if (jsonKeys[i].len == k->len && jsonKeys[i].hash == h && memcmp(jsonKeys[i].key, k->s, k->len) == 0) { 
+            return (jsonKeyId_T)i; 
         }
     }
+    return KEY_UNKNOWN;
+}
+
+static void JsonSkipWhitespace(jsonCursor_T* c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n')) { c->p++; }
+}
+
+// Consume the character ch (after any whitespace) if it is next. Returns true if it was.
+static bool JsonExpect(jsonCursor_T* c, char ch)
+{
+    JsonSkipWhitespace(c);
+    if (c->p < c->end && *c->p == ch) { c->p++; return true; }
+    return false;
+}
 
-    ESP_LOGI(TAG, "Results of calculation... Maximum possible solar generation now = %0.3fkW", solarMaxPossibleNow);
-    ESP_LOGI(TAG, "                          Desired production to cover house & battery charge is %0.3fkW", loadkW);
-    ESP_LOGI(TAG, "                          Selected relay = %u which is %0.0f%% power, which is %0.3fkw.", 
-        desiredIndex, relayPower[desiredIndex] * 100.0, solarMaxPossibleNow * relayPower[desiredIndex]);
+static bool JsonPeek(jsonCursor_T* c, char ch)
+{
+    JsonSkipWhitespace(c);
+    return (c->p < c->end && *c->p == ch);
+}
 
-    return desiredIndex;
+// Read a string token. Escapes are skipped over but not decoded.
+static bool JsonString(jsonCursor_T* c, jsonString_T* out)
+{
+    if (!JsonExpect(c, '"')) { return false; }
+    out->s = c->p;
+    while (c->p < c->end && *c->p != '"') {
+        if (*c->p == '\\') { c->p++; }
+        c->p++;
+    }
+    if (c->p >= c->end) { return false; }
+    out->len = (int)(c->p - out->s);
+    c->p++; // closing quote
+    return true;
+}
+
+// Read a number token. It is copied to a small stack buffer so strtod gets the same
+// null terminated input cJSON would have given it.
+static bool JsonNumber(jsonCursor_T* c, double* out)
+{
+    char num[JSON_MAX_NUMBER_LEN];
+    int n = 0;
+    JsonSkipWhitespace(c);
+    while (c->p < c->end && n < sizeof(num) - 1 && strchr("+-.eE0123456789", *c->p) != NULL && *c->p != '\0') {
+        num[n++] = *c->p++;
+    }
+    if (n == 0) { return false; }
+    num[n] = '\0';
+    char* numEnd = NULL;
+    *out = strtod(num, &numEnd);
+    return (numEnd == num + n);
 }
+
+// Skip over any JSON value
+static bool JsonSkipValue(jsonCursor_T* c, int depth)
+{
+    jsonString_T str;
+    double d;
+
+    if (depth > JSON_MAX_DEPTH) { return false; }
+    JsonSkipWhitespace(c);
+    if (c->p >= c->end) { return false; }
+    switch (*c->p) {
+        case '"':
+            return JsonString(c, &str);
+        case '{':
+            c->p++;
+            if (JsonExpect(c, '}')) { return true; }
+            do {
+                if (!JsonString(c, &str) || !JsonExpect(c, ':') || !JsonSkipValue(c, depth + 1)) { return false; }
+            } while (JsonExpect(c, ','));
+            return JsonExpect(c, '}');
+        case '[':
+            c->p++;
+            if (JsonExpect(c, ']')) { return true; }
+            do {
+                if (!JsonSkipValue(c, depth + 1)) { return false; }
+            } while (JsonExpect(c, ','));
+            return JsonExpect(c, ']');
+        case 't': case 'f': case 'n':
+            while (c->p < c->end && *c->p >= 'a' && *c->p <= 'z') { c->p++; }
+            return true;
+        default:
+            return JsonNumber(c, &d);
+    }
+}
+
+// Read a number into a float if there is one, otherwise skip the value and leave the float unchanged
+static bool JsonFloat(jsonCursor_T* c, float* out)
+{
+    double d;
+    JsonSkipWhitespace(c);
+    if (c->p < c->end && (*c->p == '-' || (*c->p >= '0' && *c->p <= '9'))) {
+        if (!JsonNumber(c, &d)) { return false; }
+        *out = d;
+        return true;
+    }
+    return JsonSkipValue(c, 1);
+}
+
+// Decode one {"name": ..., "units": ..., "value": ...} element of the powerValues array
+static int JsonPowerValue(jsonCursor_T* c, powerManager_T* instance)
+{
+    jsonString_T key;
+    jsonString_T name = { NULL, 0 };
+    jsonString_T units = { NULL, 0 };
+    bool gotValue = false;
+    double val = 0.0;
+
+    if (!JsonExpect(c, '{')) { return 1; }
+    if (!JsonExpect(c, '}')) {
+        do {
+            if (!JsonString(c, &key) || !JsonExpect(c, ':')) { return 1; }
+            switch (LookupKey(&key)) {
+                case KEY_NAME:
+                    if (!JsonString(c, &name)) { return 1; }
+                    break;
+                case KEY_UNITS:
+                    if (!JsonString(c, &units)) { return 1; }
+                    break;
+                case KEY_VALUE:
+                    if (!JsonNumber(c, &val)) { return 1; }
+                    gotValue = true;
+                    break;
+                default:
+                    if (!JsonSkipValue(c, 2)) { return 1; }
+                    break;
+            }
+        } while (JsonExpect(c, ','));
+        if (!JsonExpect(c, '}')) { return 1; }
+    }
+    if (name.s == NULL || units.s == NULL || !gotValue) { return 1; }
+
+    if (!(units.len == 2 && memcmp(units.s, "kW", 2) == 0)) { val /= 1000.0; } // convert to kW is needed
+    switch (LookupKey(&name)) {
+        case KEY_HOUSE: instance->housePowerkW = val; break;
+        case KEY_SOLAR: instance->solarPowerkW = val; break;
+        case KEY_BATTERY: instance->batteryPowerkW = val; break;
+        case KEY_GRID: instance->gridPowerkW = val; break;
+        default:
+            ESP_LOGE(POWER_TAG, "Error decoding JSON power data. Element had unknown type %.*s.", name.len, name.s);
+            break;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------
+// Decode a JSON buffer without allocating
+// 
+// Single pass, non-allocating alternative to PowerManager_Decode that
+// reads the power values straight out of the MQTT event buffer. The buffer
+// does not need to be null terminated. The instance is only updated if the
+// whole message decodes, so a failure can be retried with PowerManager_Decode.
+//
+// Params - instance - the struct to populate
+//        - data - JSON text to decode
+//        - len - length of the JSON text
+// Returns- 0 on success, non-zero otherwise
+// ---------------------------------------------------
+int PowerManager_DecodeStream(powerManager_T* instance, const char* data, int len)
+{
+    jsonCursor_T c = { data, data + len };
+    powerManager_T decoded = *instance;
+    jsonString_T key;
+    bool gotPowerValues = false;
+
+    if (data == NULL || !JsonExpect(&c, '{')) { return 1; }
+    if (!JsonExpect(&c, '}')) {
+        do {
+            if (!JsonString(&c, &key) || !JsonExpect(&c, ':')) { return 1; }
+            switch (LookupKey(&key)) {
+                case KEY_IMPORT_PRICE:
+                    if (!JsonFloat(&c, &decoded.importPrice)) { return 1; }
+                    break;
+                case KEY_EXPORT_PRICE:
+                    if (!JsonFloat(&c, &decoded.exportPrice)) { return 1; }
+                    break;
+                case KEY_BATTERY_LEVEL:
+                    if (!JsonFloat(&c, &decoded.batteryLevel)) { return 1; }
+                    break;
+                case KEY_POWER_VALUES:
+                    if (!JsonPeek(&c, '[')) { return 1; }
+                    c.p++;
+                    if (!JsonExpect(&c, ']')) {
+                        do {
+                            if (JsonPowerValue(&c, &decoded) != 0) { return 1; }
+                        } while (JsonExpect(&c, ','));
+                        if (!JsonExpect(&c, ']')) { return 1; }
+                    }
+                    gotPowerValues = true;
+                    break;
+                default:
+                    if (!JsonSkipValue(&c, 1)) { return 1; }
+                    break;
+            }
+        } while (JsonExpect(&c, ','));
+        if (!JsonExpect(&c, '}')) { return 1; }
+    }
+    if (!gotPowerValues) { return 1; }
+
+    *instance = decoded;
+    LogPowerValues(instance);
+    return 0;
+}
+
+// ---------------------------------------------------
+// Decode a compact binary power record
+// 
+// Copies a powerBinaryRecord_T out of the MQTT event buffer and checks
+// it before use. Records that repeat or go back from the last accepted
+// sequence are rejected, except sequence 0 which marks a publisher restart.
+// The instance is only updated if the record is accepted.
+//
+// Params - instance - the struct to populate
+//        - data - the record
+//        - len - length of the record
+//        - lastSequence - the sequence of the last accepted record, updated on success
+// Returns- 0 on success, 1 for a malformed record, 2 for a repeated or out of order record
+// ---------------------------------------------------
+int PowerManager_DecodeBinary(powerManager_T* instance, const void* data, int len, uint32_t* lastSequence)
+{
+    powerBinaryRecord_T record;
+
+    if (data == NULL || len != sizeof(record)) { return 1; }
+    memcpy(&record, data, sizeof(record));
+    if (record.version != POWER_BINARY_VERSION) { return 1; }
+    if (!isfinite(record.importPrice) || !isfinite(record.exportPrice) || !isfinite(record.batteryLevel) ||
+        !isfinite(record.gridPowerkW) || !isfinite(record.housePowerkW) || !isfinite(record.solarPowerkW) ||
+        !isfinite(record.batteryPowerkW)) { return 1; }
+    if (record.sequence != 0 && (int32_t)(record.sequence - *lastSequence) <= 0) { return 2; }
+
+    *lastSequence = record.sequence;
+    instance->importPrice = record.importPrice;
+    instance->exportPrice = record.exportPrice;
+    instance->batteryLevel = record.batteryLevel;
+    instance->gridPowerkW = record.gridPowerkW;
+    instance->housePowerkW = record.housePowerkW;
+    instance->solarPowerkW = record.solarPowerkW;
+    instance->batteryPowerkW = record.batteryPowerkW;
+    instance->sourceSequence = record.sequence;
+    LogPowerValues(instance);
+    return 0;
+}
+
+// -----------------------------------------------
+// Is an Envoy reading the metered (eim) one of a type
+// -----------------------------------------------
+static bool EnvoyIsMeter(const cJSON* reading, const char* measurementType)
+{
+    const cJSON* type = cJSON_GetObjectItemCaseSensitive(reading, "type");
+    const cJSON* measurement = cJSON_GetObjectItemCaseSensitive(reading, "measurementType");
+    return cJSON_IsString(type) && strcmp(type->valuestring, "eim") == 0 &&
+        cJSON_IsString(measurement) && strcmp(measurement->valuestring, measurementType) == 0;
+}
+
+static bool EnvoyWatts(const cJSON* reading, double* watts)
+{
+    const cJSON* w = cJSON_GetObjectItemCaseSensitive(reading, "wNow");
+    if (!cJSON_IsNumber(w) || !isfinite(w->valuedouble)) { return false; }
+    *watts = w->valuedouble;
+    return true;
+}
+
+// ---------------------------------------------------
+// Decode an Enphase Envoy /production.json response
+//
+// Uses the metered (eim) readings, so the Envoy needs its production and
+// consumption CTs; the inverter readings only update every few minutes.
+// Grid power is net consumption, +ve is import. House power is total
+// consumption, or production plus net consumption if that's missing.
+// Only the power fields are updated. sourceSequence is set to the Envoy's
+// reading time, so a repeated poll of the same reading can be spotted.
+//
+// Params - instance - the struct to populate
+//        - data - the response, not necessarily null terminated
+//        - len - its length
+// Returns- 0 on success, non-zero otherwise
+// ---------------------------------------------------
+int PowerManager_DecodeEnvoy(powerManager_T* instance, const char* data, int len)
+{
+    cJSON* root = cJSON_ParseWithLength(data, len);
+    if (root == NULL) { return 1; }
+
+    const cJSON* reading = NULL;
+    const cJSON* production = NULL;
+    const cJSON* total = NULL;
+    const cJSON* net = NULL;
+    cJSON_ArrayForEach(reading, cJSON_GetObjectItemCaseSensitive(root, "production")) {
+        if (EnvoyIsMeter(reading, "production")) { production = reading; }
+    }
+    cJSON_ArrayForEach(reading, cJSON_GetObjectItemCaseSensitive(root, "consumption")) {
+        if (EnvoyIsMeter(reading, "total-consumption")) { total = reading; }
+        else if (EnvoyIsMeter(reading, "net-consumption")) { net = reading; }
+    }
+
+    int status = 1;
+    double solarW, netW, totalW;
+    if (EnvoyWatts(production, &solarW) && EnvoyWatts(net, &netW)) {
+        if (!EnvoyWatts(total, &totalW)) { totalW = solarW + netW; }
+        const cJSON* readingTime = cJSON_GetObjectItemCaseSensitive(production, "readingTime");
+        instance->solarPowerkW = solarW / 1000.0;
+        instance->gridPowerkW = netW / 1000.0;
+        instance->housePowerkW = totalW / 1000.0;
+        instance->sourceSequence = cJSON_IsNumber(readingTime) ? (uint32_t)readingTime->valuedouble : 0;
+        LogPowerValues(instance);
+        status = 0;
+    }
+    cJSON_Delete(root);
+    return status;
+}
+
+// ---------------------------------------------------
+// Copy some of the fields of one instance to another
+//
+// Params - instance - the struct to update
+//        - from - the source of the new values
+//        - fields - POWER_FIELDS_ to copy
+// ---------------------------------------------------
+void PowerManager_Merge(powerManager_T* instance, const powerManager_T* from, uint8_t fields)
+{
+    if (fields & POWER_FIELDS_PRICES) {
+        instance->importPrice = from->importPrice;
+        instance->exportPrice = from->exportPrice;
+        instance->batteryLevel = from->batteryLevel;
+    }
+    if (fields & POWER_FIELDS_POWER) {
+        instance->gridPowerkW = from->gridPowerkW;
+        instance->housePowerkW = from->housePowerkW;
+        instance->solarPowerkW = from->solarPowerkW;
+        instance->receivedUs = from->receivedUs;
+        instance->sourceSequence = from->sourceSequence;
+    }
+    if (fields & POWER_FIELDS_BATTERY) { instance->batteryPowerkW = from->batteryPowerkW; }
+}
+
+const powerSource_T PowerSource_HomeAssistant = { "Home Assistant", POWER_FIELDS_ALL, PowerManager_DecodeStream };
+const powerSource_T PowerSource_Envoy = { "Envoy", POWER_FIELDS_POWER, PowerManager_DecodeEnvoy };
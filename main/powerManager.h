@@ -1,6 +1,19 @@
 #ifndef __POWERMANAGER_C__
 #define __POWERMANAGER_C__
 
+#include "commonvalues.h"
+#include "seqLock.h"
+
+// Set to 1 to decode every power message with both the streaming and cJSON decoders and log any difference
+#define POWERMANAGER_VERIFY_DECODE 0
+// Set to 1 to log every step of the relay selection in CalculateRelaySettings
+#define POWERMANAGER_TRACE 0
+
+#define RELAY_STEPS 16  // Number of DRM relay codes
+#define RELAY_LEVELS (RELAY_CHANNELS * (RELAY_STEPS - 1) + 1)  // Curtailment levels across all of the channels
+#define POWER_DEFAULT_MAX_SOLAR_KW 8.2          // Per relay channel, until PowerManager_SetRelayLimits
+#define POWER_DEFAULT_MAX_BATTERY_CHARGE_KW 5.0
+
 typedef struct {
     float importPrice;
     float exportPrice;
@@ -9,10 +22,133 @@ typedef struct {
     float housePowerkW;
     float solarPowerkW;
     float batteryPowerkW;
+    int64_t receivedUs;     // esp_timer_get_time() when the sample arrived, 0 if none has
+    uint32_t sourceSequence; // Sequence number from the binary source, or a count of JSON samples
 } powerManager_T;
 
+// Compact binary power record, an alternative to the JSON power message.
+// Fixed layout, little endian, no padding. Prices and power are in the same units as
+// the decoded JSON (kW for power). The sequence increments with each record; a
+// sequence of 0 marks a publisher restart and is always accepted.
+#define POWER_BINARY_VERSION 1
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;        // POWER_BINARY_VERSION
+    uint8_t reserved[3];    // Zero
+    uint32_t sequence;
+    float importPrice;
+    float exportPrice;
+    float batteryLevel;
+    float gridPowerkW;
+    float housePowerkW;
+    float solarPowerkW;
+    float batteryPowerkW;
+} powerBinaryRecord_T;
+
+_Static_assert(sizeof(powerBinaryRecord_T) == 36, "powerBinaryRecord_T layout changed");
+
+// Power data sources. Each decodes its own payload format into a powerManager_T and provides
+// some of its fields, so one source can fill in what another doesn't.
+#define POWER_FIELDS_PRICES 0x01    // importPrice, exportPrice, batteryLevel
+#define POWER_FIELDS_POWER 0x02     // gridPowerkW, housePowerkW, solarPowerkW, and receivedUs, sourceSequence
+#define POWER_FIELDS_BATTERY 0x04   // batteryPowerkW
+#define POWER_FIELDS_ALL (POWER_FIELDS_PRICES | POWER_FIELDS_POWER | POWER_FIELDS_BATTERY)
+
+typedef int (*powerSourceDecode_T)(powerManager_T* instance, const char* data, int len);
+
+typedef struct {
+    const char* name;
+    uint8_t fields;             // POWER_FIELDS_ the source provides
+    powerSourceDecode_T decode; // Returns 0 on success, the instance is only valid then
+} powerSource_T;
+
+extern const powerSource_T PowerSource_HomeAssistant;  // homeassistant/Power JSON
+extern const powerSource_T PowerSource_Envoy;          // Enphase Envoy /production.json
+
+// Double buffered power values, written by one task and read by others without locking.
+// buffer[SeqLock_Current(sequence)] holds the latest values.
+typedef struct {
+    powerManager_T buffer[2];
+    seqLock_T sequence;
+} powerManagerSnapshot_T;
+
+// Power history, sized for the last few minutes at the power feed rate (about 1 per second).
+// Samples are held as int16 watts, so +/- 32.7kW.
+#define POWER_HISTORY_SAMPLES 300   // 5 minutes
+#define POWER_SMOOTHING_SAMPLES 10  // Samples averaged for the smoothed maximum possible solar
+#define POWER_HISTORY_MAX_GAP_MS 10000  // A longer gap between samples starts the history afresh
+
+_Static_assert(POWER_SMOOTHING_SAMPLES < POWER_HISTORY_SAMPLES, "The smoothing window must fit in the history");
+
+// Power values with rolling statistics over the history
+typedef enum {
+    POWER_FIELD_GRID = 0,
+    POWER_FIELD_SOLAR,
+    POWER_FIELD_HOUSE,
+    POWER_FIELD_COUNT
+} powerField_T;
+
+typedef struct {
+    uint16_t count;         // Samples the statistics cover
+    float meankW;
+    float minkW;
+    float maxkW;
+    float variancekW2;
+} powerStats_T;
+
+// Hot path log events, passed as raw values to the log hook and formatted by PowerManager_FormatLog
+typedef enum {
+    POWER_LOG_VALUES = 0,       // importPrice, exportPrice, batteryLevel, house, grid, solar, battery
+    POWER_LOG_RELAY_SELECTED,   // relay, % power, kW at that relay, load kW
+    POWER_LOG_CONTROLLER        // grid error, integral, desired kW, max possible kW, old relay, new relay
+} powerLogEvent_T;
+
+typedef void (*powerManagerLogHook_T)(int level, uint8_t event, const float* values, int count);
+
+// Automatic controller modes
+typedef enum {
+    CONTROLLER_MODE_OPEN_LOOP = 0,  // One shot estimate of the required relay step (CalculateRelaySettings)
+    CONTROLLER_MODE_PI              // Closed loop PI / feed-forward on grid power (ExportController_Update)
+} controllerMode_T;
+
+typedef struct {
+    float kp;               // kW of production change per kW of grid power error
+    float ki;               // kW of production change per kW.s of accumulated grid power error
+    float deadbandkW;       // No action while the grid power error is within +/- this
+    float targetGridkW;     // Grid power set point, +ve is import, so slightly +ve avoids any export
+    uint32_t minDwellMs;    // Minimum time to stay on a relay step
+    uint8_t maxStepsPerUpdate; // Maximum relay steps to move in a single update
+} exportControllerConfig_T;
+
+typedef struct {
+    exportControllerConfig_T cfg;
+    float integralkWs;
+    int64_t lastUpdateUs;
+    int64_t lastChangeUs;
+} exportController_T;
+
 void PowerManager_Initialise(powerManager_T* instance);
+void PowerManager_SetLogHook(powerManagerLogHook_T hook);
+int PowerManager_FormatLog(uint8_t event, const float* values, char* line, size_t len);
+void PowerManager_SnapshotInitialise(powerManagerSnapshot_T* snapshot);
+void PowerManager_SnapshotWrite(powerManagerSnapshot_T* snapshot, const powerManager_T* instance);
+uint32_t PowerManager_SnapshotRead(const powerManagerSnapshot_T* snapshot, powerManager_T* instance);
 int PowerManager_Decode(powerManager_T*  instance, const char* s);
-uint8_t CalculateRelaySettings(powerManager_T* instance, uint8_t currentRelayValue);
+int PowerManager_DecodeStream(powerManager_T* instance, const char* data, int len);
+int PowerManager_DecodeBinary(powerManager_T* instance, const void* data, int len, uint32_t* lastSequence);
+int PowerManager_DecodeEnvoy(powerManager_T* instance, const char* data, int len);
+void PowerManager_Merge(powerManager_T* instance, const powerManager_T* from, uint8_t fields);
+bool PowerManager_RelayModelInitialise(void);
+void PowerManager_SetRelayLimits(const float* maxSolarkW, float maxBatterykW);
+bool PowerManager_SetRelayPower(int channel, const float* power);
+const float* PowerManager_RelayPower(int channel);
+float PowerManager_RelayPowerFraction(relayValue_T relayValue);
+void PowerManager_HistoryInitialise(void);
+void PowerManager_HistoryAdd(const powerManager_T* instance, relayValue_T relayValue);
+bool PowerManager_HistoryStats(powerField_T field, powerStats_T* stats);
+float PowerManager_HistorySolarMaxPossiblekW(void);
+relayValue_T CalculateRelaySettings(powerManager_T* instance, relayValue_T currentRelayValue);
+void ExportController_Initialise(exportController_T* ctl, const exportControllerConfig_T* cfg);
+relayValue_T ExportController_Update(exportController_T* ctl, const powerManager_T* instance, relayValue_T currentRelayValue, int64_t nowUs);
 
 #endif // __POWERMANAGER_C__
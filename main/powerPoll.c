@@ -0,0 +1,170 @@
+/* Local power data polling
+   
+   Polls a power data source on the local network over HTTP, such as the
+   Enphase Envoy's /production.json, instead of waiting for Home Assistant
+   to poll it and republish over MQTT. The connection is kept alive and
+   reused between polls. Responses are decoded by the source's decoder and
+   handed to a sink along with the fields the source provides.
+
+   Newer Envoy firmware needs https and a bearer token. Its certificate is
+   self signed, so it has to be pinned: given a certificate, only a server
+   presenting exactly that one is trusted. Without one, an https server is
+   checked against the bundled public CA certificates, as for any other
+   https source.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "commonvalues.h"
+#include "powerPoll.h"
+
+static esp_http_client_handle_t client = NULL;
+static const powerSource_T* pollSource = NULL;
+static powerPollSink_T pollSink = NULL;
+static TickType_t pollPeriod = 0;
+static char pinnedCert[POWER_POLL_CERT_LEN];    // The client refers to it on every reconnect
+static char response[POWER_POLL_BUFFER_LEN];
+static int responseLen = 0;
+static bool responseOverflow = false;
+
+// -----------------------------------------------
+// Collect the response body
+// -----------------------------------------------
+static esp_err_t HttpEvent(esp_http_client_event_t* evt)
+{
+    if (evt->event_id == HTTP_EVENT_ON_DATA) {
+        if (responseLen + evt->data_len <= sizeof(response)) {
+            memcpy(&response[responseLen], evt->data, evt->data_len);
+            responseLen += evt->data_len;
+        } else {
+            responseOverflow = true;
+        }
+    }
+    return ESP_OK;
+}
+
+// -----------------------------------------------
+// Poll the source on a fixed period
+// -----------------------------------------------
+static void PollTask(void* pvParameters)
+{
+    powerManager_T values;
+    uint32_t lastSequence = 0;
+    bool failing = false;
+    TickType_t lastWake = xTaskGetTickCount();
+
+    PowerManager_Initialise(&values);
+    while (true) {
+        vTaskDelayUntil(&lastWake, pollPeriod);
+
+        responseLen = 0;
+        responseOverflow = false;
+        esp_err_t err = esp_http_client_perform(client);   // Reconnects if the kept alive connection was dropped
+        int status = esp_http_client_get_status_code(client);
+        if (err != ESP_OK || status != 200 || responseOverflow || pollSource->decode(&values, response, responseLen) != 0) {
+            if (!failing) {
+                ESP_LOGW(TAG, "Polling %s failed: %s, HTTP status %d, %d bytes%s.", pollSource->name, esp_err_to_name(err), 
+                    status, responseLen, responseOverflow ? " (too long)" : "");
+            }
+            failing = true;
+            continue;
+        }
+        if (failing) { ESP_LOGI(TAG, "Polling %s recovered.", pollSource->name); }
+        failing = false;
+
+        // Leave a repeated reading out, so the power values still go stale if the source stops updating
+        if (values.sourceSequence != 0 && values.sourceSequence == lastSequence) { continue; }
+        lastSequence = values.sourceSequence;
+        pollSink(&values, pollSource->fields);
+    }
+}
+
+// ---------------------------------------------------
+// Change the time between polls
+//
+// Takes effect after the poll that's currently waiting.
+//
+// Params - periodMs - time between polls
+// ---------------------------------------------------
+void PowerPoll_SetPeriod(uint32_t periodMs)
+{
+    pollPeriod = pdMS_TO_TICKS((periodMs >= POWER_POLL_MIN_PERIOD_MS) ? periodMs : POWER_POLL_MIN_PERIOD_MS);
+}
+
+// ---------------------------------------------------
+// Start polling a local power data source
+//
+// Params - url - where to poll, http or https
+//        - token - bearer token, empty for none
+//        - cert - PEM certificate to pin for https, empty to use the CA bundle
+//        - periodMs - time between polls
+//        - source - decodes the responses
+//        - sink - given each new set of values, in the poll task
+// Returns- true if polling started
+// ---------------------------------------------------
+bool PowerPoll_Start(const char* url, const char* token, const char* cert, uint32_t periodMs, const powerSource_T* source, powerPollSink_T sink)
+{
+    static char auth[POWER_POLL_TOKEN_LEN + 8];     // Too big for the calling task's stack
+    esp_http_client_config_t httpConfig = {
+        .url = url,
+        .method = HTTP_METHOD_GET,
+        .timeout_ms = POWER_POLL_TIMEOUT_MS,
+        .keep_alive_enable = true,
+        .event_handler = HttpEvent,
+    };
+
+    if (strncmp(url, "https://", 8) == 0 && cert != NULL && cert[0] != 0) {
+        if (strlen(cert) >= sizeof(pinnedCert)) {
+            ESP_LOGE(TAG, "The pinned certificate for %s is longer than %u bytes.", url, (unsigned int)sizeof(pinnedCert));
+            return false;
+        }
+        // A pinned self signed certificate is issued to the device, not to whatever name or address it's
+        // reached by, so only the certificate itself is checked
+        strlcpy(pinnedCert, cert, sizeof(pinnedCert));
+        httpConfig.cert_pem = pinnedCert;
+        httpConfig.skip_cert_common_name_check = true;
+    } else if (strncmp(url, "https://", 8) == 0) {
+        httpConfig.crt_bundle_attach = esp_crt_bundle_attach;
+    }
+
+    pollSource = source;
+    pollSink = sink;
+    pollPeriod = pdMS_TO_TICKS((periodMs >= POWER_POLL_MIN_PERIOD_MS) ? periodMs : POWER_POLL_MIN_PERIOD_MS);
+    client = esp_http_client_init(&httpConfig);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Error creating the HTTP client for %s.", url);
+        return false;
+    }
+    if (token != NULL && token[0] != 0) {
+        snprintf(auth, sizeof(auth), "Bearer %s", token);
+        esp_http_client_set_header(client, "Authorization", auth);  // Copied by the client
+    }
+    if (xTaskCreate(PollTask, "powerPoll", POWER_POLL_TASK_STACK, NULL, POWER_POLL_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Error starting the power poll task.");
+        esp_http_client_cleanup(client);
+        client = NULL;
+        return false;
+    }
+    ESP_LOGI(TAG, "Polling %s at %s every %lu ms.", source->name, url, (unsigned long)(pollPeriod * portTICK_PERIOD_MS));
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef __POWERPOLL_H__
+#define __POWERPOLL_H__
+
+#include "powerManager.h"
+
+#define POWER_POLL_TASK_STACK 8192      // esp_http_client, and TLS if the URL is https
+#define POWER_POLL_TASK_PRIORITY 4      // Below the MQTT and control tasks
+#define POWER_POLL_BUFFER_LEN 4096      // Largest response, /production.json is about 2kB
+#define POWER_POLL_TIMEOUT_MS 2000
+#define POWER_POLL_MIN_PERIOD_MS 250
+#define POWER_POLL_TOKEN_LEN 512        // Longest bearer token, Envoy tokens are about 400 characters
+#define POWER_POLL_CERT_LEN 1536        // Longest pinned certificate PEM, an RSA 2048 certificate is about 1.2kB
+
+// Receives each new set of values from the poll task. Only the fields listed are valid.
+typedef void (*powerPollSink_T)(powerManager_T* values, uint8_t fields);
+
+bool PowerPoll_Start(const char* url, const char* token, const char* cert, uint32_t periodMs, const powerSource_T* source, powerPollSink_T sink);
+void PowerPoll_SetPeriod(uint32_t periodMs);
+
+#endif // __POWERPOLL_H__
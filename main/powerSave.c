@@ -0,0 +1,144 @@
+/* Idle power saving
+   
+   While there's no solar production there's nothing to curtail, so the
+   device drops into an idle mode. The power management locks that hold
+   the CPU at full speed and keep it out of light sleep are released,
+   letting ESP-IDF scale the frequency and light sleep between events, and
+   WiFi wakes only every listenInterval beacons. The first sample showing
+   production takes the locks again and puts WiFi back to waking on every
+   DTIM beacon, so that sample is handled at full speed.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+#include "commonvalues.h"
+#include "powerSave.h"
+
+static powerSaveConfig_T saveConfig;
+static bool enabled = false;
+static bool idle = false;
+static int64_t quietSinceUs = -1;       // esp_timer time production stopped, -1 while producing
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpuLock = NULL;
+static esp_pm_lock_handle_t sleepLock = NULL;
+#endif // CONFIG_PM_ENABLE
+
+// -----------------------------------------------
+// Take or release the locks and set the WiFi power save mode for active or idle
+// -----------------------------------------------
+static void Apply(bool idleNow)
+{
+#if CONFIG_PM_ENABLE
+    if (idleNow) {
+        esp_pm_lock_release(sleepLock);
+        esp_pm_lock_release(cpuLock);
+    } else {
+        esp_pm_lock_acquire(cpuLock);
+        esp_pm_lock_acquire(sleepLock);
+    }
+#endif // CONFIG_PM_ENABLE
+    esp_err_t err = esp_wifi_set_ps(idleNow ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error setting the WiFi power save mode: %d = %s", err, esp_err_to_name(err)); }
+}
+
+// ---------------------------------------------------
+// Initialise idle power saving
+//
+// Turns on dynamic frequency scaling and automatic light sleep, held off
+// by locks until the device goes idle. Call before WiFi starts, and set
+// the station config's listen_interval from cfg->listenInterval.
+//
+// Params - cfg - the idle settings
+// Returns- false if power management couldn't be enabled
+// ---------------------------------------------------
+bool PowerSave_Initialise(const powerSaveConfig_T* cfg)
+{
+    saveConfig = *cfg;
+    idle = false;
+    quietSinceUs = -1;
+
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pmConfig = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif // CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    };
+    esp_err_t err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "active", &cpuLock);
+    if (err == ESP_OK) { err = esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "awake", &sleepLock); }
+    if (err == ESP_OK) {
+        // Hold the locks before turning power management on, so nothing changes until we're idle
+        esp_pm_lock_acquire(cpuLock);
+        esp_pm_lock_acquire(sleepLock);
+        err = esp_pm_configure(&pmConfig);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error enabling power management: %d = %s", err, esp_err_to_name(err));
+        return false;
+    }
+    enabled = true;
+    return true;
+#else
+    ESP_LOGW(TAG, "Power management is disabled in this build, only WiFi modem sleep is used when idle.");
+    enabled = true;
+    return true;
+#endif // CONFIG_PM_ENABLE
+}
+
+// ---------------------------------------------------
+// Go idle or wake up from a new power sample
+//
+// Goes idle once there's been no production for idleEnterMs, and wakes on
+// the first sample with any.
+//
+// Params - solarPowerkW - the sample's solar production
+//        - nowUs - esp_timer_get_time()
+// Returns- true if the device went idle or woke up
+// ---------------------------------------------------
+bool PowerSave_Update(float solarPowerkW, int64_t nowUs)
+{
+    if (!enabled) { return false; }
+
+    if (solarPowerkW > saveConfig.idleSolarkW) {
+        quietSinceUs = -1;
+        if (!idle) { return false; }
+        idle = false;
+        Apply(false);
+        ESP_LOGI(TAG, "Solar production resumed, leaving idle mode.");
+        return true;
+    }
+
+    if (quietSinceUs < 0) { quietSinceUs = nowUs; }
+    if (idle || nowUs - quietSinceUs < (int64_t)saveConfig.idleEnterMs * 1000) { return false; }
+    idle = true;
+    Apply(true);
+    ESP_LOGI(TAG, "No solar production for %lu s, entering idle mode.", (unsigned long)(saveConfig.idleEnterMs / 1000));
+    return true;
+}
+
+// ---------------------------------------------------
+// Check whether the device is idle
+// ---------------------------------------------------
+bool PowerSave_Idle(void)
+{
+    return idle;
+}
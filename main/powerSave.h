@@ -0,0 +1,17 @@
+#ifndef __POWERSAVE_H__
+#define __POWERSAVE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    float idleSolarkW;          // Solar at or below this counts as no production
+    uint32_t idleEnterMs;       // How long there must be no production before going idle
+    uint8_t listenInterval;     // Beacon intervals between wakes while idle, set in the station config
+} powerSaveConfig_T;
+
+bool PowerSave_Initialise(const powerSaveConfig_T* cfg);
+bool PowerSave_Update(float solarPowerkW, int64_t nowUs);
+bool PowerSave_Idle(void);
+
+#endif // __POWERSAVE_H__
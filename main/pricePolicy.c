@@ -0,0 +1,145 @@
+/* Price aware curtailment policy
+   
+   Turns a tariff forecast pushed over MQTT into a per-interval curtailment
+   plan, once per forecast. Deciding whether to curtail for a power sample
+   is then a single table lookup and a comparison with the threshold. Outside the forecast, or before the clock
+   is set, the live export price from the power data is used instead.
+
+   Forecast format, one price per interval from start:
+     {"start": <unix time>, "interval": <seconds>, "export": [0.05, -0.01, ...]}
+   The whole forecast must fit in the MQTT receive buffer, CONFIG_MQTT_BUFFER_SIZE
+   (1024 bytes by default), which is enough for PRICE_POLICY_MAX_INTERVALS prices
+   given to four decimal places.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "commonvalues.h"
+#include "pricePolicy.h"
+#include "seqLock.h"
+
+// Double buffered plan, written by the MQTT task and read by the control task without locking.
+// plans[SeqLock_Current(planSequence)] is current.
+static pricePlan_T plans[2];
+static seqLock_T planSequence = 0;
+// Set by the MQTT task when the configuration changes, read by the control task
+static atomic_bool policyEnabled = false;
+static _Atomic float threshold = 0.0;
+
+// ---------------------------------------------------
+// Initialise the policy
+//
+// Params - enabled - false to curtail whatever the price, as before there was a policy
+//        - exportThreshold - curtail while the export price is below this
+// ---------------------------------------------------
+void PricePolicy_Initialise(bool enabled, float exportThreshold)
+{
+    atomic_store(&policyEnabled, enabled);
+    atomic_store(&threshold, exportThreshold);
+    memset(plans, 0, sizeof(plans));
+    SeqLock_Initialise(&planSequence);
+}
+
+// ---------------------------------------------------
+// Change the policy settings, keeping the current plan
+//
+// Params - enabled - false to curtail whatever the price
+//        - exportThreshold - curtail while the export price is below this
+// ---------------------------------------------------
+void PricePolicy_Configure(bool enabled, float exportThreshold)
+{
+    atomic_store(&policyEnabled, enabled);
+    atomic_store(&threshold, exportThreshold);
+}
+
+// ---------------------------------------------------
+// Build a new plan from a tariff forecast
+//
+// Only one task may call this.
+//
+// Params - data - the forecast JSON, not necessarily null terminated
+//        - len - its length
+// Returns- the number of intervals planned, or -1 if the forecast was invalid
+// ---------------------------------------------------
+int PricePolicy_Update(const char* data, int len)
+{
+    cJSON* forecast = cJSON_ParseWithLength(data, len);
+    if (forecast == NULL) {
+        ESP_LOGE(TAG, "Tariff forecast isn't valid JSON.");
+        return -1;
+    }
+
+    const cJSON* start = cJSON_GetObjectItemCaseSensitive(forecast, "start");
+    const cJSON* interval = cJSON_GetObjectItemCaseSensitive(forecast, "interval");
+    const cJSON* prices = cJSON_GetObjectItemCaseSensitive(forecast, "export");
+    if (!cJSON_IsNumber(start) || !cJSON_IsNumber(interval) || interval->valuedouble < 60 || !cJSON_IsArray(prices)) {
+        ESP_LOGE(TAG, "Tariff forecast needs start, interval (at least 60 seconds) and export.");
+        cJSON_Delete(forecast);
+        return -1;
+    }
+
+    int curtailed = 0;
+    float limit = atomic_load(&threshold);
+    const cJSON* price = NULL;
+    pricePlan_T* plan = &plans[SeqLock_WriteBegin(&planSequence)];
+    plan->start = (int64_t)start->valuedouble;
+    plan->intervalS = (uint32_t)interval->valuedouble;
+    plan->count = 0;
+    cJSON_ArrayForEach(price, prices) {
+        if (plan->count == PRICE_POLICY_MAX_INTERVALS) { break; }
+        float exportPrice = cJSON_IsNumber(price) ? (float)price->valuedouble : -INFINITY; // Unknown is treated as cheap
+        if (exportPrice < limit) { curtailed++; }
+        plan->exportPrice[plan->count++] = exportPrice;
+    }
+    cJSON_Delete(forecast);
+
+    SeqLock_WriteEnd(&planSequence);
+    ESP_LOGI(TAG, "Tariff plan updated: %u intervals of %lu s, curtailing in %d.", plan->count, (unsigned long)plan->intervalS, curtailed);
+    return plan->count;
+}
+
+// ---------------------------------------------------
+// Decide whether to curtail export now
+//
+// Params - now - time(), or 0 if the clock isn't set
+//        - liveExportPrice - the export price from the latest power data
+// Returns- true to curtail
+// ---------------------------------------------------
+bool PricePolicy_Curtail(time_t now, float liveExportPrice)
+{
+    if (!atomic_load(&policyEnabled)) { return true; }
+
+    unsigned int seq;
+    float exportPrice;
+    do {
+        seq = SeqLock_ReadBegin(&planSequence);
+        const pricePlan_T* plan = &plans[SeqLock_Current(seq)];
+        exportPrice = liveExportPrice;  // No plan for now
+        if (SeqLock_Updates(seq) > 0 && now >= plan->start && plan->intervalS > 0) {
+            int64_t index = (now - plan->start) / plan->intervalS;
+            if (index < plan->count) { exportPrice = plan->exportPrice[index]; }
+        }
+    } while (SeqLock_ReadRetry(&planSequence, seq));
+
+    return exportPrice < atomic_load(&threshold);
+}
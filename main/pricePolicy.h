@@ -0,0 +1,24 @@
+#ifndef __PRICEPOLICY_H__
+#define __PRICEPOLICY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PRICE_POLICY_MAX_INTERVALS 96   // 48 hours of 30 minute intervals
+
+// A curtailment plan, precomputed from a tariff forecast. The prices are kept rather than
+// the decisions so a new threshold applies to the plan straight away.
+typedef struct {
+    int64_t start;          // time() at the start of the first interval
+    uint32_t intervalS;
+    uint16_t count;
+    float exportPrice[PRICE_POLICY_MAX_INTERVALS];  // -INFINITY where the forecast price is unknown
+} pricePlan_T;
+
+void PricePolicy_Initialise(bool enabled, float exportThreshold);
+void PricePolicy_Configure(bool enabled, float exportThreshold);
+int PricePolicy_Update(const char* data, int len);
+bool PricePolicy_Curtail(time_t now, float liveExportPrice);
+
+#endif // __PRICEPOLICY_H__
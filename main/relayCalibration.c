@@ -0,0 +1,241 @@
+/* Relay power curve calibration
+
+   Learns how much of the available solar each DRM relay code really lets
+   through at this site. Whenever a single channel's relay code changes,
+   the settled solar output just before the change is compared with the
+   settled output just after it. While the sun hasn't moved much between
+   the two, their ratio is the ratio of the two codes' production. Each
+   observation nudges the higher code's entry towards what it implies,
+   keeping code 0 as full production and the curve strictly decreasing.
+
+   The learned curves are handed to the power manager, so the maximum
+   possible solar estimates and both controllers use them, and are saved
+   to NVS so they survive a restart.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "commonvalues.h"
+#include "powerManager.h"
+#include "relayCalibration.h"
+
+#define RELAY_CALIBRATION_MAGIC 0x52435631  // "RCV1"
+
+typedef struct {
+    uint32_t magic;
+    uint8_t channels;       // RELAY_CHANNELS when saved
+    uint8_t steps;          // RELAY_STEPS when saved
+    uint8_t reserved[2];
+    float power[RELAY_CHANNELS][RELAY_STEPS];
+} relayCalibrationRecord_T;
+
+static relayCalibrationConfig_T calConfig;
+static bool enabled = false;
+static bool loaded = false;                 // learned has been initialised
+static float learned[RELAY_CHANNELS][RELAY_STEPS];
+static bool dirty = false;                  // learned hasn't been written to NVS
+static int64_t savedUs = 0;                 // esp_timer time of the last NVS write
+
+static relayValue_T sampleValue = 0;        // Relay value of the latest sample
+static int64_t valueSinceUs = 0;            // When samples at sampleValue started
+static bool settled = false;                // There's been a settled sample at sampleValue
+static float settledkW = 0.0;               // The latest settled sample at sampleValue
+static int64_t settledUs = 0;
+static bool pending = false;                // There's a settled sample from before the last change to compare with
+static relayValue_T beforeValue = 0;
+static float beforekW = 0.0;
+static int64_t beforeUs = 0;
+
+// -----------------------------------------------
+// Load the learned curves from NVS, or start from the built in tables
+// -----------------------------------------------
+static void Load(void)
+{
+    relayCalibrationRecord_T record;
+    size_t len = sizeof(record);
+    nvs_handle_t handle;
+    bool found = false;
+
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        PowerManager_SetRelayPower(channel, NULL);
+        memcpy(learned[channel], PowerManager_RelayPower(channel), sizeof(learned[channel]));
+    }
+    if (nvs_open(RELAY_CALIBRATION_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        found = (nvs_get_blob(handle, RELAY_CALIBRATION_NVS_KEY, &record, &len) == ESP_OK && len == sizeof(record)
+            && record.magic == RELAY_CALIBRATION_MAGIC && record.channels == RELAY_CHANNELS && record.steps == RELAY_STEPS);
+        nvs_close(handle);
+    }
+    if (found) {
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+            if (PowerManager_SetRelayPower(channel, record.power[channel])) {
+                memcpy(learned[channel], record.power[channel], sizeof(learned[channel]));
+            } else {
+                ESP_LOGW(TAG, "Saved relay %d power curve isn't valid, using the built in one.", channel);
+            }
+        }
+        ESP_LOGI(TAG, "Loaded the learned relay power curves from NVS.");
+    }
+    loaded = true;
+}
+
+// -----------------------------------------------
+// Write the learned curves to NVS
+// -----------------------------------------------
+static void Save(void)
+{
+    relayCalibrationRecord_T record = { .magic = RELAY_CALIBRATION_MAGIC, .channels = RELAY_CHANNELS, .steps = RELAY_STEPS };
+    nvs_handle_t handle;
+
+    memcpy(record.power, learned, sizeof(record.power));
+    esp_err_t err = nvs_open(RELAY_CALIBRATION_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, RELAY_CALIBRATION_NVS_KEY, &record, sizeof(record));
+        if (err == ESP_OK) { err = nvs_commit(handle); }
+        nvs_close(handle);
+    }
+    savedUs = esp_timer_get_time();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving the relay power curves to NVS: %s", esp_err_to_name(err));
+        return;
+    }
+    dirty = false;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        ESP_LOGI(TAG, "Saved relay %d power curve, code 1 %0.3f, code 8 %0.3f, code 15 %0.3f.", channel,
+            learned[channel][1], learned[channel][8], learned[channel][RELAY_STEPS - 1]);
+    }
+}
+
+// -----------------------------------------------
+// Learn from a pair of settled samples either side of a relay change
+// -----------------------------------------------
+static void Learn(relayValue_T valueA, float kWA, relayValue_T valueB, float kWB)
+{
+    if (kWA < RELAY_CALIBRATION_MIN_SOLAR_KW || kWB < RELAY_CALIBRATION_MIN_SOLAR_KW) { return; }
+
+    // Only a change on a single channel says anything about that channel's curve
+    int channel = -1;
+    for (int c = 0; c < RELAY_CHANNELS; c++) {
+        if (RELAY_VALUE_CODE(valueA, c) == RELAY_VALUE_CODE(valueB, c)) { continue; }
+        if (channel >= 0) { return; }
+        channel = c;
+    }
+    if (channel < 0) { return; }
+
+    // The value with the lower code is the anchor, and the higher code's entry is the one learned
+    bool curtailed = RELAY_VALUE_CODE(valueB, channel) > RELAY_VALUE_CODE(valueA, channel);
+    relayValue_T lowValue = curtailed ? valueA : valueB;
+    relayValue_T highValue = curtailed ? valueB : valueA;
+    float ratio = curtailed ? kWB / kWA : kWA / kWB;
+    if (ratio >= 1.0) { return; }   // Cloud, or the limit isn't binding
+
+    // Scale the modelled drop in production by how much bigger or smaller the observed one was. The
+    // other channels don't change, so this works in whole system fractions without needing their sizes.
+    float lowFraction = PowerManager_RelayPowerFraction(lowValue);
+    float modelDrop = lowFraction - PowerManager_RelayPowerFraction(highValue);
+    float observedDrop = lowFraction * (1.0 - ratio);
+    float scale = observedDrop / modelDrop;
+    if (modelDrop <= 0.0 || scale > RELAY_CALIBRATION_MAX_SCALE || scale < 1.0 / RELAY_CALIBRATION_MAX_SCALE) { return; }
+
+    float* table = learned[channel];
+    int low = RELAY_VALUE_CODE(lowValue, channel);
+    int high = RELAY_VALUE_CODE(highValue, channel);
+    float estimate = table[low] - (table[low] - table[high]) * scale;
+    float updated = table[high] + RELAY_CALIBRATION_WEIGHT * (estimate - table[high]);
+
+    // Stay strictly between the neighbouring codes
+    float upper = table[high - 1] - RELAY_CALIBRATION_MIN_GAP;
+    float lower = ((high + 1 < RELAY_STEPS) ? table[high + 1] : 0.0) + RELAY_CALIBRATION_MIN_GAP;
+    if (upper < lower) { return; }
+    if (updated > upper) { updated = upper; }
+    if (updated < lower) { updated = lower; }
+
+    ESP_LOGD(TAG, "Relay %d code %d -> %d produced %0.3f of the output, code %d moves from %0.3f to %0.3f.",
+        channel, low, high, ratio, high, table[high], updated);
+    table[high] = updated;
+    if (PowerManager_SetRelayPower(channel, table)) { dirty = true; }
+}
+
+// ---------------------------------------------------
+// Start, stop or change the calibration
+//
+// The first time it's enabled the learned curves are loaded from NVS and
+// handed to the power manager. Disabling it goes back to the built in
+// tables, without forgetting what was learned.
+//
+// Params - cfg - what to do
+// ---------------------------------------------------
+void RelayCalibration_Configure(const relayCalibrationConfig_T* cfg)
+{
+    calConfig = *cfg;
+    pending = false;
+    settled = false;
+    if (calConfig.enabled && !loaded) {
+        Load();
+        savedUs = esp_timer_get_time();
+    } else if (calConfig.enabled) {
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) { PowerManager_SetRelayPower(channel, learned[channel]); }
+    } else if (enabled) {
+        for (int channel = 0; channel < RELAY_CHANNELS; channel++) { PowerManager_SetRelayPower(channel, NULL); }
+    }
+    enabled = calConfig.enabled;
+}
+
+// ---------------------------------------------------
+// Learn from a new power sample
+//
+// Params - solarkW - the solar production
+//        - relayValue - the relay value it was produced at
+//        - nowUs - esp_timer_get_time() when it arrived
+// ---------------------------------------------------
+void RelayCalibration_Sample(float solarkW, relayValue_T relayValue, int64_t nowUs)
+{
+    if (!enabled) { return; }
+
+    // A change makes the last settled sample at the old value the one to compare with
+    if (relayValue != sampleValue) {
+        pending = settled;
+        beforeValue = sampleValue;
+        beforekW = settledkW;
+        beforeUs = settledUs;
+        sampleValue = relayValue;
+        valueSinceUs = nowUs;
+        settled = false;
+        return;
+    }
+
+    if (nowUs - valueSinceUs < (int64_t)calConfig.settleMs * 1000) { return; }
+    settled = true;
+    settledkW = solarkW;
+    settledUs = nowUs;
+    if (pending) {
+        pending = false;
+        if (nowUs - beforeUs <= (int64_t)calConfig.windowMs * 1000) { Learn(beforeValue, beforekW, relayValue, solarkW); }
+    }
+}
+
+// ---------------------------------------------------
+// Periodic housekeeping, writes changed curves to NVS now and then
+// ---------------------------------------------------
+void RelayCalibration_Tick(void)
+{
+    if (dirty && esp_timer_get_time() - savedUs >= (int64_t)RELAY_CALIBRATION_SAVE_PERIOD_S * 1000000) { Save(); }
+}
@@ -0,0 +1,26 @@
+#ifndef __RELAYCALIBRATION_H__
+#define __RELAYCALIBRATION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "commonvalues.h"
+
+#define RELAY_CALIBRATION_NVS_NAMESPACE "relay"
+#define RELAY_CALIBRATION_NVS_KEY "curve"
+#define RELAY_CALIBRATION_SAVE_PERIOD_S 3600    // Write a changed curve to NVS at most this often
+#define RELAY_CALIBRATION_MIN_SOLAR_KW 0.3      // Don't learn from less solar than this, the ratio is mostly noise
+#define RELAY_CALIBRATION_WEIGHT 0.1            // How far each observation moves the learned curve
+#define RELAY_CALIBRATION_MAX_SCALE 4.0         // Observed step sizes further than this from the curve are outliers
+#define RELAY_CALIBRATION_MIN_GAP 0.005         // Smallest production difference between adjacent relay codes
+
+typedef struct {
+    bool enabled;
+    uint32_t settleMs;      // Time after a relay change before the solar output reflects it
+    uint32_t windowMs;      // Longest time between the two samples compared, so the sun hasn't moved much
+} relayCalibrationConfig_T;
+
+void RelayCalibration_Configure(const relayCalibrationConfig_T* cfg);
+void RelayCalibration_Sample(float solarkW, relayValue_T relayValue, int64_t nowUs);
+void RelayCalibration_Tick(void);
+
+#endif // __RELAYCALIBRATION_H__
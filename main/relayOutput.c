@@ -0,0 +1,116 @@
+/* Relay output driver
+   
+   Drives the four DRM relay outputs of every channel with a single write to
+   the GPIO output register, so an Envoy never sees an intermediate relay code. Separate
+   gpio_set_level calls, or a w1ts write followed by a w1tc write, would
+   briefly present a mix of the old and new codes.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "soc/gpio_struct.h"
+#include "commonvalues.h"
+#include "relayOutput.h"
+
+_Static_assert(RELAY0 < 32 && RELAY1 < 32 && RELAY2 < 32 && RELAY3 < 32, "Relay outputs must all be in GPIO bank 0");
+
+static const gpio_num_t channelPins[RELAY_CHANNELS][4] = {
+    RELAY_CHANNEL0_PINS,
+#if RELAY_CHANNELS > 1
+    RELAY_CHANNEL1_PINS,
+#endif
+#if RELAY_CHANNELS > 2
+    RELAY_CHANNEL2_PINS,
+#endif
+#if RELAY_CHANNELS > 3
+    RELAY_CHANNEL3_PINS,
+#endif
+};
+
+static portMUX_TYPE relayOutputLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t outputBits[RELAY_CHANNELS][16];     // GPIO.out bits for each channel's relay code
+static uint32_t relayMask = 0;                      // Every channel's relay pins
+
+// ---------------------------------------------------
+// Initialise the relay outputs
+//
+// The output levels are set before the pins become outputs,
+// so the relays go straight to the given value at boot.
+//
+// Params - relayValue - the relay value to start with
+// ---------------------------------------------------
+void RelayOutput_Initialise(relayValue_T relayValue)
+{
+    relayMask = 0;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        for (int bit = 0; bit < 4; bit++) {
+            if (channelPins[channel][bit] >= 32) {
+                ESP_LOGE(TAG, "Relay channel %d output %d is GPIO %d, outside bank 0. It won't be driven.", channel, bit, channelPins[channel][bit]);
+                continue;
+            }
+            relayMask |= 1UL << channelPins[channel][bit];
+        }
+        for (int value = 0; value < 16; value++) {
+#if RELAY_OUTPUT_GRAY_CODE
+            uint8_t code = value ^ (value >> 1);
+#else
+            uint8_t code = value;
+#endif // RELAY_OUTPUT_GRAY_CODE
+            outputBits[channel][value] = 0;
+            for (int bit = 0; bit < 4; bit++) {
+                if ((code & (1 << bit)) && channelPins[channel][bit] < 32) { outputBits[channel][value] |= 1UL << channelPins[channel][bit]; }
+            }
+        }
+    }
+
+    RelayOutput_Write(relayValue);
+    gpio_config_t io = {
+        .pin_bit_mask = relayMask,
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    esp_err_t err = gpio_config(&io);
+    if (err != ESP_OK) { ESP_LOGE(TAG, "Error configuring the relay outputs: %d = %s", err, esp_err_to_name(err)); }
+
+#if SOC_GPIO_SUPPORT_SLP_SWITCH
+    // Keep driving the relays through automatic light sleep, see powerSave.c
+    for (int pin = 0; pin < 32; pin++) {
+        if (relayMask & (1UL << pin)) { gpio_sleep_sel_dis((gpio_num_t)pin); }
+    }
+#endif // SOC_GPIO_SUPPORT_SLP_SWITCH
+}
+
+// ---------------------------------------------------
+// Set every channel's relay outputs at once
+//
+// Params - relayValue - the relay value, one relay code per channel
+// ---------------------------------------------------
+void RelayOutput_Write(relayValue_T relayValue)
+{
+    uint32_t bits = 0;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) { bits |= outputBits[channel][RELAY_VALUE_CODE(relayValue, channel)]; }
+
+    // Read-modify-write of the whole output register, so other pins in the bank are left alone
+    // and all of the relay pins change on the same store
+    portENTER_CRITICAL(&relayOutputLock);
+    GPIO.out = (GPIO.out & ~relayMask) | bits;
+    portEXIT_CRITICAL(&relayOutputLock);
+}
@@ -0,0 +1,25 @@
+#ifndef __RELAYOUTPUT_H__
+#define __RELAYOUTPUT_H__
+
+#include "driver/gpio.h"
+#include "commonvalues.h"
+
+// DRM relay outputs, bit 0 to bit 3 of each channel's relay code. All must be in GPIO bank 0
+// (GPIO0-31) so every channel can be written together through the single GPIO.out register.
+#define RELAY0 GPIO_NUM_26
+#define RELAY1 GPIO_NUM_27
+#define RELAY2 GPIO_NUM_9
+#define RELAY3 GPIO_NUM_10
+#define RELAY_CHANNEL0_PINS { RELAY0, RELAY1, RELAY2, RELAY3 }
+#define RELAY_CHANNEL1_PINS { GPIO_NUM_16, GPIO_NUM_17, GPIO_NUM_18, GPIO_NUM_19 }
+#define RELAY_CHANNEL2_PINS { GPIO_NUM_21, GPIO_NUM_22, GPIO_NUM_23, GPIO_NUM_25 }
+#define RELAY_CHANNEL3_PINS { GPIO_NUM_4, GPIO_NUM_5, GPIO_NUM_12, GPIO_NUM_14 }
+
+// Set to 1 to drive the relays with the Gray code of the relay value, so adjacent steps only
+// change one relay. Only for installations where the Envoy's DRM mapping is set up to match.
+#define RELAY_OUTPUT_GRAY_CODE 0
+
+void RelayOutput_Initialise(relayValue_T relayValue);
+void RelayOutput_Write(relayValue_T relayValue);
+
+#endif // __RELAYOUTPUT_H__
@@ -0,0 +1,151 @@
+/* Relay transition scheduler
+   
+   Sits between the relay decision and the GPIO write. Curtailing (a higher
+   relay value) is applied at once so we never sit in export, but restoring
+   production only moves one step on one channel at a time, each after a
+   minimum dwell.
+   The relay value is only published once it has settled, so a ramp or a
+   burst of flapping decisions costs one MQTT message.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "relayScheduler.h"
+
+static relayValue_T appliedValue = 0;   // On the relays now
+static relayValue_T targetValue = 0;    // Where we're heading
+static relayValue_T publishedValue = 0; // Last value published
+static int64_t lastChangeUs = 0;        // esp_timer time of the last relay change
+static int64_t dwellUs = 0;
+static int64_t settleUs = 0;
+
+// ---------------------------------------------------
+// Initialise the scheduler
+//
+// Params - value - the value already on the relays, taken as published
+//        - minDwellMs - minimum time on each step before production is increased
+//        - publishSettleMs - how long a value must be steady before it's published
+//        - nowUs - esp_timer_get_time()
+// ---------------------------------------------------
+void RelayScheduler_Initialise(relayValue_T value, uint32_t minDwellMs, uint32_t publishSettleMs, int64_t nowUs)
+{
+    appliedValue = value;
+    targetValue = value;
+    publishedValue = value;
+    dwellUs = (int64_t)minDwellMs * 1000;
+    settleUs = (int64_t)publishSettleMs * 1000;
+    lastChangeUs = nowUs - dwellUs; // The first step doesn't have to wait
+}
+
+// ---------------------------------------------------
+// Change the timings without disturbing a transition in progress
+//
+// Params - minDwellMs - minimum time on each step before production is increased
+//        - publishSettleMs - how long a value must be steady before it's published
+// ---------------------------------------------------
+void RelayScheduler_SetTimings(uint32_t minDwellMs, uint32_t publishSettleMs)
+{
+    dwellUs = (int64_t)minDwellMs * 1000;
+    settleUs = (int64_t)publishSettleMs * 1000;
+}
+
+// ---------------------------------------------------
+// Move towards a new target relay value
+//
+// Params - target - the relay value the controller wants
+//        - nowUs - esp_timer_get_time()
+// Returns- the relay value to apply now
+// ---------------------------------------------------
+relayValue_T RelayScheduler_Step(relayValue_T target, int64_t nowUs)
+{
+    bool curtailed = false;
+
+    // Curtailing, go straight there on every channel that needs it
+    targetValue = target;
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        uint8_t code = RELAY_VALUE_CODE(targetValue, channel);
+        if (code > RELAY_VALUE_CODE(appliedValue, channel)) {
+            appliedValue = RELAY_VALUE_WITH_CODE(appliedValue, channel, code);
+            curtailed = true;
+        }
+    }
+    if (curtailed) {
+        lastChangeUs = nowUs;
+        return appliedValue;
+    }
+
+    // Increasing production, one step on one channel per dwell
+    if (nowUs - lastChangeUs < dwellUs) { return appliedValue; }
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        uint8_t code = RELAY_VALUE_CODE(appliedValue, channel);
+        if (RELAY_VALUE_CODE(targetValue, channel) < code) {
+            appliedValue = RELAY_VALUE_WITH_CODE(appliedValue, channel, code - 1);
+            lastChangeUs = nowUs;
+            break;
+        }
+    }
+    return appliedValue;
+}
+
+// ---------------------------------------------------
+// Check whether there's a settled relay value to publish
+//
+// Params - nowUs - esp_timer_get_time()
+//        - value - set to the value to publish
+//        - previous - set to the value published before, so only the channels that changed need publishing
+// Returns- true if the value should be published now
+// ---------------------------------------------------
+bool RelayScheduler_TakePublish(int64_t nowUs, relayValue_T* value, relayValue_T* previous)
+{
+    if (appliedValue != targetValue || appliedValue == publishedValue || nowUs - lastChangeUs < settleUs) { return false; }
+    *previous = publishedValue;
+    publishedValue = appliedValue;
+    *value = appliedValue;
+    return true;
+}
+
+// -----------------------------------------------
+// Check whether production is still being stepped up on any channel
+// -----------------------------------------------
+static bool Raising(void)
+{
+    for (int channel = 0; channel < RELAY_CHANNELS; channel++) {
+        if (RELAY_VALUE_CODE(appliedValue, channel) > RELAY_VALUE_CODE(targetValue, channel)) { return true; }
+    }
+    return false;
+}
+
+// ---------------------------------------------------
+// Get how long until the scheduler needs to run again
+//
+// Params - nowUs - esp_timer_get_time()
+// Returns- microseconds until the next step or publish is due, or -1 if there's nothing pending
+// ---------------------------------------------------
+int64_t RelayScheduler_NextWakeUs(int64_t nowUs)
+{
+    int64_t dueUs;
+    if (Raising()) {
+        dueUs = lastChangeUs + dwellUs;
+    } else if (appliedValue != publishedValue) {
+        dueUs = lastChangeUs + settleUs;
+    } else {
+        return -1;
+    }
+    return (dueUs > nowUs) ? dueUs - nowUs : 0;
+}
@@ -0,0 +1,12 @@
+#ifndef __RELAYSCHEDULER_H__
+#define __RELAYSCHEDULER_H__
+
+#include "commonvalues.h"
+
+void RelayScheduler_Initialise(relayValue_T value, uint32_t minDwellMs, uint32_t publishSettleMs, int64_t nowUs);
+void RelayScheduler_SetTimings(uint32_t minDwellMs, uint32_t publishSettleMs);
+relayValue_T RelayScheduler_Step(relayValue_T targetValue, int64_t nowUs);
+bool RelayScheduler_TakePublish(int64_t nowUs, relayValue_T* relayValue, relayValue_T* previous);
+int64_t RelayScheduler_NextWakeUs(int64_t nowUs);
+
+#endif // __RELAYSCHEDULER_H__
@@ -0,0 +1,198 @@
+/* Relay state persistence
+   
+   Keeps the last applied relay value in RTC memory, which survives soft
+   resets, and in NVS, which survives power cycles, so the relays can be
+   put back the way they were before the network is up. NVS writes are
+   coalesced so a burst of relay changes only costs one flash write.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "commonvalues.h"
+#include "relayState.h"
+
+#define RELAY_STATE_MAGIC 0x524C5932    // "RLY2"
+
+typedef struct {
+    relayValue_T relayValue;
+    bool allowUnknownAge;   // Limits in force when saved, as the configuration isn't loaded yet at restore
+    uint32_t maxAgeS;
+    int64_t savedTime;      // time() when this value was last known to be current
+} relayStateRecord_T;
+
+typedef struct {
+    uint32_t magic;
+    relayStateRecord_T record;
+    uint32_t check;
+} relayStateRtc_T;
+
+// Survives soft resets (panic, watchdog, esp_restart) but not power cycles
+RTC_NOINIT_ATTR static relayStateRtc_T rtcState;
+
+static relayValue_T currentValue = 0;
+static bool dirty = false;              // currentValue hasn't been written to NVS
+static int64_t changedUs = 0;           // esp_timer time of the last change
+static int64_t nvsSavedTime = 0;        // time() of the last NVS write
+static uint32_t restoreMaxAgeS = 3600;
+static bool restoreAllowUnknownAge = true;
+
+static uint32_t RtcCheck(const relayStateRtc_T* rtc)
+{
+    return rtc->magic ^ rtc->record.relayValue ^ ((uint32_t)rtc->record.allowUnknownAge << 8) ^ rtc->record.maxAgeS 
+        ^ (uint32_t)rtc->record.savedTime ^ (uint32_t)(rtc->record.savedTime >> 32) ^ 0xA5A5A5A5;
+}
+
+static void RtcSave(void)
+{
+    rtcState.magic = RELAY_STATE_MAGIC;
+    rtcState.record.relayValue = currentValue;
+    rtcState.record.allowUnknownAge = restoreAllowUnknownAge;
+    rtcState.record.maxAgeS = restoreMaxAgeS;
+    rtcState.record.savedTime = time(NULL);
+    rtcState.check = RtcCheck(&rtcState);
+}
+
+static void NvsSave(void)
+{
+    nvs_handle_t handle;
+    relayStateRecord_T record = { 
+        .relayValue = currentValue, 
+        .allowUnknownAge = restoreAllowUnknownAge,
+        .maxAgeS = restoreMaxAgeS,
+        .savedTime = time(NULL) 
+    };
+
+    esp_err_t err = nvs_open(RELAY_STATE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, RELAY_STATE_NVS_KEY, &record, sizeof(record));
+        if (err == ESP_OK) { err = nvs_commit(handle); }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) { 
+        ESP_LOGE(TAG, "Error saving the relay state to NVS: %s", esp_err_to_name(err)); 
+        return;
+    }
+    dirty = false;
+    nvsSavedTime = record.savedTime;
+    ESP_LOGD(TAG, "Saved relay state %0*X to NVS", RELAY_CHANNELS, currentValue);
+}
+
+// ---------------------------------------------------
+// Restore the relay value saved before the last reset
+//
+// Tries RTC memory first, as it's only valid after a soft reset and its
+// age is always known. Otherwise uses NVS, whose age is only known if the
+// clock was set before the value was saved and is still running. The
+// staleness limits are the ones saved with the value.
+//
+// Params - relayValue - set to the restored value on success
+// Returns- true if a value was restored
+// ---------------------------------------------------
+bool RelayState_Restore(relayValue_T* relayValue)
+{
+    int64_t now = time(NULL);
+    relayStateRecord_T record;
+    bool ageKnown = false;
+    bool found = false;
+
+    if (rtcState.magic == RELAY_STATE_MAGIC && rtcState.check == RtcCheck(&rtcState)) {
+        record = rtcState.record;
+        ageKnown = true;
+        found = true;
+        ESP_LOGI(TAG, "Found relay state %0*X in RTC memory", RELAY_CHANNELS, record.relayValue);
+    } else {
+        nvs_handle_t handle;
+        size_t len = sizeof(record);
+        if (nvs_open(RELAY_STATE_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+            found = (nvs_get_blob(handle, RELAY_STATE_NVS_KEY, &record, &len) == ESP_OK && len == sizeof(record));
+            nvs_close(handle);
+        }
+        ageKnown = found && now >= RELAY_STATE_VALID_TIME && record.savedTime >= RELAY_STATE_VALID_TIME;
+        if (found) { ESP_LOGI(TAG, "Found relay state %0*X in NVS", RELAY_CHANNELS, record.relayValue); }
+    }
+    rtcState.magic = 0;  // Only use it once
+
+    if (!found || record.relayValue > RELAY_VALUE_MAX) { return false; }
+    if (ageKnown && (now < record.savedTime || now - record.savedTime > record.maxAgeS)) {
+        ESP_LOGI(TAG, "Saved relay state is %lld seconds old, not restoring it", now - record.savedTime);
+        return false;
+    }
+    if (!ageKnown && !record.allowUnknownAge) {
+        ESP_LOGI(TAG, "Saved relay state is of unknown age, not restoring it");
+        return false;
+    }
+
+    currentValue = record.relayValue;
+    nvsSavedTime = ageKnown ? record.savedTime : 0;
+    *relayValue = record.relayValue;
+    return true;
+}
+
+// ---------------------------------------------------
+// Set the staleness limits saved with the relay value
+//
+// Params - maxAgeS - don't restore values older than this
+//        - allowUnknownAge - restore an NVS value even if its age can't be worked out
+// ---------------------------------------------------
+void RelayState_SetLimits(uint32_t maxAgeS, bool allowUnknownAge)
+{
+    restoreMaxAgeS = maxAgeS;
+    restoreAllowUnknownAge = allowUnknownAge;
+}
+
+// ---------------------------------------------------
+// Record a newly applied relay value
+//
+// Updates RTC memory straight away. The NVS write is left to
+// RelayState_Tick once the value has been steady for a while.
+//
+// Params - relayValue - the value now on the relays
+// ---------------------------------------------------
+void RelayState_Update(relayValue_T relayValue)
+{
+    if (relayValue != currentValue) {
+        currentValue = relayValue;
+        dirty = true;
+        changedUs = esp_timer_get_time();
+    }
+    RtcSave();
+}
+
+// ---------------------------------------------------
+// Periodic housekeeping
+//
+// Keeps the RTC timestamp current, writes a changed relay value to NVS
+// once it has settled, and refreshes the NVS timestamp occasionally so
+// its age stays meaningful after a power cycle.
+// ---------------------------------------------------
+void RelayState_Tick(void)
+{
+    RtcSave();
+    int64_t now = time(NULL);
+    if (dirty && esp_timer_get_time() - changedUs >= (int64_t)RELAY_STATE_SAVE_DELAY_MS * 1000) {
+        NvsSave();
+    } else if (!dirty && now >= RELAY_STATE_VALID_TIME && now - nvsSavedTime >= RELAY_STATE_REFRESH_S) {
+        NvsSave();
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef __RELAYSTATE_H__
+#define __RELAYSTATE_H__
+
+#include "commonvalues.h"
+
+#define RELAY_STATE_NVS_NAMESPACE "relay"
+#define RELAY_STATE_NVS_KEY "value"     // Was "state" when the record held a single 8 bit relay code
+#define RELAY_STATE_SAVE_DELAY_MS 10000     // Relay value must be steady this long before it's written to NVS
+#define RELAY_STATE_REFRESH_S 600           // Rewrite the NVS timestamp at most this often while unchanged
+#define RELAY_STATE_VALID_TIME 1672531200   // 2023-01-01, anything earlier means the clock hasn't been set
+
+bool RelayState_Restore(relayValue_T* relayValue);
+void RelayState_SetLimits(uint32_t maxAgeS, bool allowUnknownAge);
+void RelayState_Update(relayValue_T relayValue);
+void RelayState_Tick(void);
+
+#endif // __RELAYSTATE_H__
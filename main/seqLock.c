@@ -0,0 +1,84 @@
+/* Sequence lock
+
+   Lets one task publish values that other tasks copy without taking a lock.
+   The writer fills the buffer readers aren't using, bumping the sequence
+   before and after, so it's odd while the write is in progress. A reader
+   copies the current buffer and retries if any write started or finished
+   while it was copying, as a second write would have gone into the buffer
+   it was reading. Readers never wait for the writer, so a reader that has
+   preempted the writer on the same core still gets the last complete values.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include "seqLock.h"
+
+// ---------------------------------------------------
+// Initialise a lock, with buffer 0 current and no writes
+// ---------------------------------------------------
+void SeqLock_Initialise(seqLock_T* lock)
+{
+    atomic_init(lock, 0);
+}
+
+// ---------------------------------------------------
+// Start a write
+//
+// Only one task may write through a lock.
+//
+// Params - lock - the lock
+// Returns- the buffer to write, 0 or 1
+// ---------------------------------------------------
+unsigned int SeqLock_WriteBegin(seqLock_T* lock)
+{
+    unsigned int seq = atomic_load_explicit(lock, memory_order_relaxed);
+    atomic_store_explicit(lock, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return SeqLock_Current(seq) ^ 1;
+}
+
+// ---------------------------------------------------
+// Finish a write, making the written buffer current
+// ---------------------------------------------------
+void SeqLock_WriteEnd(seqLock_T* lock)
+{
+    unsigned int seq = atomic_load_explicit(lock, memory_order_relaxed);
+    atomic_store_explicit(lock, seq + 1, memory_order_release);
+}
+
+// ---------------------------------------------------
+// Start a read
+//
+// Params - lock - the lock
+// Returns- the sequence, copy buffer SeqLock_Current() of it then call SeqLock_ReadRetry()
+// ---------------------------------------------------
+unsigned int SeqLock_ReadBegin(const seqLock_T* lock)
+{
+    return atomic_load_explicit(lock, memory_order_acquire);
+}
+
+// ---------------------------------------------------
+// Check whether a read has to be repeated
+//
+// Params - lock - the lock
+//        - seq - what SeqLock_ReadBegin() returned
+// Returns- true if a write started or finished during the read, so the copy may be torn
+// ---------------------------------------------------
+bool SeqLock_ReadRetry(const seqLock_T* lock, unsigned int seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(lock, memory_order_relaxed) != seq;
+}
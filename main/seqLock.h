@@ -0,0 +1,21 @@
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Sequence lock over a pair of buffers, written by one task and read by others without
+// blocking either side. The sequence is odd while a write is in progress, and
+// SeqLock_Current() gives the buffer holding the latest complete values.
+typedef atomic_uint seqLock_T;
+
+#define SeqLock_Current(seq) (((seq) >> 1) & 1)
+#define SeqLock_Updates(seq) ((seq) >> 1)       // Completed writes
+
+void SeqLock_Initialise(seqLock_T* lock);
+unsigned int SeqLock_WriteBegin(seqLock_T* lock);
+void SeqLock_WriteEnd(seqLock_T* lock);
+unsigned int SeqLock_ReadBegin(const seqLock_T* lock);
+bool SeqLock_ReadRetry(const seqLock_T* lock, unsigned int seq);
+
+#endif // __SEQLOCK_H__
@@ -0,0 +1,292 @@
+/* Latency and soak test mode
+
+   Built only with SOAK_TEST_ENABLE. A low priority task injects synthetic
+   homeassistant/Power messages and relay commands at fixed rates. They are
+   handed to the MQTT task as user events, so they go through the same
+   router and handlers as messages from the broker. Each injected message
+   opens a probe, and each stage of handling it is timed from the
+   injection: the MQTT task picking it up, the handler finishing, the
+   control task's decision, the relay GPIO write and the settled relay
+   state publish. Stamps from the control task are matched to the probe by
+   the arrival time of the event behind them.
+
+   Results are cumulative over the soak, as log-linear histograms (1/8
+   octave, so percentiles are within 12.5%) with exact maxima, along with
+   the minimum free heap and the tasks' stack high water marks. They're
+   published over MQTT and logged to the console periodically.
+
+   Power messages only drive the relays in auto mode with curtailment on,
+   and commands only in manual mode, so set the mode for the path under
+   test. Real messages arriving during a probe can be stamped against it.
+
+   Copyright 2023 Phillip C Dimond
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+#include "soakTest.h"
+
+#if SOAK_TEST_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_log.h"
+#include "commonvalues.h"
+#include "metrics.h"
+#include "mqttRouter.h"
+
+#define SOAK_TEST_RING_LEN 8                // Injected messages that can be waiting for the MQTT task
+#define SOAK_TEST_MESSAGE_LEN 320
+#define SOAK_TEST_SUB_BUCKETS 8             // Per octave
+#define SOAK_TEST_BUCKETS (32 * SOAK_TEST_SUB_BUCKETS)
+
+// Cumulative histogram of one stage's latency. Each is only written by one task.
+typedef struct {
+    uint32_t bucket[SOAK_TEST_BUCKETS];
+    uint32_t count;
+    uint32_t maxUs;
+} soakHistogram_T;
+
+typedef struct {
+    const char* topic;
+    char payload[SOAK_TEST_MESSAGE_LEN];
+    int64_t injectedUs;
+} soakMessage_T;
+
+static soakMessage_T ring[SOAK_TEST_RING_LEN];
+static int ringNext = 0;
+static soakHistogram_T histogram[SOAK_STAGE_COUNT];
+static atomic_uint_least32_t probeUs = 0;   // Low 32 bits of the open probe's injection time
+static atomic_uint probeDone = 0;           // Bit per stage already stamped for the open probe
+static uint32_t injected = 0;
+static char reports[2][SOAK_TEST_PAYLOAD_LEN];  // Alternate, so the one waiting to be published isn't overwritten
+static int reportNext = 0;
+
+static const char* powerTopic;
+static const char* const* commandTopics;
+static soakTestInject_T injectHook;
+static soakTestReport_T reportHook;
+static TaskHandle_t controlTaskHandle;
+static const char* stageNames[SOAK_STAGE_COUNT] = SOAK_STAGE_NAMES;
+
+// -----------------------------------------------
+// Histogram helpers
+// -----------------------------------------------
+static int BucketIndex(uint32_t us)
+{
+    if (us < SOAK_TEST_SUB_BUCKETS) { return us; }
+    int octave = 31 - __builtin_clz(us);
+    return octave * SOAK_TEST_SUB_BUCKETS + ((us >> (octave - 3)) & (SOAK_TEST_SUB_BUCKETS - 1));
+}
+
+static uint32_t BucketUpperUs(int index)
+{
+    if (index < SOAK_TEST_SUB_BUCKETS) { return index; }
+    int octave = index / SOAK_TEST_SUB_BUCKETS;
+    uint64_t upper = ((uint64_t)(SOAK_TEST_SUB_BUCKETS + index % SOAK_TEST_SUB_BUCKETS + 1) << (octave - 3)) - 1;
+    return (upper > UINT32_MAX) ? UINT32_MAX : (uint32_t)upper;
+}
+
+static void HistogramRecord(soakHistogram_T* h, uint32_t us)
+{
+    h->bucket[BucketIndex(us)]++;
+    h->count++;
+    if (us > h->maxUs) { h->maxUs = us; }
+}
+
+static uint32_t HistogramPercentile(const soakHistogram_T* h, uint32_t percent)
+{
+    if (h->count == 0) { return 0; }
+    uint64_t target = ((uint64_t)h->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < SOAK_TEST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= target) {
+            uint32_t upper = BucketUpperUs(i);
+            return (upper < h->maxUs) ? upper : h->maxUs;
+        }
+    }
+    return h->maxUs;
+}
+
+// -----------------------------------------------
+// Inject a message, opening a new probe
+// -----------------------------------------------
+static void Inject(const char* topic, int64_t nowUs)
+{
+    soakMessage_T* message = &ring[ringNext];
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_USER_EVENT,
+        .topic = (char*)topic,
+        .topic_len = strlen(topic),
+        .data = message->payload,
+        .data_len = strlen(message->payload),
+        .msg_id = ringNext,
+    };
+    event.total_data_len = event.data_len;
+    message->topic = topic;
+    message->injectedUs = nowUs;
+    ringNext = (ringNext + 1) % SOAK_TEST_RING_LEN;
+
+    atomic_store(&probeUs, (uint32_t)nowUs);
+    atomic_store(&probeDone, 0);
+    if (injectHook(&event)) { injected++; }
+}
+
+// -----------------------------------------------
+// A synthetic power message. The house load ramps up and down over ten
+// minutes against steady solar, so export comes and goes.
+// -----------------------------------------------
+static void FormatPower(char* payload, size_t len, int64_t nowUs)
+{
+    float phase = (float)((nowUs / 1000) % 600000) / 600000.0;
+    float housekW = 0.5 + 5.5 * ((phase < 0.5) ? 2.0 * phase : 2.0 * (1.0 - phase));
+    float solarkW = 6.0 + 0.1 * ((float)(esp_random() % 1000) / 1000.0 - 0.5);
+    snprintf(payload, len, "{\"importPrice\": 0.28, \"exportPrice\": -0.02, \"batteryLevel\": 100, \"powerValues\": ["
+        "{\"name\": \"House\", \"units\": \"kW\", \"value\": %0.3f}, {\"name\": \"Solar\", \"units\": \"kW\", \"value\": %0.3f}, "
+        "{\"name\": \"Battery\", \"units\": \"kW\", \"value\": 0.000}, {\"name\": \"Grid\", \"units\": \"kW\", \"value\": %0.3f}]}",
+        housekW, solarkW, housekW - solarkW);
+}
+
+// -----------------------------------------------
+// Format and send the results so far
+// -----------------------------------------------
+static void Report(void)
+{
+    char* payload = reports[reportNext];
+    size_t len = sizeof(reports[reportNext]);
+    int n = snprintf(payload, len, "{\"uptimeS\": %lld, \"injected\": %lu",
+        (long long)(esp_timer_get_time() / 1000000), (unsigned long)injected);
+    for (int stage = 0; stage < SOAK_STAGE_COUNT && n > 0 && n < len; stage++) {
+        const soakHistogram_T* h = &histogram[stage];
+        n += snprintf(&payload[n], len - n, ", \"%s\": {\"n\": %lu, \"p50\": %lu, \"p99\": %lu, \"max\": %lu}",
+            stageNames[stage], (unsigned long)h->count, (unsigned long)HistogramPercentile(h, 50),
+            (unsigned long)HistogramPercentile(h, 99), (unsigned long)h->maxUs);
+    }
+    if (n > 0 && n < len) {
+        n += snprintf(&payload[n], len - n,
+            ", \"minFreeHeap\": %lu, \"controlStackFree\": %lu, \"mqttStackFree\": %lu, \"soakStackFree\": %lu}",
+            (unsigned long)esp_get_minimum_free_heap_size(), (unsigned long)uxTaskGetStackHighWaterMark(controlTaskHandle),
+            (unsigned long)Metrics_MqttStackFree(), (unsigned long)uxTaskGetStackHighWaterMark(NULL));
+    }
+    if (n <= 0 || n >= len) {
+        ESP_LOGE(TAG, "Soak test report didn't fit in %u bytes.", (unsigned int)len);
+        return;
+    }
+    ESP_LOGI(TAG, "Soak test: %s", payload);
+    reportHook(payload);
+    reportNext ^= 1;
+}
+
+// -----------------------------------------------
+// Injects the synthetic messages and reports periodically
+// -----------------------------------------------
+static void SoakTask(void* pvParameters)
+{
+    int64_t nowUs = esp_timer_get_time();
+    int64_t nextPowerUs = nowUs;
+    int64_t nextCommandUs = nowUs;
+    int64_t nextReportUs = nowUs + (int64_t)SOAK_TEST_REPORT_PERIOD_MS * 1000;
+    int channel = 0;
+
+    while (true) {
+        nowUs = esp_timer_get_time();
+        if (SOAK_TEST_POWER_PERIOD_MS > 0 && nowUs >= nextPowerUs) {
+            FormatPower(ring[ringNext].payload, SOAK_TEST_MESSAGE_LEN, nowUs);
+            Inject(powerTopic, nowUs);
+            nextPowerUs += (int64_t)SOAK_TEST_POWER_PERIOD_MS * 1000;
+        } else if (SOAK_TEST_COMMAND_PERIOD_MS > 0 && nowUs >= nextCommandUs) {
+            snprintf(ring[ringNext].payload, SOAK_TEST_MESSAGE_LEN, "%lu", (unsigned long)(esp_random() % 16));
+            Inject(commandTopics[channel], nowUs);
+            channel = (channel + 1) % RELAY_CHANNELS;
+            nextCommandUs += (int64_t)SOAK_TEST_COMMAND_PERIOD_MS * 1000;
+        }
+        if (nowUs >= nextReportUs) {
+            Report();
+            nextReportUs += (int64_t)SOAK_TEST_REPORT_PERIOD_MS * 1000;
+        }
+
+        // Sleep until whatever is due next
+        int64_t nextUs = nextReportUs;
+        if (SOAK_TEST_POWER_PERIOD_MS > 0 && nextPowerUs < nextUs) { nextUs = nextPowerUs; }
+        if (SOAK_TEST_COMMAND_PERIOD_MS > 0 && nextCommandUs < nextUs) { nextUs = nextCommandUs; }
+        nowUs = esp_timer_get_time();
+        if (nextUs > nowUs) { vTaskDelay(pdMS_TO_TICKS((nextUs - nowUs) / 1000) + 1); }
+    }
+}
+
+// ---------------------------------------------------
+// Start the soak test
+//
+// Params - power - the power message topic
+//        - commands - each relay channel's command topic
+//        - inject - hands a message to the MQTT task, which then calls SoakTest_Handle
+//        - report - publishes a report
+//        - controlTask - the control task, for its stack high water mark
+// Returns- true if the test task started
+// ---------------------------------------------------
+bool SoakTest_Start(const char* power, const char* const* commands, soakTestInject_T inject, soakTestReport_T report, TaskHandle_t controlTask)
+{
+    powerTopic = power;
+    commandTopics = commands;
+    injectHook = inject;
+    reportHook = report;
+    controlTaskHandle = controlTask;
+    if (xTaskCreate(SoakTask, "soak", SOAK_TEST_TASK_STACK, NULL, SOAK_TEST_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Error starting the soak test task.");
+        return false;
+    }
+    ESP_LOGW(TAG, "Soak test running, power every %d ms, commands every %d ms.", SOAK_TEST_POWER_PERIOD_MS, SOAK_TEST_COMMAND_PERIOD_MS);
+    return true;
+}
+
+// ---------------------------------------------------
+// Handle an injected message in the MQTT task
+//
+// Params - event - the MQTT_USER_EVENT made by the soak task
+// ---------------------------------------------------
+void SoakTest_Handle(esp_mqtt_event_handle_t event)
+{
+    if (event->msg_id < 0 || event->msg_id >= SOAK_TEST_RING_LEN) { return; }
+    int64_t injectedUs = ring[event->msg_id].injectedUs;
+
+    // A message that waited behind a later one belongs to a closed probe, so isn't timed
+    bool current = (atomic_load(&probeUs) == (uint32_t)injectedUs);
+    if (current) { SoakTest_Mark(SOAK_STAGE_ARRIVAL, (uint32_t)esp_timer_get_time()); }
+    MqttRouter_Dispatch(event);
+    if (current) { SoakTest_Mark(SOAK_STAGE_HANDLED, (uint32_t)esp_timer_get_time()); }
+}
+
+// ---------------------------------------------------
+// Stamp a stage of handling the open probe
+//
+// Only the first stamp of each stage is taken, and only if the event
+// behind it arrived after the probe was injected.
+//
+// Params - stage - which stage was reached
+//        - eventUs - low 32 bits of esp_timer_get_time() when the event behind it arrived, 0 if unknown
+// ---------------------------------------------------
+void SoakTest_Mark(soakStage_T stage, uint32_t eventUs)
+{
+    uint32_t startUs = atomic_load(&probeUs);
+    if (eventUs == 0 || startUs == 0 || (int32_t)(eventUs - startUs) < 0) { return; }
+    if (atomic_fetch_or(&probeDone, 1U << stage) & (1U << stage)) { return; }
+    HistogramRecord(&histogram[stage], (uint32_t)esp_timer_get_time() - startUs);
+}
+
+#endif // SOAK_TEST_ENABLE
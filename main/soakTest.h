@@ -0,0 +1,46 @@
+#ifndef __SOAKTEST_H__
+#define __SOAKTEST_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+
+// Set to 1 to build the latency and soak test mode. It drives the relays from synthetic
+// messages, so it's for the bench only, never for firmware going onto a real system.
+#define SOAK_TEST_ENABLE 0
+
+#define SOAK_TEST_POWER_PERIOD_MS 1000      // Synthetic homeassistant/Power messages, 0 for none
+#define SOAK_TEST_COMMAND_PERIOD_MS 5000    // Synthetic relay commands, 0 for none
+#define SOAK_TEST_REPORT_PERIOD_MS 60000    // Results to MQTT and the console
+#define SOAK_TEST_TASK_STACK 4096
+#define SOAK_TEST_TASK_PRIORITY 3           // Below the MQTT and control tasks, so it doesn't disturb what it measures
+#define SOAK_TEST_PAYLOAD_LEN 640           // Report JSON
+
+// Stages of handling an injected message, each timed from when it was injected
+typedef enum {
+    SOAK_STAGE_ARRIVAL = 0,     // The MQTT task picked it up
+    SOAK_STAGE_HANDLED,         // Its handler decoded it and notified the control task
+    SOAK_STAGE_DECISION,        // The control task decided on a relay value
+    SOAK_STAGE_ACTUATION,       // The relay GPIOs were written
+    SOAK_STAGE_PUBLISH,         // The settled relay state was published
+    SOAK_STAGE_COUNT
+} soakStage_T;
+
+#define SOAK_STAGE_NAMES { "arrival", "handled", "decision", "actuation", "publish" }
+
+// Hands a synthetic message to the MQTT task, as though it had come from the broker
+typedef bool (*soakTestInject_T)(esp_mqtt_event_handle_t event);
+// Publishes a report. It stays valid until the next report but one, so it needn't be copied.
+typedef void (*soakTestReport_T)(const char* payload);
+
+#if SOAK_TEST_ENABLE
+bool SoakTest_Start(const char* powerTopic, const char* const* commandTopics, soakTestInject_T inject, soakTestReport_T report, TaskHandle_t controlTask);
+void SoakTest_Handle(esp_mqtt_event_handle_t event);
+void SoakTest_Mark(soakStage_T stage, uint32_t eventUs);
+#else
+#define SoakTest_Mark(stage, eventUs) ((void)(eventUs))
+#endif // SOAK_TEST_ENABLE
+
+#endif // __SOAKTEST_H__